@@ -0,0 +1,171 @@
+#include "usbpv.hpp"
+#include "usbpv_latency.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include <vector>
+#include <unistd.h>
+
+#define BENCH_BLOCK  (64*1024)
+
+// a high speed bulk IN stream: SOF, IN token, DATA0 with 512 bytes, ACK
+static void put_packet(std::vector<uint32_t>* words, uint32_t tick, const uint8_t* data, int len)
+{
+    uint8_t tmp[2 + 1024] = {(uint8_t)len, (uint8_t)(len >> 8)};
+    memcpy(tmp + 2, data, len);
+    // speed code 0 is high speed, see upv_speed_cvt
+    words->push_back(((tick & 0xffffff) << 8) | 0x60);
+    for(int i=0;i<len+2;i+=4){
+        uint32_t w;
+        memcpy(&w, tmp + i, 4);
+        words->push_back(w);
+    }
+}
+
+static void make_stream(std::vector<uint32_t>* words, int mbytes)
+{
+    uint8_t sof[3] = {0xA5, 0x12, 0x34};
+    uint8_t token[3] = {0x69, 0x05, 0x08};
+    uint8_t data[1 + 512 + 2] = {0xC3};
+    uint8_t ack[1] = {0xD2};
+    for(int i=1;i<(int)sizeof(data);i++){
+        data[i] = (uint8_t)i;
+    }
+    uint32_t tick = 0;
+    words->push_back(UPV_START_CMD);
+    while(words->size()*4 < (size_t)mbytes*1024*1024){
+        put_packet(words, tick += 7500, sof, 3);
+        for(int i=0;i<12;i++){
+            put_packet(words, tick += 20, token, 3);
+            put_packet(words, tick += 20, data, sizeof(data));
+            put_packet(words, tick += 600, ack, 1);
+        }
+    }
+}
+
+// what a handler typically reads of each packet
+struct bench_count{
+    uint64_t packets;
+    uint64_t bytes;
+    inline void operator()(const usbpv::packet_view& p){
+        packets++;
+        bytes += p.size() + p.pid();
+    }
+};
+
+static bench_count cb_count;
+static long UPV_CB bench_callback(void* context, unsigned long tick, const void* data, unsigned long len, long status)
+{
+    (void)context;
+    (void)tick;
+    (void)status;
+    cb_count.packets++;
+    cb_count.bytes += len + (len ? ((const uint8_t*)data)[0] : 0);
+    return 0;
+}
+
+static void report(const char* name, uint64_t ns, size_t bytes, int reps, const bench_count& c)
+{
+    double mb = (double)bytes * reps / (1024.0*1024.0);
+    printf("%-24s %8.1f MB/s %6.1f ns/packet  (%llu packets)\n", name, mb * 1e9 / ns,
+           (double)ns / c.packets, (unsigned long long)c.packets);
+}
+
+// test_usbpv_s -p N: parse a synthetic N MB stream, no device needed
+int parse_bench(int mbytes)
+{
+    if(mbytes <= 0){
+        mbytes = 64;
+    }
+    std::vector<uint32_t> words;
+    make_stream(&words, mbytes);
+    const uint8_t* p = (const uint8_t*)&words[0];
+    int total = (int)(words.size() * 4);
+    const int reps = 5;
+    printf("stream %d bytes, %d runs\n", total, reps);
+
+    // typed handler inlined into the parse loop, no upv_s
+    usbpv::parser<bench_count> parser(bench_count{0, 0});
+    uint64_t t0 = upv_now_ns();
+    for(int r=0;r<reps;r++){
+        parser.reset();
+        for(int off=0;off<total;off+=BENCH_BLOCK){
+            parser.feed(p + off, total - off < BENCH_BLOCK ? total - off : BENCH_BLOCK);
+        }
+    }
+    report("usbpv::parser<H>", upv_now_ns() - t0, total, reps, parser.handler());
+
+    // counters and hooks of upv_s, then the C callback
+    upv_s* upv = new upv_s();
+    upv->packet_handler = bench_callback;
+    t0 = upv_now_ns();
+    for(int r=0;r<reps;r++){
+        upv->data_state = 0;
+        for(int off=0;off<total;off+=BENCH_BLOCK){
+            upv->process_data(p + off, total - off < BENCH_BLOCK ? total - off : BENCH_BLOCK);
+        }
+    }
+    report("upv_s::process_data", upv_now_ns() - t0, total, reps, cb_count);
+
+    // counters and hooks of upv_s, then the typed handler as in usbpv::session
+    bench_count count = {0, 0};
+    usbpv::detail::emitter<bench_count> e = {&count};
+    upv_s_emitter<usbpv::detail::emitter<bench_count> > emit = {upv, &e};
+    t0 = upv_now_ns();
+    for(int r=0;r<reps;r++){
+        upv->data_state = 0;
+        for(int off=0;off<total;off+=BENCH_BLOCK){
+            upv_parse_data(*upv, p + off, total - off < BENCH_BLOCK ? total - off : BENCH_BLOCK, emit);
+        }
+    }
+    report("session hook chain", upv_now_ns() - t0, total, reps, count);
+    delete upv;
+    return 0;
+}
+
+static std::atomic<uint64_t> lat_packets(0);
+static long UPV_CB latency_callback(void* context, unsigned long tick, const void* data, unsigned long len, long status)
+{
+    (void)context; (void)tick; (void)data; (void)len; (void)status;
+    upv_stat_add(lat_packets, (uint64_t)1);
+    return 0;
+}
+
+// test_usbpv_s -l SN S: transfer buffer latency of the parser thread and the
+// inline mode, S seconds each, with the same transfer sizing in both
+int latency_bench(const char* sn, int seconds)
+{
+    static const char* modes[] = {"parser thread", "inline"};
+    if(seconds <= 0){
+        seconds = 5;
+    }
+    printf("%-14s %8s %10s %10s %10s %10s %10s\n", "mode", "blocks", "queue p50", "p99", "total p50", "p99", "max us");
+    for(int inl=0;inl<2;inl++){
+        upv_s upv;
+        upv_latency lat;
+        auto res = upv.open(sn, strlen(sn));
+        if(res != 0){
+            printf("fail to open %s, %d\n", sn, res);
+            return res;
+        }
+        upv.inline_parse = inl;
+        upv.latency_target_ms = 4;
+        upv.latency.store(&lat, std::memory_order_release);
+        lat_packets.store(0);
+        res = upv.start_capture(NULL, latency_callback);
+        if(res != 0){
+            printf("fail to start %s, %d\n", sn, res);
+            return res;
+        }
+        sleep(seconds);
+        upv.stop_capture(1000);
+        upv.latency.store(NULL, std::memory_order_release);
+        upv_latency_info_t q, t;
+        lat.queue.query(&q);
+        lat.total.query(&t);
+        printf("%-14s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f  (%llu packets)\n", modes[inl], (unsigned long long)t.count,
+               q.p50_ns/1000.0, q.p99_ns/1000.0, t.p50_ns/1000.0, t.p99_ns/1000.0, t.max_ns/1000.0,
+               (unsigned long long)lat_packets.load());
+        upv.close();
+    }
+    return 0;
+}
@@ -1,18 +1,42 @@
 #include "usbpv_s.h"
 #include "stdio.h"
+#include "stdlib.h"
 
 FILE* fp_data = NULL;
 
 long UPV_CB on_packet(void* context, unsigned long tick_60MHz, const void* data, unsigned long len, long status);
+int open_bench(const char* sn, int count);
+int store_test();
+int fanout_test();
+int parse_bench(int mbytes);
+int latency_bench(const char* sn, int seconds);
 int main(int argc, char* argv[])
 {
-    (void)argc;
-    (void)argv;
+    // test_usbpv_s -t: offline checks
+    if(argc > 1 && strcmp(argv[1], "-t") == 0){
+        int r = store_test();
+        return fanout_test() | r;
+    }
+    // test_usbpv_s -p N: parser throughput on N MB of synthetic stream
+    if(argc > 1 && strcmp(argv[1], "-p") == 0){
+        return parse_bench(argc > 2 ? atoi(argv[2]) : 0);
+    }
     auto devs = upv_s::list_devices();
     printf("There are %d devices\n", devs.size());
     for(auto it = devs.begin(); it!=devs.end(); it++){
         printf("%s\n", it->c_str());
     }
+    // test_usbpv_s -l S [SN]: transfer latency of both parse modes, S seconds each,
+    // a given SN is opened even when not listed, such as the analyzer of make sim
+    if(argc > 2 && strcmp(argv[1], "-l") == 0){
+        const char* sn = argc > 3 ? argv[3] : devs.size() > 0 ? devs.begin()->c_str() : NULL;
+        return sn ? latency_bench(sn, atoi(argv[2])) : 0;
+    }
+    // test_usbpv_s -b N [SN]: open and close the analyzer N times
+    if(argc > 2 && strcmp(argv[1], "-b") == 0){
+        const char* sn = argc > 3 ? argv[3] : devs.size() > 0 ? devs.begin()->c_str() : NULL;
+        return sn ? open_bench(sn, atoi(argv[2])) : 0;
+    }
     if(devs.size() < 1){
         return 0;
     }
@@ -45,6 +69,7 @@ int main(int argc, char* argv[])
     fp_data = fopen("test.bin", "wb+");
 
     upv.start_capture(NULL, on_packet);
+    upv.set_stats_print(1000);
 
     printf("press any key to quit\n");
     getchar();
@@ -64,6 +89,43 @@ int main(int argc, char* argv[])
     return 0;
 }
 
+// time of each open step, the first open usually uploads the image and later ones skip it
+// without an analyzer: make sim && ./obj/test_usbpv_sim -b 20 SIM00001
+int open_bench(const char* sn, int count)
+{
+    static const char* names[] = {"init", "usb_open", " match", "check", "reset", "load", "start", "config", " drain", "total"};
+    const int steps = sizeof(names)/sizeof(names[0]);
+    uint64_t sum[steps] = {0};
+    uint64_t max[steps] = {0};
+    int skipped = 0;
+    int polls = 0;
+    upv_s upv;
+    for(int i=0;i<count;i++){
+        auto res = upv.open(sn, strlen(sn));
+        if(res != 0){
+            printf("open %d of %s fail %d\n", i, sn, res);
+            return res;
+        }
+        upv_open_times& o = upv.open_times;
+        uint64_t v[] = {o.init_ns, o.usb_open_ns, o.match_ns, o.check_ns, o.reset_ns, o.load_ns, o.start_ns, o.config_ns, o.drain_ns, o.total_ns};
+        for(int k=0;k<steps;k++){
+            sum[k] += v[k];
+            if(v[k] > max[k]){
+                max[k] = v[k];
+            }
+        }
+        skipped += o.load_skipped;
+        polls += o.status_polls;
+        upv.close();
+    }
+    printf("%d opens, %d skipped the load, %.1f status reads per open\n", count, skipped, count ? (double)polls/count : 0.0);
+    printf("%-10s %10s %10s\n", "step", "avg us", "max us");
+    for(int k=0;k<steps && count>0;k++){
+        printf("%-10s %10llu %10llu\n", names[k], (unsigned long long)(sum[k]/count/1000), (unsigned long long)(max[k]/1000));
+    }
+    return 0;
+}
+
 int usbpv_record_data_unused(const uint8_t* data, int len)
 {
     if(fp_data){
@@ -0,0 +1,584 @@
+#include "usbpv_s.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include <stddef.h>
+#include <deque>
+#include <list>
+#include <unistd.h>
+
+/*
+ * Simulated analyzer linked in place of libusb by "make sim"
+ * One analyzer with serial UPV_SIM_SERIAL is behind the libusb calls of
+ * usbpv_util.cpp and upv_s. It answers the vendor requests, takes the image
+ * upload, echoes register writes and sends the capture word stream between
+ * the start and stop commands, with the delays below. The open steps, the
+ * capture threads and the parser run unchanged, so open and latency numbers
+ * can be compared between builds without an analyzer. The delays are rough
+ * figures for a high speed link, not measured on a device.
+ */
+
+#define UPV_SIM_SERIAL      "SIM00001"
+#define UPV_SIM_OPEN_US     1000    // device open and claim
+#define UPV_SIM_DESC_US     125     // one descriptor read
+#define UPV_SIM_CTRL_US     250     // one vendor request
+#define UPV_SIM_RESET_US    2000    // FPGA reset before the load
+#define UPV_SIM_OUT_RATE    35      // bulk OUT bytes per us
+#define UPV_SIM_RATE        4000    // capture stream bytes per ms
+
+// vendor requests of usbpv_util.cpp
+#define SIM_REQ_RESET   0x73
+#define SIM_REQ_START   0x74
+#define SIM_REQ_STATUS  0x75
+
+struct libusb_device{
+    libusb_context* ctx;
+};
+
+struct libusb_context{
+    libusb_device dev;
+    pthread_mutex_t events;     // one thread handles events at a time
+    volatile int interrupted;
+};
+
+struct libusb_device_handle{
+    libusb_context* ctx;
+};
+
+// the libusb_transfer is last, it ends with the iso packet array
+struct sim_transfer{
+    uint64_t submit_ns;
+    uint64_t done_ns;           // OUT transfers complete at this time
+    int cancelled;
+    struct libusb_transfer t;
+};
+
+struct sim_device{
+    int loaded;                 // image loaded since power on
+    int loading;                // reset done, OUT data is the image
+    int image_bytes;
+    int streaming;
+    uint64_t stream_ns;
+    uint64_t produced;          // stream bytes since the start command
+    int phase;                  // position in the traffic pattern
+    uint64_t out_busy_ns;       // bulk OUT pipe busy until
+    std::deque<uint32_t> fifo;  // words the device has to send
+    std::list<sim_transfer*> pending;
+};
+
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sim_cond;
+static pthread_once_t sim_once = PTHREAD_ONCE_INIT;
+static sim_device sim;
+static libusb_context* sim_default_ctx;
+
+static void sim_init()
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sim_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// sim_mutex is held
+static void sim_wait(uint64_t until_ns)
+{
+    struct timespec ts;
+    ts.tv_sec = until_ns / 1000000000ull;
+    ts.tv_nsec = until_ns % 1000000000ull;
+    pthread_cond_timedwait(&sim_cond, &sim_mutex, &ts);
+}
+
+static inline sim_transfer* sim_of(struct libusb_transfer* t)
+{
+    return (sim_transfer*)((char*)t - offsetof(sim_transfer, t));
+}
+
+static void sim_put_packet(uint32_t tick, const uint8_t* data, int len)
+{
+    // odd length packets carry the device FIFO room after the data, 255 is empty
+    uint8_t tmp[2 + 520];
+    memset(tmp, 0xff, sizeof(tmp));
+    tmp[0] = (uint8_t)len;
+    tmp[1] = (uint8_t)(len >> 8);
+    memcpy(tmp + 2, data, len);
+    // speed code 0 is high speed
+    sim.fifo.push_back(((tick & 0xffffff) << 8) | 0x60);
+    int n = (len + 2 + 3) / 4;
+    for(int i=0;i<n;i++){
+        uint32_t w;
+        memcpy(&w, tmp + i*4, 4);
+        sim.fifo.push_back(w);
+    }
+    sim.produced += 4 + n*4;
+}
+
+// stream up to now: a SOF then bulk IN transactions of 512 bytes
+static void sim_produce(uint64_t now)
+{
+    static const uint8_t sof[3] = {0xA5, 0x00, 0x10};
+    static const uint8_t token[3] = {0x69, 0x05, 0x08};
+    static const uint8_t ack[1] = {0xD2};
+    static uint8_t data[1 + 512 + 2];
+    if(!sim.streaming){
+        return;
+    }
+    uint64_t target = (now - sim.stream_ns) * UPV_SIM_RATE / 1000000;
+    while(sim.produced < target){
+        // 60MHz tick of the bus time this packet is sent at
+        uint32_t tick = (uint32_t)(sim.produced * 60000 / UPV_SIM_RATE);
+        if(sim.phase == 0){
+            sim_put_packet(tick, sof, 3);
+        }else if(sim.phase % 3 == 1){
+            sim_put_packet(tick, token, 3);
+        }else if(sim.phase % 3 == 2){
+            data[0] = (sim.phase & 4) ? 0x4B : 0xC3;
+            data[1] = (uint8_t)sim.phase;
+            sim_put_packet(tick, data, sizeof(data));
+        }else{
+            sim_put_packet(tick, ack, 1);
+        }
+        sim.phase = (sim.phase + 1) % 37;
+    }
+}
+
+// command and register words written to the bulk OUT endpoint
+static void sim_write(const uint8_t* buf, int len)
+{
+    uint64_t now = upv_now_ns();
+    if(sim.loading){
+        sim.image_bytes += len;
+        return;
+    }
+    for(int i=0;i+4<=len;i+=4){
+        uint32_t w;
+        memcpy(&w, buf + i, 4);
+        if(w == UPV_START_CMD){
+            if(!sim.streaming){
+                sim.fifo.push_back(w);
+                sim.streaming = 1;
+                sim.stream_ns = now;
+                sim.produced = 0;
+            }
+        }else if(w == UPV_STOP_CMD){
+            // the stop goes after the buffered data
+            if(sim.streaming){
+                sim_produce(now);
+                sim.fifo.push_back(w);
+                sim.streaming = 0;
+            }
+        }else if((w & 0xff) == 0x55){
+            sim.fifo.push_back(w);
+        }
+    }
+    pthread_cond_broadcast(&sim_cond);
+}
+
+// while streaming the device sends full transfers, otherwise what it has
+static int sim_read(uint8_t* buf, int len, int timed_out)
+{
+    int n = (int)sim.fifo.size();
+    if(n*4 < len && sim.streaming && !timed_out){
+        return -1;
+    }
+    if(n > len/4){
+        n = len/4;
+    }
+    for(int i=0;i<n;i++){
+        uint32_t w = sim.fifo.front();
+        sim.fifo.pop_front();
+        memcpy(buf + i*4, &w, 4);
+    }
+    return n*4;
+}
+
+// the first transfer of ctx that is done at now, wake gets the next time one may be
+static sim_transfer* sim_ready(libusb_context* ctx, uint64_t now, uint64_t* wake)
+{
+    int in_seen = 0;
+    sim_produce(now);
+    for(std::list<sim_transfer*>::iterator it = sim.pending.begin(); it != sim.pending.end(); ++it){
+        sim_transfer* st = *it;
+        struct libusb_transfer* t = &st->t;
+        if(t->dev_handle->ctx != ctx){
+            continue;
+        }
+        uint64_t timeout_ns = t->timeout ? st->submit_ns + t->timeout*1000000ull : ~0ull;
+        if(st->cancelled){
+            t->status = LIBUSB_TRANSFER_CANCELLED;
+            t->actual_length = 0;
+        }else if((t->endpoint & LIBUSB_ENDPOINT_IN) == 0){
+            if(now < st->done_ns){
+                if(st->done_ns < *wake){
+                    *wake = st->done_ns;
+                }
+                continue;
+            }
+            sim_write(t->buffer, t->length);
+            t->status = LIBUSB_TRANSFER_COMPLETED;
+            t->actual_length = t->length;
+        }else{
+            // IN data goes to the oldest IN transfer
+            if(in_seen++){
+                continue;
+            }
+            int r = sim_read(t->buffer, t->length, now >= timeout_ns);
+            if(r < 0 || (r == 0 && now < timeout_ns)){
+                if(timeout_ns < *wake){
+                    *wake = timeout_ns;
+                }
+                if(sim.streaming){
+                    uint64_t need = t->length - sim.fifo.size()*4;
+                    uint64_t at = now + need * 1000000 / UPV_SIM_RATE;
+                    if(at < *wake){
+                        *wake = at;
+                    }
+                }
+                continue;
+            }
+            t->status = r < t->length && now >= timeout_ns ? LIBUSB_TRANSFER_TIMED_OUT : LIBUSB_TRANSFER_COMPLETED;
+            t->actual_length = r;
+        }
+        sim.pending.erase(it);
+        return st;
+    }
+    return NULL;
+}
+
+// runs the callback of one done transfer, or waits for one up to timeout_ns
+static int sim_handle_events(libusb_context* ctx, uint64_t timeout_ns, int* completed)
+{
+    if(ctx == NULL){
+        ctx = sim_default_ctx;
+    }
+    uint64_t end_ns = upv_now_ns() + timeout_ns;
+    pthread_mutex_lock(&ctx->events);
+    pthread_mutex_lock(&sim_mutex);
+    for(;;){
+        if(ctx->interrupted){
+            ctx->interrupted = 0;
+            break;
+        }
+        if(completed && *completed){
+            break;
+        }
+        uint64_t now = upv_now_ns();
+        uint64_t wake = end_ns;
+        sim_transfer* st = sim_ready(ctx, now, &wake);
+        if(st){
+            pthread_mutex_unlock(&sim_mutex);
+            st->t.callback(&st->t);
+            pthread_mutex_unlock(&ctx->events);
+            return 0;
+        }
+        if(now >= end_ns){
+            break;
+        }
+        sim_wait(wake);
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    pthread_mutex_unlock(&ctx->events);
+    return 0;
+}
+
+extern "C" {
+
+int LIBUSB_CALL libusb_init(libusb_context** ctx)
+{
+    pthread_once(&sim_once, sim_init);
+    libusb_context* c = new libusb_context();
+    c->dev.ctx = c;
+    pthread_mutex_init(&c->events, NULL);
+    c->interrupted = 0;
+    if(ctx){
+        *ctx = c;
+    }else{
+        sim_default_ctx = c;
+    }
+    return 0;
+}
+
+void LIBUSB_CALL libusb_exit(libusb_context* ctx)
+{
+    if(ctx == NULL){
+        ctx = sim_default_ctx;
+        sim_default_ctx = NULL;
+    }
+    if(ctx){
+        pthread_mutex_destroy(&ctx->events);
+        delete ctx;
+    }
+}
+
+int LIBUSB_CALL libusb_has_capability(uint32_t capability)
+{
+    (void)capability;
+    return 0;
+}
+
+int LIBUSB_CALL libusb_hotplug_register_callback(libusb_context* ctx, libusb_hotplug_event events, libusb_hotplug_flag flags,
+        int vendor_id, int product_id, int dev_class, libusb_hotplug_callback_fn cb_fn, void* user_data,
+        libusb_hotplug_callback_handle* handle)
+{
+    (void)ctx; (void)events; (void)flags; (void)vendor_id; (void)product_id;
+    (void)dev_class; (void)cb_fn; (void)user_data; (void)handle;
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void LIBUSB_CALL libusb_hotplug_deregister_callback(libusb_context* ctx, libusb_hotplug_callback_handle handle)
+{
+    (void)ctx;
+    (void)handle;
+}
+
+ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context* ctx, libusb_device*** list)
+{
+    if(ctx == NULL){
+        ctx = sim_default_ctx;
+    }
+    usleep(UPV_SIM_DESC_US);
+    libusb_device** devs = (libusb_device**)calloc(2, sizeof(libusb_device*));
+    devs[0] = &ctx->dev;
+    *list = devs;
+    return 1;
+}
+
+void LIBUSB_CALL libusb_free_device_list(libusb_device** list, int unref_devices)
+{
+    (void)unref_devices;
+    free(list);
+}
+
+int LIBUSB_CALL libusb_get_device_descriptor(libusb_device* dev, struct libusb_device_descriptor* desc)
+{
+    (void)dev;
+    memset(desc, 0, sizeof(*desc));
+    desc->bLength = LIBUSB_DT_DEVICE_SIZE;
+    desc->bDescriptorType = LIBUSB_DT_DEVICE;
+    desc->bcdUSB = 0x0200;
+    desc->bMaxPacketSize0 = 64;
+    desc->idVendor = UPV_VID;
+    desc->idProduct = UPV_PID;
+    desc->iManufacturer = 1;
+    desc->iProduct = 2;
+    desc->iSerialNumber = 3;
+    desc->bNumConfigurations = 1;
+    return 0;
+}
+
+int LIBUSB_CALL libusb_get_config_descriptor(libusb_device* dev, uint8_t config_index, struct libusb_config_descriptor** config)
+{
+    static struct libusb_config_descriptor cfg;
+    (void)dev;
+    (void)config_index;
+    cfg.bLength = LIBUSB_DT_CONFIG_SIZE;
+    cfg.bDescriptorType = LIBUSB_DT_CONFIG;
+    cfg.bNumInterfaces = 1;
+    cfg.bConfigurationValue = 1;
+    *config = &cfg;
+    return 0;
+}
+
+void LIBUSB_CALL libusb_free_config_descriptor(struct libusb_config_descriptor* config)
+{
+    (void)config;
+}
+
+int LIBUSB_CALL libusb_open(libusb_device* dev, libusb_device_handle** dev_handle)
+{
+    usleep(UPV_SIM_OPEN_US);
+    libusb_device_handle* h = new libusb_device_handle();
+    h->ctx = dev->ctx;
+    *dev_handle = h;
+    return 0;
+}
+
+void LIBUSB_CALL libusb_close(libusb_device_handle* dev_handle)
+{
+    delete dev_handle;
+}
+
+libusb_device* LIBUSB_CALL libusb_get_device(libusb_device_handle* dev_handle)
+{
+    return &dev_handle->ctx->dev;
+}
+
+int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle* dev_handle, uint8_t desc_index, unsigned char* data, int length)
+{
+    (void)dev_handle;
+    const char* s = desc_index == 1 ? UPV_MAN : desc_index == 2 ? "USB Packet Viewer" : desc_index == 3 ? UPV_SIM_SERIAL : NULL;
+    if(s == NULL || length <= 0){
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    usleep(UPV_SIM_DESC_US);
+    snprintf((char*)data, length, "%s", s);
+    return (int)strlen((char*)data);
+}
+
+int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle* dev_handle, int interface_number)
+{
+    (void)dev_handle;
+    (void)interface_number;
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_get_configuration(libusb_device_handle* dev_handle, int* config)
+{
+    (void)dev_handle;
+    *config = 1;
+    return 0;
+}
+
+int LIBUSB_CALL libusb_set_configuration(libusb_device_handle* dev_handle, int configuration)
+{
+    (void)dev_handle;
+    (void)configuration;
+    return 0;
+}
+
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle* dev_handle, int interface_number)
+{
+    (void)dev_handle;
+    (void)interface_number;
+    return 0;
+}
+
+int LIBUSB_CALL libusb_control_transfer(libusb_device_handle* dev_handle, uint8_t request_type, uint8_t bRequest,
+        uint16_t wValue, uint16_t wIndex, unsigned char* data, uint16_t wLength, unsigned int timeout)
+{
+    (void)dev_handle; (void)request_type; (void)wValue; (void)wIndex; (void)timeout;
+    usleep(bRequest == SIM_REQ_RESET ? UPV_SIM_CTRL_US + UPV_SIM_RESET_US : UPV_SIM_CTRL_US);
+    pthread_mutex_lock(&sim_mutex);
+    int r = 0;
+    if(bRequest == SIM_REQ_STATUS && wLength >= 2){
+        // the load ends with the first status read after image data
+        if(sim.loading && sim.image_bytes > 0){
+            sim.loading = 0;
+            sim.loaded = 1;
+        }
+        uint16_t status = sim.loaded ? 3 : sim.loading ? 0 : 0x10;
+        memcpy(data, &status, 2);
+        r = 2;
+    }else if(bRequest == SIM_REQ_RESET){
+        sim.loaded = 0;
+        sim.loading = 1;
+        sim.image_bytes = 0;
+        sim.streaming = 0;
+        sim.fifo.clear();
+    }else if(bRequest != SIM_REQ_START){
+        r = LIBUSB_ERROR_PIPE;
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return r;
+}
+
+int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle* dev_handle, unsigned char endpoint, unsigned char* data,
+        int length, int* actual_length, unsigned int timeout)
+{
+    (void)dev_handle;
+    *actual_length = 0;
+    if((endpoint & LIBUSB_ENDPOINT_IN) == 0){
+        usleep(length / UPV_SIM_OUT_RATE + 1);
+        pthread_mutex_lock(&sim_mutex);
+        sim_write(data, length);
+        pthread_mutex_unlock(&sim_mutex);
+        *actual_length = length;
+        return 0;
+    }
+    uint64_t end_ns = upv_now_ns() + (timeout ? timeout*1000000ull : ~0ull/2);
+    pthread_mutex_lock(&sim_mutex);
+    for(;;){
+        uint64_t now = upv_now_ns();
+        sim_produce(now);
+        int r = sim_read(data, length, now >= end_ns);
+        if(r > 0 || now >= end_ns){
+            pthread_mutex_unlock(&sim_mutex);
+            *actual_length = r > 0 ? r : 0;
+            return r > 0 ? 0 : LIBUSB_ERROR_TIMEOUT;
+        }
+        uint64_t wake = now + 1000000;
+        sim_wait(wake < end_ns ? wake : end_ns);
+    }
+}
+
+struct libusb_transfer* LIBUSB_CALL libusb_alloc_transfer(int iso_packets)
+{
+    sim_transfer* st = (sim_transfer*)calloc(1, sizeof(sim_transfer) + iso_packets*sizeof(struct libusb_iso_packet_descriptor));
+    if(st == NULL){
+        return NULL;
+    }
+    st->t.num_iso_packets = iso_packets;
+    return &st->t;
+}
+
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer* transfer)
+{
+    if(transfer){
+        free(sim_of(transfer));
+    }
+}
+
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer* transfer)
+{
+    sim_transfer* st = sim_of(transfer);
+    uint64_t now = upv_now_ns();
+    pthread_mutex_lock(&sim_mutex);
+    for(std::list<sim_transfer*>::iterator it = sim.pending.begin(); it != sim.pending.end(); ++it){
+        if(*it == st){
+            pthread_mutex_unlock(&sim_mutex);
+            return LIBUSB_ERROR_BUSY;
+        }
+    }
+    st->submit_ns = now;
+    st->cancelled = 0;
+    if((transfer->endpoint & LIBUSB_ENDPOINT_IN) == 0){
+        // OUT transfers go over the bus one after another
+        uint64_t begin = sim.out_busy_ns > now ? sim.out_busy_ns : now;
+        st->done_ns = begin + (uint64_t)transfer->length * 1000 / UPV_SIM_OUT_RATE;
+        sim.out_busy_ns = st->done_ns;
+    }
+    sim.pending.push_back(st);
+    pthread_cond_broadcast(&sim_cond);
+    pthread_mutex_unlock(&sim_mutex);
+    return 0;
+}
+
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer* transfer)
+{
+    sim_transfer* st = sim_of(transfer);
+    int r = LIBUSB_ERROR_NOT_FOUND;
+    pthread_mutex_lock(&sim_mutex);
+    for(std::list<sim_transfer*>::iterator it = sim.pending.begin(); it != sim.pending.end(); ++it){
+        if(*it == st){
+            st->cancelled = 1;
+            r = 0;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&sim_cond);
+    pthread_mutex_unlock(&sim_mutex);
+    return r;
+}
+
+int LIBUSB_CALL libusb_handle_events_completed(libusb_context* ctx, int* completed)
+{
+    return sim_handle_events(ctx, 60000000000ull, completed);
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context* ctx, struct timeval* tv, int* completed)
+{
+    return sim_handle_events(ctx, tv->tv_sec*1000000000ull + tv->tv_usec*1000ull, completed);
+}
+
+void LIBUSB_CALL libusb_interrupt_event_handler(libusb_context* ctx)
+{
+    if(ctx == NULL){
+        ctx = sim_default_ctx;
+    }
+    pthread_mutex_lock(&sim_mutex);
+    ctx->interrupted = 1;
+    pthread_cond_broadcast(&sim_cond);
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+}
@@ -0,0 +1,172 @@
+#include "usbpv_store.h"
+#include "usbpv_index.h"
+#include "usbpv_search.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include <unistd.h>
+
+static int failed = 0;
+
+#define CHECK(cond) do{ \
+    if(!(cond)){ \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failed++; \
+    } \
+}while(0)
+
+// IN token and DATA0 packet pairs, the DATA0 payload holds 55 AA every 7th pair
+static void fill_store(upv_packet_store* store, std::vector<uint64_t>* ticks, int pairs, uint64_t step, uint64_t* tick)
+{
+    for(int i=0;i<pairs;i++){
+        uint8_t token[3] = {UPV_PID_IN, 0x05, 0x01};
+        uint8_t data[16] = {UPV_PID_DATA0, 0};
+        int len = 3 + i % 9;
+        if(i % 7 == 0){
+            data[1] = 0x55;
+            data[2] = 0xAA;
+        }
+        *tick += step;
+        store->append((uint32_t)(*tick & 0xffffff), token, 3, 0);
+        ticks->push_back(*tick);
+        *tick += step;
+        store->append((uint32_t)(*tick & 0xffffff), data, len, 0);
+        ticks->push_back(*tick);
+    }
+}
+
+// the store must keep exact ticks when a chunk spans more than 32 bit of ticks
+static void test_tick_wrap()
+{
+    upv_packet_store* store = new upv_packet_store();
+    std::vector<uint64_t> ticks;
+    uint64_t tick = 0;
+    // about 4 minutes of an idle bus, tick_delta would overflow every 273 packets
+    fill_store(store, &ticks, 500, 0xf00000, &tick);
+    // then a busy bus filling several chunks
+    fill_store(store, &ticks, 6000, 100, &tick);
+    uint64_t n = store->count();
+    CHECK(n == ticks.size());
+    CHECK(store->chunk_count.load() > 4);
+    CHECK(ticks[n-1] > 0x100000000ull);
+
+    for(uint64_t i=0;i<n;i++){
+        if(store->tick_at(i) != ticks[i]){
+            printf("tick of packet %llu is %llu, not %llu\n", (unsigned long long)i,
+                   (unsigned long long)store->tick_at(i), (unsigned long long)ticks[i]);
+            failed++;
+            break;
+        }
+    }
+    uint64_t walked = 0;
+    int order = 1;
+    store->for_each(0, n, [&](uint64_t pos, const upv_stored_packet_t& p){
+        if(pos != walked || p.tick != ticks[pos]){
+            order = 0;
+        }
+        walked++;
+    });
+    CHECK(order);
+    CHECK(walked == n);
+
+    // tick ranges across the chunk splits
+    uint64_t first, last;
+    store->slice(ticks[100], ticks[900], &first, &last);
+    CHECK(first == 100 && last == 900);
+    store->slice(ticks[100] + 1, ticks[900] + 1, &first, &last);
+    CHECK(first == 101 && last == 901);
+    store->slice(ticks[n-10], ~0ull, &first, &last);
+    CHECK(first == n-10 && last == n);
+    store->slice(0, ticks[0], &first, &last);
+    CHECK(first == 0 && last == 0);
+
+    upv_packet_index index(store);
+    CHECK(index.sync() == n);
+    CHECK(index.position_of(ticks[600]) == 600);
+    CHECK(index.position_of(ticks[600] + 1) == 601);
+    upv_index_query_t q;
+    upv_packet_index::init_query(&q);
+    q.pid = UPV_PID_DATA0 & 0x0f;
+    q.tick_begin = ticks[200];
+    q.tick_end = ticks[400];
+    std::vector<uint64_t> pos;
+    CHECK(index.query(q, &pos) == 100);
+    CHECK(pos.size() == 100 && pos[0] == 201 && pos[99] == 399);
+
+    upv_matcher matcher;
+    uint8_t pattern[2] = {0x55, 0xAA};
+    CHECK(matcher.add(pattern, NULL, 2) == 0);
+    std::vector<upv_search_hit_t> hits;
+    uint64_t found = upv_search_store(store, matcher, 0, n, 4, &hits);
+    CHECK(found == (500 + 6) / 7 + (6000 + 6) / 7);
+    CHECK(hits.size() == found);
+    CHECK(hits.size() > 72 && hits[71].position == 71*14 + 1 && hits[72].position == 1001);
+    CHECK(hits.size() > 72 && hits[72].tick == ticks[1001]);
+    delete store;
+}
+
+// one packet in the device stream format, header then length and bytes
+static void put_packet(std::vector<uint32_t>* words, uint32_t tick, const uint8_t* data, int len)
+{
+    uint8_t tmp[2 + 64] = {(uint8_t)len, (uint8_t)(len >> 8)};
+    memcpy(tmp + 2, data, len);
+    words->push_back((tick << 8) | 0x60 | UPV_SPD_HIGH);
+    for(int i=0;i<len+2;i+=4){
+        uint32_t w;
+        memcpy(&w, tmp + i, 4);
+        words->push_back(w);
+    }
+}
+
+// the same packets searched in a recorded stream and in the store
+static void test_search_file()
+{
+    std::vector<uint32_t> words;
+    words.push_back(UPV_START_CMD);
+    upv_packet_store* store = new upv_packet_store();
+    for(int i=0;i<3000;i++){
+        uint8_t data[16] = {UPV_PID_DATA1, (uint8_t)i, 0x12, 0x34, (uint8_t)(i >> 8)};
+        int len = 5 + i % 11;
+        if(i % 5 == 0){
+            data[4] = 0x56;
+        }
+        put_packet(&words, (uint32_t)(i * 977) & 0xffffff, data, len);
+        store->append((uint32_t)(i * 977) & 0xffffff, data, len, 0);
+    }
+    words.push_back(UPV_STOP_CMD);
+    char path[] = "/tmp/test_usbpv_XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    if(fd < 0){
+        delete store;
+        return;
+    }
+    CHECK(write(fd, &words[0], words.size()*4) == (ssize_t)(words.size()*4));
+    close(fd);
+
+    upv_matcher matcher;
+    uint8_t pattern[3] = {0x12, 0x34, 0x56};
+    matcher.add(pattern, NULL, 3);
+    std::vector<upv_search_hit_t> file_hits;
+    std::vector<upv_search_hit_t> store_hits;
+    int64_t found = upv_search_file(path, matcher, &file_hits);
+    unlink(path);
+    CHECK(found == 600);
+    CHECK(upv_search_store(store, matcher, 0, store->count(), 2, &store_hits) == 600);
+    int same = file_hits.size() == store_hits.size();
+    for(size_t i=0;same && i<file_hits.size();i++){
+        same = file_hits[i].position == store_hits[i].position && file_hits[i].tick == store_hits[i].tick
+            && file_hits[i].offset == 2;
+    }
+    CHECK(same);
+    delete store;
+}
+
+// test_usbpv_s -t: checks of the store, index and search, no device needed
+int store_test()
+{
+    failed = 0;
+    test_tick_wrap();
+    test_search_file();
+    printf("store test %s, %d failed\n", failed ? "FAIL" : "ok", failed);
+    return failed ? 1 : 0;
+}
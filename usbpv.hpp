@@ -0,0 +1,239 @@
+#ifndef __USBPV_HPP__
+#define __USBPV_HPP__
+
+#include "usbpv_s.h"
+#include "usbpv_emit.h"
+#include <memory>
+#include <utility>
+
+/**
+ * Header only C++ interface
+ * The packet handler is a template parameter, the stream parser is
+ * instantiated for it so the handler call inlines into the parse loop
+ * instead of going through pfnt_on_packet and a void* context.
+ *
+ *   auto s = usbpv::session<my_handler>::open(sn, strlen(sn), my_handler());
+ *   if(s && s.start() == upv_s::R_Success){ ... }
+ */
+namespace usbpv {
+
+enum class speed {
+    unknown = UPV_SPD_Unknown,
+    low = UPV_SPD_LOW,
+    full = UPV_SPD_FULL,
+    high = UPV_SPD_HIGH,
+};
+
+enum class packet_type {
+    data = UPV_DATA_PACKET,
+    reset_begin = UPV_RESET_BEGIN,
+    reset_end = UPV_RESET_END,
+    suspend_begin = UPV_SUSPEND_BEGIN,
+    suspend_end = UPV_SUSPEND_END,
+    capture_gap = UPV_CAPTURE_GAP,   // packets may be missing before the next one
+    overflow = UPV_OVERFLOW,
+};
+
+// read only view of packet bytes
+class byte_span
+{
+public:
+    byte_span() : ptr(nullptr), count(0) {}
+    byte_span(const uint8_t* p, size_t n) : ptr(p), count(n) {}
+
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const uint8_t* begin() const { return ptr; }
+    const uint8_t* end() const { return ptr + count; }
+    uint8_t operator[](size_t i) const { return ptr[i]; }
+    byte_span subspan(size_t offset, size_t n) const {
+        if(offset > count){
+            offset = count;
+        }
+        return byte_span(ptr + offset, n < count - offset ? n : count - offset);
+    }
+
+private:
+    const uint8_t* ptr;
+    size_t count;
+};
+
+// one packet or bus event, only valid inside the handler call
+class packet_view
+{
+public:
+    packet_view(uint32_t tick, const uint8_t* data, int len, int status)
+        : tick_(tick), data_(data), len_(len), status_(status) {}
+
+    uint32_t tick() const { return tick_; }         // 60MHz tick in 24 bit
+    int status() const { return status_; }
+    usbpv::speed speed() const { return (usbpv::speed)GetPacketSpeed(status_); }
+    packet_type type() const { return (packet_type)GetPacketType(status_); }
+    bool is_data() const { return GetPacketType(status_) == UPV_DATA_PACKET; }
+    // PID byte followed by the payload and CRC, empty for bus events
+    byte_span bytes() const { return is_data() ? byte_span(data_, len_) : byte_span(); }
+    size_t size() const { return is_data() ? len_ : 0; }
+    uint8_t pid() const { return is_data() && len_ > 0 ? data_[0] : 0; }
+
+private:
+    uint32_t tick_;
+    const uint8_t* data_;
+    int len_;
+    int status_;
+};
+
+namespace detail {
+
+template<typename H>
+struct emitter {
+    H* handler;
+    inline void operator()(uint32_t tick, const uint8_t* data, int len, int status){
+        (*handler)(packet_view(tick, data, len, status));
+    }
+};
+
+}
+
+/**
+ * Parser for a recorded or forwarded device stream
+ * handler(packet_view) is called for each packet.
+ */
+template<typename H>
+class parser
+{
+public:
+    explicit parser(H h = H()) : handler_(std::move(h)) { reset(); }
+
+    void reset() {
+        state.data_state = 0;
+        state.data_buf_idx = 0;
+        state.last_header = 0;
+        state.recover_count.store(0);
+        state.pause_on_stop.store(0);
+        state.echo_count.store(0);
+    }
+    // returns -1 after the stop command
+    int feed(const uint8_t* data, int len) {
+        detail::emitter<H> e = {&handler_};
+        return upv_parse_data(state, data, len, e);
+    }
+    H& handler() { return handler_; }
+    uint64_t recovered() const { return state.recover_count.load(std::memory_order_relaxed); }
+
+private:
+    upv_parse_state state;
+    H handler_;
+};
+
+/**
+ * Capture session owning a upv_s, move only
+ * The handler runs in the parser thread. Packets go through the same counters
+ * and hooks of upv_s as with process_data, the typed handler takes the place
+ * of the packet callback. A capture_gap packet is delivered after a reopen.
+ */
+template<typename H>
+class session
+{
+public:
+    session() {}
+    session(session&& other) : hold(std::move(other.hold)), dev(std::move(other.dev)) {}
+    session& operator=(session&& other) {
+        if(this != &other){
+            // stop our parser thread before its handler goes away
+            close();
+            hold = std::move(other.hold);
+            dev = std::move(other.dev);
+        }
+        return *this;
+    }
+    session(const session&) = delete;
+    session& operator=(const session&) = delete;
+    ~session() { close(); }
+
+    static session open(const char* option, int opt_len, H handler = H(), upv_s::upv_result* result = nullptr) {
+        session s;
+        s.dev.reset(new upv_s());
+        upv_s::upv_result r = s.dev->open(option, opt_len);
+        if(result){
+            *result = r;
+        }
+        if(r != upv_s::R_Success){
+            s.dev.reset();
+            return s;
+        }
+        s.hold.reset(new holder(s.dev.get(), std::move(handler)));
+        return s;
+    }
+
+    explicit operator bool() const { return dev != nullptr; }
+
+    upv_s::upv_result start() {
+        if(!dev){
+            return upv_s::R_DeviceNotOpen;
+        }
+        dev->data_processor = &session::process;
+        dev->processor_context = hold.get();
+        // the parser calls the handler directly, the callback only gets the gap marker
+        return dev->start_capture(hold.get(), &session::on_packet);
+    }
+    upv_s::upv_result stop(int timeout_ms = 1000) {
+        if(!dev){
+            return upv_s::R_DeviceNotOpen;
+        }
+        return dev->stop_capture(timeout_ms);
+    }
+    upv_s::upv_result pause(int timeout_ms = 1000) {
+        if(!dev){
+            return upv_s::R_DeviceNotOpen;
+        }
+        return dev->pause_capture(timeout_ms);
+    }
+    upv_s::upv_result resume() {
+        if(!dev){
+            return upv_s::R_DeviceNotOpen;
+        }
+        return dev->resume_capture();
+    }
+    // speed, flag and filter bytes as after the SN in open, capture keeps running
+    upv_s::upv_result reconfigure(const char* config, int len) {
+        if(!dev){
+            return upv_s::R_DeviceNotOpen;
+        }
+        return dev->reconfigure(config, len);
+    }
+    void close() {
+        // upv_s stops the capture when destroyed
+        dev.reset();
+        hold.reset();
+    }
+
+    H& handler() { return hold->handler; }
+    upv_s* device() { return dev.get(); }
+
+private:
+    struct holder {
+        holder(upv_s* d, H&& h) : dev(d), handler(std::move(h)) {}
+        upv_s* dev;
+        H handler;
+    };
+
+    static int process(void* context, const uint8_t* data, int len) {
+        holder* h = (holder*)context;
+        detail::emitter<H> e = {&h->handler};
+        upv_s_emitter<detail::emitter<H> > emit = {h->dev, &e};
+        return upv_parse_data(*h->dev, data, len, emit);
+    }
+    static long UPV_CB on_packet(void* context, unsigned long tick, const void* data, unsigned long len, long status) {
+        holder* h = (holder*)context;
+        h->handler(packet_view((uint32_t)tick, (const uint8_t*)data, (int)len, (int)status));
+        return 0;
+    }
+
+    std::unique_ptr<holder> hold;
+    std::unique_ptr<upv_s> dev;
+};
+
+}
+
+#endif
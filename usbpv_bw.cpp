@@ -0,0 +1,146 @@
+#include "usbpv_bw.h"
+#include "string.h"
+
+#define MF_PER_100MS  800
+#define MF_PER_SEC    8000
+
+upv_bw_stats::upv_bw_stats()
+{
+    reset();
+}
+
+static void clear_slot(upv_bw_slot_t* s)
+{
+    memset(s, 0, sizeof(*s));
+    for(int i=0;i<8;i++) s->mf[i].id = ~0ull;
+    for(int i=0;i<10;i++) s->ms100[i].id = ~0ull;
+    for(int i=0;i<60;i++) s->sec[i].id = ~0ull;
+}
+
+void upv_bw_stats::reset()
+{
+    tick_ext.reset();
+    cur_mf = 0;
+    next_mf_tick = UPV_BW_MF_TICKS;
+    cur_slot = 0;
+    slot_count = 1;
+    dirty_count = 0;
+    memset(slot_map, 0, sizeof(slot_map));
+    clear_slot(&slots[0]);
+    slots[0].addr = UPV_NO_ADDR;
+    slots[0].ep = UPV_NO_EP;
+}
+
+int upv_bw_stats::alloc_slot(int addr, int ep, int dir_in)
+{
+    if(slot_count >= UPV_BW_MAX_SLOTS){
+        // only counted on the bus
+        return 0;
+    }
+    int slot = slot_count;
+    upv_bw_slot_t* s = &slots[slot];
+    clear_slot(s);
+    s->addr = addr;
+    s->ep = ep;
+    s->dir_in = dir_in;
+    slot_map[addr][ep | (dir_in ? 0x10 : 0)] = slot;
+    slot_count++;
+    return slot;
+}
+
+static inline void add_bucket(upv_bw_bucket_t* b, int n, uint64_t id, uint64_t units, uint64_t bytes)
+{
+    upv_bw_bucket_t* e = &b[id % n];
+    if(e->id != id){
+        e->id = id;
+        e->units = 0;
+        e->bytes = 0;
+    }
+    e->units += units;
+    e->bytes += bytes;
+}
+
+void upv_bw_stats::fold(upv_bw_slot_t* s)
+{
+    add_bucket(s->mf, 8, cur_mf, s->mf_units, s->mf_bytes);
+    add_bucket(s->ms100, 10, cur_mf/MF_PER_100MS, s->mf_units, s->mf_bytes);
+    add_bucket(s->sec, 60, cur_mf/MF_PER_SEC, s->mf_units, s->mf_bytes);
+    s->mf_units = 0;
+    s->mf_bytes = 0;
+    s->dirty = 0;
+}
+
+void upv_bw_stats::advance(uint64_t mf)
+{
+    fold(&slots[0]);
+    for(int i=0;i<dirty_count;i++){
+        fold(&slots[dirty_list[i]]);
+    }
+    dirty_count = 0;
+    cur_mf = mf;
+    next_mf_tick = (mf+1) * UPV_BW_MF_TICKS;
+}
+
+static inline void sum_window(const upv_bw_bucket_t* b, int n, uint64_t cur, uint64_t* units, uint64_t* bytes)
+{
+    for(int i=0;i<n;i++){
+        if(b[i].id <= cur && b[i].id + n > cur){
+            *units += b[i].units;
+            *bytes += b[i].bytes;
+        }
+    }
+}
+
+void upv_bw_stats::fill(const upv_bw_slot_t* s, upv_bw_info_t* info) const
+{
+    uint64_t mf = cur_mf;
+    uint64_t u, b;
+    info->addr = s->addr;
+    info->ep = s->ep;
+    info->dir_in = s->dir_in;
+    info->packets = s->packets;
+    info->bytes = s->bytes;
+
+    u = s->mf_units;
+    b = s->mf_bytes;
+    sum_window(s->mf, 8, mf, &u, &b);
+    info->util_1ms = (uint32_t)(u * 1000000 / (8ull*UPV_BW_MF_UNITS));
+    info->bytes_1ms = b;
+
+    u = s->mf_units;
+    b = s->mf_bytes;
+    sum_window(s->ms100, 10, mf/MF_PER_100MS, &u, &b);
+    info->util_1s = (uint32_t)(u * 1000000 / (1ull*MF_PER_SEC*UPV_BW_MF_UNITS));
+    info->bytes_1s = b;
+
+    u = s->mf_units;
+    b = s->mf_bytes;
+    sum_window(s->sec, 60, mf/MF_PER_SEC, &u, &b);
+    info->util_1min = (uint32_t)(u * 1000000 / (60ull*MF_PER_SEC*UPV_BW_MF_UNITS));
+    info->bytes_1min = b;
+}
+
+int upv_bw_stats::query(upv_bw_info_t* info, int max_count) const
+{
+    int n = slot_count;
+    if(n > max_count){
+        n = max_count;
+    }
+    for(int i=0;i<n;i++){
+        fill(&slots[i], &info[i]);
+    }
+    return n;
+}
+
+int upv_bw_stats::query(int addr, int ep, int dir_in, upv_bw_info_t* info) const
+{
+    int slot = 0;
+    if(addr != UPV_NO_ADDR){
+        slot = slot_map[addr & 0x7f][(ep & 0x0f) | (dir_in ? 0x10 : 0)];
+        if(!slot){
+            return -1;
+        }
+    }
+    fill(&slots[slot], info);
+    return 0;
+}
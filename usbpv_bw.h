@@ -0,0 +1,116 @@
+#ifndef __USBPV_BW_H__
+#define __USBPV_BW_H__
+
+#include "usbpv_decode.h"
+#include "usbpv_lib.h"
+
+#define UPV_BW_MAX_SLOTS  64
+#define UPV_BW_MF_TICKS   7500          // 125us microframe in 60MHz tick
+#define UPV_BW_MF_UNITS   60000         // 125us microframe in high speed bit time
+
+struct upv_bw_bucket_t{
+    uint64_t id;
+    uint64_t units;
+    uint64_t bytes;
+};
+
+// counters of one endpoint, slot 0 holds the whole bus
+struct upv_bw_slot_t{
+    uint8_t  addr;
+    uint8_t  ep;
+    uint8_t  dir_in;
+    uint8_t  dirty;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t mf_units;                  // current microframe, not folded yet
+    uint64_t mf_bytes;
+    upv_bw_bucket_t mf[8];              // 125us buckets, 1ms window
+    upv_bw_bucket_t ms100[10];          // 100ms buckets, 1s window
+    upv_bw_bucket_t sec[60];            // 1s buckets, 1min window
+};
+
+/**
+ * Bus time accounting per address/endpoint
+ * Bus time is counted in high speed bit time, a packet costs its bits with
+ * bit stuffing, SYNC and EOP scaled by the packet speed. Data and handshake
+ * packets are charged to the endpoint of the preceding token, SOF to the bus
+ * only. Counters are folded into the windows once per microframe, "now" is the
+ * tick of the last packet. Queries may run from another thread and read the
+ * counters without lock.
+ */
+class upv_bw_stats
+{
+public:
+    upv_bw_stats();
+    void reset();
+
+    inline void on_packet(uint32_t tick, const uint8_t* data, int len, long status){
+        static const uint16_t bit_mul[4] = {1, 320, 40, 1};
+        static const uint8_t  bit_ovh[4] = {40, 11, 11, 40};
+        if(GetPacketType(status) != UPV_DATA_PACKET || len < 1){
+            return;
+        }
+        uint64_t t = tick_ext.extend(tick);
+        if(t >= next_mf_tick){
+            advance(t / UPV_BW_MF_TICKS);
+        }
+        int spd = GetPacketSpeed(status);
+        uint32_t units = ((len*28)/3 + bit_ovh[spd]) * bit_mul[spd];
+        uint8_t pid = data[0];
+        int slot = cur_slot;
+        if(pid == UPV_PID_IN || pid == UPV_PID_OUT || pid == UPV_PID_SETUP || pid == UPV_PID_PING){
+            if(len >= 3){
+                int dir_in = pid == UPV_PID_IN;
+                slot = slot_map[UPV_TOKEN_ADDR(data)][UPV_TOKEN_EP(data) | (dir_in ? 0x10 : 0)];
+                if(!slot){
+                    slot = alloc_slot(UPV_TOKEN_ADDR(data), UPV_TOKEN_EP(data), dir_in);
+                }
+            }
+            cur_slot = slot;
+        }else if(pid == UPV_PID_SOF){
+            slot = 0;
+            cur_slot = 0;
+        }
+        int bytes = (pid & 0x03) == 0x03 && len >= 3 ? len - 3 : 0;
+        slots[0].mf_units += units;
+        slots[0].mf_bytes += bytes;
+        slots[0].packets++;
+        slots[0].bytes += bytes;
+        if(slot){
+            upv_bw_slot_t* s = &slots[slot];
+            s->mf_units += units;
+            s->mf_bytes += bytes;
+            s->packets++;
+            s->bytes += bytes;
+            if(!s->dirty){
+                s->dirty = 1;
+                dirty_list[dirty_count++] = slot;
+            }
+        }
+    }
+
+    /**
+     * \returns number of entries filled, entry 0 is the whole bus
+     */
+    int query(upv_bw_info_t* info, int max_count) const;
+    int query(int addr, int ep, int dir_in, upv_bw_info_t* info) const;
+
+protected:
+    void advance(uint64_t mf);
+    int  alloc_slot(int addr, int ep, int dir_in);
+    void fold(upv_bw_slot_t* s);
+    void fill(const upv_bw_slot_t* s, upv_bw_info_t* info) const;
+
+public:
+    upv_tick_ext tick_ext;
+    uint64_t cur_mf;
+    uint64_t next_mf_tick;
+    int cur_slot;
+    int slot_count;
+    int dirty_count;
+    uint8_t dirty_list[UPV_BW_MAX_SLOTS];
+    uint8_t slot_map[128][32];
+    upv_bw_slot_t slots[UPV_BW_MAX_SLOTS];
+};
+
+#endif
@@ -0,0 +1,443 @@
+#include "usbpv_class.h"
+#include "string.h"
+
+#define USB_CLASS_HID       0x03
+#define USB_CLASS_MSC       0x08
+#define USB_CLASS_CDC_DATA  0x0A
+
+#define MSC_CBW_SIGNATURE   0x43425355
+#define MSC_CSW_SIGNATURE   0x53425355
+
+#define MSC_IDLE    0
+#define MSC_DATA    1
+#define MSC_STATUS  2
+
+static inline uint32_t le32(const uint8_t* p)
+{
+    return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+static inline uint32_t be32(const uint8_t* p)
+{
+    return ((uint32_t)p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3];
+}
+static inline uint16_t be16(const uint8_t* p)
+{
+    return (p[0]<<8) | p[1];
+}
+
+upv_class_decoder::upv_class_decoder()
+    :context(NULL)
+    ,record_handler(NULL)
+{
+    enum_tracker = new upv_enum_tracker();
+    enum_tracker->context = this;
+    enum_tracker->event_handler = on_enum_event;
+    reset();
+}
+
+upv_class_decoder::~upv_class_decoder()
+{
+    delete enum_tracker;
+}
+
+void upv_class_decoder::reset()
+{
+    for(int i=0;i<UPV_CLASS_MAX_SLOTS;i++){
+        slots[i].used = 0;
+        slots[i].hid.items.clear();
+    }
+    memset(slot_map, 0, sizeof(slot_map));
+    memset(data_toggle, 0, sizeof(data_toggle));
+}
+
+void UPV_CB upv_class_decoder::on_enum_event(void* decoder, int addr, int event)
+{
+    upv_class_decoder* d = (upv_class_decoder*)decoder;
+    if(addr < 0){
+        return;
+    }
+    switch(event){
+    case UPV_ENUM_ADDRESS:
+    case UPV_ENUM_CONFIGURED:
+    case UPV_ENUM_INTERFACE:
+        // every endpoint of the device restarts at DATA0
+        memset(d->data_toggle[addr], 0, sizeof(d->data_toggle[addr]));
+        break;
+    case UPV_ENUM_CLEAR_HALT:{
+        uint8_t ep = d->enum_tracker->ctrl[addr].setup[4];
+        d->data_toggle[addr][(ep & 0x0f) | ((ep & 0x80) ? 0x10 : 0)] = 0;
+        break;
+    }
+    }
+}
+
+void upv_class_decoder::feed(unsigned long tick_60MHz, const uint8_t* data, unsigned long len, long status)
+{
+    if(enum_tracker->feed(tick_60MHz, data, len, status)){
+        on_xact(enum_tracker->tracker.xact);
+    }
+    if(GetPacketType(status) == UPV_RESET_BEGIN){
+        reset();
+    }
+}
+
+long UPV_CB upv_class_decoder::on_packet(void* decoder, unsigned long tick_60MHz, const void* data, unsigned long len, long status)
+{
+    ((upv_class_decoder*)decoder)->feed(tick_60MHz, (const uint8_t*)data, len, status);
+    return 0;
+}
+
+upv_class_slot_t* upv_class_decoder::get_slot(const upv_xact_t& x, const upv_ep_info_t* info)
+{
+    uint8_t& idx = slot_map[x.addr][(x.ep & 0x0f) | (x.token == UPV_PID_IN ? 0x10 : 0)];
+    if(idx){
+        upv_class_slot_t* s = &slots[idx-1];
+        if(s->used && s->addr == x.addr && s->iface == info->iface && s->iface_class == info->iface_class){
+            return s;
+        }
+        idx = 0;
+    }
+    // the endpoint is new or the configuration changed, find the interface slot
+    upv_class_slot_t* free_slot = NULL;
+    for(int i=0;i<UPV_CLASS_MAX_SLOTS;i++){
+        upv_class_slot_t* s = &slots[i];
+        if(!s->used){
+            if(!free_slot){
+                free_slot = s;
+            }
+            continue;
+        }
+        if(s->addr == x.addr && s->iface == info->iface){
+            if(s->iface_class == info->iface_class){
+                idx = i+1;
+                return s;
+            }
+            s->used = 0;
+            if(!free_slot){
+                free_slot = s;
+            }
+        }
+    }
+    if(!free_slot){
+        return NULL;
+    }
+    upv_class_slot_t* s = free_slot;
+    s->used = 1;
+    s->addr = x.addr;
+    s->iface = info->iface;
+    s->iface_class = info->iface_class;
+    s->msc_state = MSC_IDLE;
+    s->cdc_offset[0] = 0;
+    s->cdc_offset[1] = 0;
+    s->hid_parsed = 0;
+    s->hid.has_report_id = 0;
+    s->hid.items.clear();
+    idx = (uint8_t)(s - slots) + 1;
+    return s;
+}
+
+void upv_class_decoder::on_xact(const upv_xact_t& x)
+{
+    if(x.ep == 0 || x.data_pid == 0 || !record_handler){
+        return;
+    }
+    int dir_in = x.token == UPV_PID_IN;
+    const upv_ep_info_t* info = enum_tracker->endpoint(x.addr, x.ep, dir_in);
+    if(info->type == UPV_EP_TYPE_UNKNOWN || info->type == UPV_EP_TYPE_ISO){
+        return;
+    }
+    if(x.handshake != UPV_PID_ACK && x.handshake != UPV_PID_NYET){
+        return;
+    }
+    if(info->iface_class != USB_CLASS_MSC && info->iface_class != USB_CLASS_HID && info->iface_class != USB_CLASS_CDC_DATA){
+        return;
+    }
+    upv_class_slot_t* s = get_slot(x, info);
+    if(!s){
+        return;
+    }
+    uint8_t& toggle = data_toggle[x.addr][(x.ep & 0x0f) | (dir_in ? 0x10 : 0)];
+    if(toggle == x.data_pid){
+        // retransmission after a lost ACK
+        return;
+    }
+    toggle = x.data_pid;
+
+    switch(info->iface_class){
+    case USB_CLASS_MSC:
+        on_msc(s, x, dir_in);
+        break;
+    case USB_CLASS_HID:
+        on_hid(s, x);
+        break;
+    case USB_CLASS_CDC_DATA:
+        on_cdc(s, x, dir_in);
+        break;
+    }
+}
+
+void upv_class_decoder::on_msc(upv_class_slot_t* s, const upv_xact_t& x, int dir_in)
+{
+    upv_msc_record_t& m = s->msc;
+    if(!dir_in && x.len == 31 && le32(x.data) == MSC_CBW_SIGNATURE){
+        // CBW, a pending command without CSW is dropped
+        const uint8_t* cdb = x.data + 15;
+        memset(&m, 0, sizeof(m));
+        m.tag = le32(x.data+4);
+        m.data_len = le32(x.data+8);
+        m.dir_in = (x.data[12] & 0x80) ? 1 : 0;
+        m.lun = x.data[13] & 0x0f;
+        m.cdb_len = x.data[14] & 0x1f;
+        if(m.cdb_len > 16){
+            m.cdb_len = 16;
+        }
+        memcpy(m.cdb, cdb, 16);
+        m.opcode = cdb[0];
+        switch(m.opcode){
+        case 0x08: // READ(6)
+        case 0x0A: // WRITE(6)
+            m.lba = ((cdb[1] & 0x1f)<<16) | (cdb[2]<<8) | cdb[3];
+            m.blocks = cdb[4] ? cdb[4] : 256;
+            break;
+        case 0x28: // READ(10)
+        case 0x2A: // WRITE(10)
+        case 0x2F: // VERIFY(10)
+            m.lba = be32(cdb+2);
+            m.blocks = be16(cdb+7);
+            break;
+        case 0xA8: // READ(12)
+        case 0xAA: // WRITE(12)
+            m.lba = be32(cdb+2);
+            m.blocks = be32(cdb+6);
+            break;
+        case 0x88: // READ(16)
+        case 0x8A: // WRITE(16)
+            m.lba = ((uint64_t)be32(cdb+2)<<32) | be32(cdb+6);
+            m.blocks = be32(cdb+10);
+            break;
+        }
+        s->msc_tick = x.tick;
+        s->msc_ep = x.ep;
+        s->msc_state = m.data_len ? MSC_DATA : MSC_STATUS;
+        return;
+    }
+    if(s->msc_state == MSC_IDLE){
+        return;
+    }
+    if(dir_in && x.len == 13 && le32(x.data) == MSC_CSW_SIGNATURE && le32(x.data+4) == m.tag){
+        m.residue = le32(x.data+8);
+        m.status = x.data[12];
+        m.latency = x.tick - s->msc_tick;
+        s->msc_state = MSC_IDLE;
+
+        record.type = UPV_CLASS_MSC;
+        record.tick = s->msc_tick;
+        record.addr = x.addr;
+        record.ep = s->msc_ep;
+        record.iface = s->iface;
+        record.msc = m;
+        record_handler(context, &record);
+        return;
+    }
+    if(s->msc_state == MSC_DATA && dir_in == m.dir_in){
+        m.data_seen += x.len;
+    }
+}
+
+void upv_class_decoder::on_hid(upv_class_slot_t* s, const upv_xact_t& x)
+{
+    if(x.token != UPV_PID_IN || x.len == 0){
+        return;
+    }
+    if(!s->hid_parsed){
+        const upv_usb_device_t* dev = enum_tracker->device(x.addr);
+        if(dev && s->iface < dev->report_desc.size() && dev->report_desc[s->iface].size()){
+            const std::vector<uint8_t>& desc = dev->report_desc[s->iface];
+            parse_hid_report_desc(&desc[0], desc.size(), &s->hid);
+            s->hid_parsed = 1;
+        }
+    }
+
+    upv_hid_record_t& h = record.hid;
+    const uint8_t* report = x.data;
+    int report_len = x.len;
+    h.report_id = 0;
+    if(s->hid.has_report_id){
+        h.report_id = report[0];
+        report++;
+        report_len--;
+    }
+    h.len = x.len;
+    h.data = x.data;
+    h.field_count = 0;
+    for(size_t i=0;i<s->hid.items.size();i++){
+        const upv_hid_item_t& it = s->hid.items[i];
+        if(it.report_id != h.report_id || (it.flags & 0x01)){
+            // other report or constant padding
+            continue;
+        }
+        for(int n=0;n<it.count && h.field_count<UPV_HID_MAX_FIELDS;n++){
+            int bit = it.bit_offset + n*it.bit_size;
+            if(bit + it.bit_size > report_len*8){
+                break;
+            }
+            uint32_t v = 0;
+            for(int b=0;b<it.bit_size;b++){
+                if(report[(bit+b)>>3] & (1<<((bit+b)&7))){
+                    v |= 1u<<b;
+                }
+            }
+            upv_hid_field_t& f = h.fields[h.field_count++];
+            f.usage_page = it.usage_page;
+            f.bit_offset = bit;
+            f.bit_size = it.bit_size;
+            f.flags = it.flags;
+            if(it.logical_min < 0 && it.bit_size < 32 && (v & (1u<<(it.bit_size-1)))){
+                v |= ~0u << it.bit_size;
+            }
+            f.value = (int32_t)v;
+            if(it.flags & 0x02){
+                // variable, one usage per field
+                if(n < (int)it.usages.size()){
+                    f.usage = it.usages[n];
+                }else if(it.usages.size()){
+                    f.usage = it.usages.back();
+                }else{
+                    uint32_t u = it.usage_min + n;
+                    f.usage = u > it.usage_max ? it.usage_max : u;
+                }
+            }else{
+                // array, the value selects the usage
+                f.usage = it.usage_min + (uint32_t)(f.value - it.logical_min);
+            }
+        }
+    }
+
+    record.type = UPV_CLASS_HID;
+    record.tick = x.tick;
+    record.addr = x.addr;
+    record.ep = x.ep;
+    record.iface = s->iface;
+    record_handler(context, &record);
+}
+
+void upv_class_decoder::on_cdc(upv_class_slot_t* s, const upv_xact_t& x, int dir_in)
+{
+    if(x.len == 0){
+        return;
+    }
+    upv_cdc_record_t& c = record.cdc;
+    c.dir_in = dir_in;
+    c.len = x.len;
+    c.data = x.data;
+    c.offset = s->cdc_offset[dir_in];
+    s->cdc_offset[dir_in] += x.len;
+
+    record.type = UPV_CLASS_CDC;
+    record.tick = x.tick;
+    record.addr = x.addr;
+    record.ep = x.ep;
+    record.iface = s->iface;
+    record_handler(context, &record);
+}
+
+int upv_class_decoder::parse_hid_report_desc(const uint8_t* desc, int len, upv_hid_layout_t* layout)
+{
+    struct global_t{
+        uint16_t usage_page;
+        int32_t  logical_min;
+        uint8_t  report_size;
+        uint8_t  report_id;
+        uint16_t report_count;
+    };
+    global_t g;
+    global_t stack[8];
+    int sp = 0;
+    std::vector<uint32_t> usages;
+    uint32_t usage_min = 0;
+    uint32_t usage_max = 0;
+    uint16_t bit_offset[256];
+
+    memset(&g, 0, sizeof(g));
+    memset(bit_offset, 0, sizeof(bit_offset));
+    layout->has_report_id = 0;
+    layout->items.clear();
+
+    int pos = 0;
+    while(pos < len){
+        uint8_t prefix = desc[pos++];
+        if(prefix == 0xfe){
+            // long item
+            if(pos + 2 > len){
+                break;
+            }
+            pos += 2 + desc[pos];
+            continue;
+        }
+        int size = prefix & 0x03;
+        if(size == 3){
+            size = 4;
+        }
+        if(pos + size > len){
+            return -1;
+        }
+        uint32_t uval = 0;
+        for(int i=0;i<size;i++){
+            uval |= (uint32_t)desc[pos+i] << (i*8);
+        }
+        int32_t sval = (int32_t)uval;
+        if(size == 1){
+            sval = (int8_t)uval;
+        }else if(size == 2){
+            sval = (int16_t)uval;
+        }
+        pos += size;
+
+        int type = (prefix >> 2) & 0x03;
+        int tag = prefix >> 4;
+        if(type == 1){
+            // global item
+            switch(tag){
+            case 0: g.usage_page = uval; break;
+            case 1: g.logical_min = sval; break;
+            case 7: g.report_size = uval; break;
+            case 8: g.report_id = uval; layout->has_report_id = 1; break;
+            case 9: g.report_count = uval; break;
+            case 10: if(sp < 8) stack[sp++] = g; break;
+            case 11: if(sp > 0) g = stack[--sp]; break;
+            }
+        }else if(type == 2){
+            // local item, 4 byte usage carries its own usage page
+            uint32_t u = size == 4 ? (uval & 0xffff) : uval;
+            switch(tag){
+            case 0: usages.push_back(u); break;
+            case 1: usage_min = u; break;
+            case 2: usage_max = u; break;
+            }
+        }else if(type == 0){
+            // main item
+            if(tag == 8){
+                // input
+                upv_hid_item_t it;
+                it.report_id = g.report_id;
+                it.flags = uval;
+                it.bit_size = g.report_size;
+                it.count = g.report_count;
+                it.bit_offset = bit_offset[g.report_id];
+                it.usage_page = g.usage_page;
+                it.usage_min = usage_min;
+                it.usage_max = usage_max;
+                it.logical_min = g.logical_min;
+                it.usages = usages;
+                if(it.bit_size > 0 && it.bit_size <= 32){
+                    layout->items.push_back(it);
+                }
+                bit_offset[g.report_id] += g.report_size * g.report_count;
+            }
+            usages.clear();
+            usage_min = 0;
+            usage_max = 0;
+        }
+    }
+    return (int)layout->items.size();
+}
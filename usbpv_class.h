@@ -0,0 +1,82 @@
+#ifndef __USBPV_CLASS_H__
+#define __USBPV_CLASS_H__
+
+#include "usbpv_decode.h"
+#include "usbpv_lib.h"
+
+#define UPV_CLASS_MAX_SLOTS  64
+
+// one input item of a HID report descriptor
+struct upv_hid_item_t{
+    uint8_t  report_id;
+    uint8_t  flags;
+    uint8_t  bit_size;
+    uint16_t count;
+    uint16_t bit_offset;
+    uint16_t usage_page;
+    uint32_t usage_min;
+    uint32_t usage_max;
+    int32_t  logical_min;
+    std::vector<uint32_t> usages;
+};
+
+struct upv_hid_layout_t{
+    int has_report_id;
+    std::vector<upv_hid_item_t> items;
+};
+
+// decoder state of one interface
+struct upv_class_slot_t{
+    uint8_t  used;
+    uint8_t  addr;
+    uint8_t  iface;
+    uint8_t  iface_class;
+    // mass storage bulk only
+    int      msc_state;
+    uint64_t msc_tick;
+    uint8_t  msc_ep;
+    upv_msc_record_t msc;
+    // CDC
+    uint64_t cdc_offset[2];
+    // HID
+    int      hid_parsed;
+    upv_hid_layout_t hid;
+};
+
+/**
+ * Decode mass storage bulk only, HID reports and CDC data stream
+ * The decoder drives its own upv_enum_tracker to learn which interface owns an
+ * endpoint, the records are passed to the callback synchronously. All state is
+ * allocated up front, the HID report descriptor is parsed once on first use.
+ */
+class upv_class_decoder
+{
+public:
+    upv_class_decoder();
+    ~upv_class_decoder();
+    void reset();
+
+    void feed(unsigned long tick_60MHz, const uint8_t* data, unsigned long len, long status);
+    static long UPV_CB on_packet(void* decoder, unsigned long tick_60MHz, const void* data, unsigned long len, long status);
+
+    static int parse_hid_report_desc(const uint8_t* desc, int len, upv_hid_layout_t* layout);
+
+protected:
+    void on_xact(const upv_xact_t& x);
+    static void UPV_CB on_enum_event(void* decoder, int addr, int event);
+    upv_class_slot_t* get_slot(const upv_xact_t& x, const upv_ep_info_t* info);
+    void on_msc(upv_class_slot_t* s, const upv_xact_t& x, int dir_in);
+    void on_hid(upv_class_slot_t* s, const upv_xact_t& x);
+    void on_cdc(upv_class_slot_t* s, const upv_xact_t& x, int dir_in);
+
+public:
+    void* context;
+    pfn_class_handler record_handler;
+    upv_enum_tracker* enum_tracker;
+    upv_class_record_t record;
+    upv_class_slot_t slots[UPV_CLASS_MAX_SLOTS];
+    uint8_t slot_map[128][32];
+    uint8_t data_toggle[128][32];  // data PID of the last accepted packet by endpoint, 0 after a toggle reset
+};
+
+#endif
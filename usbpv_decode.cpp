@@ -0,0 +1,395 @@
+#include "usbpv_decode.h"
+#include "string.h"
+
+#define CTRL_IDLE    0
+#define CTRL_DATA    1
+#define CTRL_STATUS  2
+
+#define XACT_IDLE    0
+#define XACT_TOKEN   1
+#define XACT_DATA    2
+
+upv_xact_tracker::upv_xact_tracker()
+{
+    reset();
+}
+
+void upv_xact_tracker::reset()
+{
+    memset(&xact, 0, sizeof(xact));
+    memset(&cur, 0, sizeof(cur));
+    state = XACT_IDLE;
+    tick_ext.reset();
+}
+
+int upv_xact_tracker::feed(unsigned long tick_60MHz, const uint8_t* data, unsigned long len, long status)
+{
+    uint64_t tick = tick_ext.extend(tick_60MHz);
+    int ret = 0;
+    if(GetPacketType(status) != UPV_DATA_PACKET || len < 1){
+        // bus event, the pending transaction will never get a handshake
+        if(state == XACT_DATA){
+            xact = cur;
+            ret = 1;
+        }
+        state = XACT_IDLE;
+        return ret;
+    }
+
+    uint8_t pid = data[0];
+    switch(pid){
+    case UPV_PID_OUT:
+    case UPV_PID_IN:
+    case UPV_PID_SETUP:
+    case UPV_PID_PING:
+        if(state == XACT_DATA){
+            // isochronous, no handshake
+            xact = cur;
+            ret = 1;
+        }
+        state = XACT_IDLE;
+        if(len < 3){
+            break;
+        }
+        cur.tick = tick;
+        cur.token = pid;
+        cur.addr = UPV_TOKEN_ADDR(data);
+        cur.ep = UPV_TOKEN_EP(data);
+        cur.speed = GetPacketSpeed(status);
+        cur.data_pid = 0;
+        cur.handshake = 0;
+        cur.len = 0;
+        cur.data = payload;
+        state = XACT_TOKEN;
+        break;
+    case UPV_PID_DATA0:
+    case UPV_PID_DATA1:
+    case UPV_PID_DATA2:
+    case UPV_PID_MDATA:
+        if(state == XACT_TOKEN && cur.token != UPV_PID_PING && len >= 3){
+            // strip PID and CRC16
+            int plen = (int)len - 3;
+            if(plen > (int)sizeof(payload)){
+                plen = sizeof(payload);
+            }
+            memcpy(payload, data+1, plen);
+            cur.data_pid = pid;
+            cur.len = plen;
+            state = XACT_DATA;
+        }else{
+            if(state == XACT_DATA){
+                xact = cur;
+                ret = 1;
+            }
+            state = XACT_IDLE;
+        }
+        break;
+    case UPV_PID_ACK:
+    case UPV_PID_NAK:
+    case UPV_PID_STALL:
+    case UPV_PID_NYET:
+        if(state != XACT_IDLE){
+            xact = cur;
+            xact.handshake = pid;
+            ret = 1;
+        }
+        state = XACT_IDLE;
+        break;
+    case UPV_PID_SOF:
+        if(state == XACT_DATA){
+            xact = cur;
+            ret = 1;
+        }
+        state = XACT_IDLE;
+        break;
+    default:
+        // SPLIT and PRE precede a normal token, keep current state
+        break;
+    }
+    return ret;
+}
+
+upv_enum_tracker::upv_enum_tracker()
+    :context(NULL)
+    ,event_handler(NULL)
+{
+    reset();
+}
+
+void upv_enum_tracker::reset()
+{
+    tracker.reset();
+    for(int i=0;i<128;i++){
+        clear_device(i);
+    }
+}
+
+void upv_enum_tracker::clear_device(int addr)
+{
+    devices[addr] = upv_usb_device_t();
+    ctrl[addr].stage = CTRL_IDLE;
+    update_endpoints(addr);
+}
+
+int upv_enum_tracker::feed(unsigned long tick_60MHz, const uint8_t* data, unsigned long len, long status)
+{
+    int r = tracker.feed(tick_60MHz, data, len, status);
+    if(r){
+        on_xact(tracker.xact);
+    }
+    if(GetPacketType(status) == UPV_RESET_BEGIN){
+        // every device behind the monitored port starts over at address 0
+        for(int i=0;i<128;i++){
+            if(devices[i].state != UPV_DEV_NONE){
+                clear_device(i);
+            }
+        }
+        if(event_handler){
+            event_handler(context, -1, UPV_ENUM_RESET);
+        }
+    }
+    return r;
+}
+
+long UPV_CB upv_enum_tracker::on_packet(void* tracker, unsigned long tick_60MHz, const void* data, unsigned long len, long status)
+{
+    ((upv_enum_tracker*)tracker)->feed(tick_60MHz, (const uint8_t*)data, len, status);
+    return 0;
+}
+
+void upv_enum_tracker::on_xact(const upv_xact_t& x)
+{
+    if(x.ep != 0){
+        return;
+    }
+    upv_ctrl_xfer_t& c = ctrl[x.addr];
+    if(x.handshake == UPV_PID_STALL){
+        c.stage = CTRL_IDLE;
+        return;
+    }
+    if(x.handshake != UPV_PID_ACK && x.handshake != UPV_PID_NYET){
+        // NAK or lost handshake, the host will retry
+        return;
+    }
+
+    if(x.token == UPV_PID_SETUP){
+        if(x.len != 8){
+            c.stage = CTRL_IDLE;
+            return;
+        }
+        memcpy(c.setup, x.data, 8);
+        c.len = 0;
+        c.toggle = UPV_PID_DATA1;
+        c.stage = (c.setup[6] | (c.setup[7]<<8)) ? CTRL_DATA : CTRL_STATUS;
+        upv_usb_device_t& dev = devices[x.addr];
+        if(dev.state == UPV_DEV_NONE){
+            dev.state = x.addr ? UPV_DEV_ADDRESS : UPV_DEV_DEFAULT;
+            dev.speed = x.speed;
+        }
+        return;
+    }
+
+    if(c.stage == CTRL_IDLE || x.data_pid == 0){
+        return;
+    }
+    int dir_in = (c.setup[0] & 0x80) != 0;
+    int token_in = x.token == UPV_PID_IN;
+    if(c.stage == CTRL_DATA && token_in == dir_in){
+        if(x.data_pid != c.toggle){
+            // retransmission after a lost ACK
+            return;
+        }
+        c.toggle = c.toggle == UPV_PID_DATA1 ? UPV_PID_DATA0 : UPV_PID_DATA1;
+        int n = x.len;
+        if(c.len + n > (int)sizeof(c.data)){
+            n = sizeof(c.data) - c.len;
+        }
+        memcpy(c.data + c.len, x.data, n);
+        c.len += n;
+        return;
+    }
+    if(x.len == 0 && (c.stage == CTRL_STATUS ? token_in : token_in != dir_in)){
+        // status stage done
+        c.stage = CTRL_IDLE;
+        on_request(x.addr, c.setup, c.data, c.len);
+    }
+}
+
+void upv_enum_tracker::on_request(int addr, const uint8_t* setup, const uint8_t* data, int len)
+{
+    uint8_t type = setup[0];
+    uint8_t req = setup[1];
+    uint16_t value = setup[2] | (setup[3]<<8);
+    uint16_t index = setup[4] | (setup[5]<<8);
+    int event = -1;
+
+    if(type == 0x00 && req == 5){
+        // SET_ADDRESS
+        int new_addr = value & 0x7f;
+        if(new_addr != addr){
+            devices[new_addr] = devices[addr];
+            clear_device(addr);
+        }
+        upv_usb_device_t& dev = devices[new_addr];
+        dev.state = new_addr ? UPV_DEV_ADDRESS : UPV_DEV_DEFAULT;
+        dev.config = 0;
+        dev.interfaces.clear();
+        dev.endpoints.clear();
+        update_endpoints(new_addr);
+        addr = new_addr;
+        event = UPV_ENUM_ADDRESS;
+    }else if(type == 0x80 && req == 6){
+        // GET_DESCRIPTOR
+        upv_usb_device_t& dev = devices[addr];
+        int desc_type = value >> 8;
+        int desc_index = value & 0xff;
+        if(desc_type == 1 && len > 0){
+            int n = len < 18 ? len : 18;
+            if(n >= dev.device_desc_len){
+                memcpy(dev.device_desc, data, n);
+                dev.device_desc_len = n;
+            }
+            if(n >= 8){
+                dev.max_packet0 = dev.device_desc[7];
+            }
+            if(n >= 12){
+                dev.vid = dev.device_desc[8] | (dev.device_desc[9]<<8);
+                dev.pid = dev.device_desc[10] | (dev.device_desc[11]<<8);
+            }
+            update_endpoints(addr);
+            event = UPV_ENUM_DEVICE_DESC;
+        }else if(desc_type == 2 && len >= 9){
+            if((int)dev.config_desc.size() <= desc_index){
+                dev.config_desc.resize(desc_index+1);
+            }
+            std::vector<uint8_t>& cfg = dev.config_desc[desc_index];
+            if(len > (int)cfg.size()){
+                cfg.assign(data, data+len);
+                if(dev.config && dev.config == data[5]){
+                    // configured before the full descriptor was seen
+                    parse_config(addr, data, len);
+                    update_endpoints(addr);
+                }
+            }
+            event = UPV_ENUM_CONFIG_DESC;
+        }
+    }else if(type == 0x81 && req == 6 && (value >> 8) == 0x22 && len > 0){
+        // HID report descriptor
+        upv_usb_device_t& dev = devices[addr];
+        int iface = index & 0xff;
+        if((int)dev.report_desc.size() <= iface){
+            dev.report_desc.resize(iface+1);
+        }
+        dev.report_desc[iface].assign(data, data+len);
+        event = UPV_ENUM_REPORT_DESC;
+    }else if(type == 0x00 && req == 9){
+        // SET_CONFIGURATION
+        upv_usb_device_t& dev = devices[addr];
+        dev.config = value & 0xff;
+        dev.interfaces.clear();
+        dev.endpoints.clear();
+        dev.alt_setting.clear();
+        dev.state = dev.config ? UPV_DEV_CONFIGURED : UPV_DEV_ADDRESS;
+        for(size_t i=0;i<dev.config_desc.size() && dev.config;i++){
+            const std::vector<uint8_t>& cfg = dev.config_desc[i];
+            if(cfg.size() >= 9 && cfg[5] == dev.config){
+                parse_config(addr, &cfg[0], cfg.size());
+                break;
+            }
+        }
+        update_endpoints(addr);
+        event = UPV_ENUM_CONFIGURED;
+    }else if(type == 0x01 && req == 11){
+        // SET_INTERFACE
+        upv_usb_device_t& dev = devices[addr];
+        int iface = index & 0xff;
+        if(iface < (int)dev.alt_setting.size()){
+            dev.alt_setting[iface] = value & 0xff;
+            update_endpoints(addr);
+        }
+        event = UPV_ENUM_INTERFACE;
+    }else if(type == 0x02 && req == 1 && value == 0){
+        // CLEAR_FEATURE(ENDPOINT_HALT), the data toggle of the endpoint restarts at DATA0
+        event = UPV_ENUM_CLEAR_HALT;
+    }
+
+    if(event >= 0 && event_handler){
+        event_handler(context, addr, event);
+    }
+}
+
+void upv_enum_tracker::parse_config(int addr, const uint8_t* desc, int len)
+{
+    upv_usb_device_t& dev = devices[addr];
+    dev.interfaces.clear();
+    dev.endpoints.clear();
+    dev.alt_setting.clear();
+    upv_usb_interface_t* iface = NULL;
+    int pos = 0;
+    while(pos + 2 <= len){
+        int dlen = desc[pos];
+        int dtype = desc[pos+1];
+        if(dlen < 2 || pos + dlen > len){
+            break;
+        }
+        const uint8_t* d = desc + pos;
+        if(dtype == 4 && dlen >= 9){
+            upv_usb_interface_t it;
+            it.number = d[2];
+            it.alt = d[3];
+            it.num_ep = d[4];
+            it.iface_class = d[5];
+            it.iface_subclass = d[6];
+            it.iface_protocol = d[7];
+            dev.interfaces.push_back(it);
+            iface = &dev.interfaces.back();
+            if((int)dev.alt_setting.size() <= it.number){
+                dev.alt_setting.resize(it.number+1, 0);
+            }
+        }else if(dtype == 5 && dlen >= 7 && iface){
+            upv_usb_endpoint_t ep;
+            ep.address = d[2];
+            ep.attributes = d[3];
+            ep.max_packet = d[4] | (d[5]<<8);
+            ep.interval = d[6];
+            ep.iface = iface->number;
+            ep.alt = iface->alt;
+            dev.endpoints.push_back(ep);
+        }
+        pos += dlen;
+    }
+}
+
+void upv_enum_tracker::update_endpoints(int addr)
+{
+    upv_ep_info_t* table = ep_table[addr];
+    const upv_usb_device_t& dev = devices[addr];
+    memset(table, 0, sizeof(ep_table[0]));
+    for(int i=0;i<32;i++){
+        table[i].type = UPV_EP_TYPE_UNKNOWN;
+    }
+    table[0x00].type = UPV_EP_TYPE_CONTROL;
+    table[0x00].max_packet = dev.max_packet0;
+    table[0x10] = table[0x00];
+
+    for(size_t i=0;i<dev.endpoints.size();i++){
+        const upv_usb_endpoint_t& ep = dev.endpoints[i];
+        if(ep.iface >= dev.alt_setting.size() || dev.alt_setting[ep.iface] != ep.alt){
+            continue;
+        }
+        upv_ep_info_t& info = table[(ep.address & 0x0f) | ((ep.address & 0x80) ? 0x10 : 0)];
+        info.type = ep.attributes & 0x03;
+        info.iface = ep.iface;
+        info.interval = ep.interval;
+        info.max_packet = ep.max_packet;
+        for(size_t j=0;j<dev.interfaces.size();j++){
+            const upv_usb_interface_t& it = dev.interfaces[j];
+            if(it.number == ep.iface && it.alt == ep.alt){
+                info.iface_class = it.iface_class;
+                info.iface_subclass = it.iface_subclass;
+                info.iface_protocol = it.iface_protocol;
+                break;
+            }
+        }
+    }
+}
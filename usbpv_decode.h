@@ -0,0 +1,197 @@
+#ifndef __USBPV_DECODE_H__
+#define __USBPV_DECODE_H__
+
+#include "usbpv_s.h"
+#include <vector>
+
+// USB packet identifier, first byte of every captured data packet
+#define UPV_PID_OUT       0xE1
+#define UPV_PID_IN        0x69
+#define UPV_PID_SOF       0xA5
+#define UPV_PID_SETUP     0x2D
+#define UPV_PID_DATA0     0xC3
+#define UPV_PID_DATA1     0x4B
+#define UPV_PID_DATA2     0x87
+#define UPV_PID_MDATA     0x0F
+#define UPV_PID_ACK       0xD2
+#define UPV_PID_NAK       0x5A
+#define UPV_PID_STALL     0x1E
+#define UPV_PID_NYET      0x96
+#define UPV_PID_PRE       0x3C
+#define UPV_PID_SPLIT     0x78
+#define UPV_PID_PING      0xB4
+
+#define UPV_EP_TYPE_CONTROL   0
+#define UPV_EP_TYPE_ISO       1
+#define UPV_EP_TYPE_BULK      2
+#define UPV_EP_TYPE_INTERRUPT 3
+#define UPV_EP_TYPE_UNKNOWN   0xff
+
+#define UPV_TOKEN_ADDR(data)  ((data)[1] & 0x7f)
+#define UPV_TOKEN_EP(data)    ((((data)[1]>>7) | ((data)[2]<<1)) & 0x0f)
+
+// extend the 24 bit 60MHz tick to 64 bit, the gap between two packets must
+// less than one wrap (~280ms), SOF packets keep it true on an active bus
+struct upv_tick_ext{
+    upv_tick_ext():base(0),last(0){}
+    inline uint64_t extend(uint32_t tick){
+        if(tick < last){
+            base += (1<<24);
+        }
+        last = tick;
+        return base + tick;
+    }
+    void reset(){
+        base = 0;
+        last = 0;
+    }
+    uint64_t base;
+    uint32_t last;
+};
+
+// one USB transaction: token, optional data packet and optional handshake
+struct upv_xact_t{
+    uint64_t tick;       // extended tick of the token packet
+    uint8_t  token;      // UPV_PID_OUT/IN/SETUP/PING
+    uint8_t  addr;
+    uint8_t  ep;
+    uint8_t  speed;      // UPV_SPD_xxx
+    uint8_t  data_pid;   // 0 when there is no data packet
+    uint8_t  handshake;  // 0 when there is no handshake, e.g. isochronous
+    uint16_t len;        // payload length without PID and CRC16
+    const uint8_t* data; // payload, valid until next feed
+};
+
+// assemble transactions out of the packet stream
+class upv_xact_tracker
+{
+public:
+    upv_xact_tracker();
+    void reset();
+    /**
+     * feed one packet in the pfnt_on_packet form
+     * \returns 1 when xact holds a completed transaction, otherwise 0
+     */
+    int feed(unsigned long tick_60MHz, const uint8_t* data, unsigned long len, long status);
+
+public:
+    upv_xact_t xact;
+    upv_xact_t cur;
+    int state;
+    upv_tick_ext tick_ext;
+    uint8_t payload[1024];
+};
+
+struct upv_ep_info_t{
+    uint8_t  type;           // UPV_EP_TYPE_xxx
+    uint8_t  iface;          // bInterfaceNumber
+    uint8_t  iface_class;
+    uint8_t  iface_subclass;
+    uint8_t  iface_protocol;
+    uint8_t  interval;
+    uint16_t max_packet;
+};
+
+struct upv_usb_endpoint_t{
+    uint8_t  address;        // bEndpointAddress
+    uint8_t  attributes;
+    uint8_t  interval;
+    uint8_t  iface;
+    uint8_t  alt;
+    uint16_t max_packet;
+};
+
+struct upv_usb_interface_t{
+    uint8_t number;
+    uint8_t alt;
+    uint8_t iface_class;
+    uint8_t iface_subclass;
+    uint8_t iface_protocol;
+    uint8_t num_ep;
+};
+
+enum upv_dev_state{
+    UPV_DEV_NONE = 0,
+    UPV_DEV_DEFAULT,      // talking on address 0
+    UPV_DEV_ADDRESS,
+    UPV_DEV_CONFIGURED,
+};
+
+struct upv_usb_device_t{
+    int      state;          // upv_dev_state
+    uint8_t  speed;
+    uint8_t  config;         // active bConfigurationValue, 0 for unconfigured
+    uint16_t vid;
+    uint16_t pid;
+    uint8_t  max_packet0;
+    uint8_t  device_desc_len;
+    uint8_t  device_desc[18];
+    std::vector<std::vector<uint8_t> > config_desc;       // indexed by descriptor index
+    std::vector<upv_usb_interface_t> interfaces;          // all alternate settings of active config
+    std::vector<upv_usb_endpoint_t> endpoints;
+    std::vector<uint8_t> alt_setting;                     // current alt setting, indexed by interface number
+    std::vector<std::vector<uint8_t> > report_desc;       // HID report descriptor, indexed by interface number
+};
+
+struct upv_ctrl_xfer_t{
+    int      stage;
+    uint8_t  setup[8];
+    uint8_t  toggle;         // expected data PID
+    uint16_t len;
+    uint8_t  data[4096];
+};
+
+#define UPV_ENUM_RESET        0
+#define UPV_ENUM_ADDRESS      1
+#define UPV_ENUM_DEVICE_DESC  2
+#define UPV_ENUM_CONFIG_DESC  3
+#define UPV_ENUM_CONFIGURED   4
+#define UPV_ENUM_INTERFACE    5
+#define UPV_ENUM_REPORT_DESC  6
+#define UPV_ENUM_CLEAR_HALT   7     // CLEAR_FEATURE(ENDPOINT_HALT), wIndex in ctrl[addr].setup
+
+typedef void(UPV_CB* pfnt_on_enum_event)(void* context, int addr, int event);
+
+// build the device tree from the standard requests seen on the bus
+// the object is large, allocate it with new
+class upv_enum_tracker
+{
+public:
+    upv_enum_tracker();
+    void reset();
+
+    /**
+     * feed one packet in the pfnt_on_packet form
+     * \returns 1 when xact holds a completed transaction, otherwise 0
+     */
+    int feed(unsigned long tick_60MHz, const uint8_t* data, unsigned long len, long status);
+    static long UPV_CB on_packet(void* tracker, unsigned long tick_60MHz, const void* data, unsigned long len, long status);
+
+    const upv_usb_device_t* device(int addr) const {
+        return devices[addr & 0x7f].state == UPV_DEV_NONE ? NULL : &devices[addr & 0x7f];
+    }
+    inline const upv_ep_info_t* endpoint(int addr, int ep, int dir_in) const {
+        return &ep_table[addr & 0x7f][(ep & 0x0f) | (dir_in ? 0x10 : 0)];
+    }
+    inline int endpoint_type(int addr, int ep, int dir_in) const {
+        return endpoint(addr, ep, dir_in)->type;
+    }
+
+    void on_xact(const upv_xact_t& x);
+    void on_request(int addr, const uint8_t* setup, const uint8_t* data, int len);
+
+protected:
+    void clear_device(int addr);
+    void parse_config(int addr, const uint8_t* desc, int len);
+    void update_endpoints(int addr);
+
+public:
+    void* context;
+    pfnt_on_enum_event event_handler;
+    upv_xact_tracker tracker;
+    upv_usb_device_t devices[128];
+    upv_ctrl_xfer_t ctrl[128];
+    upv_ep_info_t ep_table[128][32];
+};
+
+#endif
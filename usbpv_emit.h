@@ -0,0 +1,73 @@
+#ifndef __USBPV_EMIT_H__
+#define __USBPV_EMIT_H__
+
+#include "usbpv_s.h"
+#include "usbpv_bw.h"
+#include "usbpv_search.h"
+#include "usbpv_ring.h"
+#include "usbpv_shm.h"
+#include "usbpv_fanout.h"
+#include "usbpv_health.h"
+
+/**
+ * Packet hook chain of upv_s
+ * Shared by process_data and the typed usbpv::session, so both feed the
+ * bandwidth, trigger, ring, shared memory, subscriber and merge hooks and the
+ * health sampling the same way. The final handler(tick, data, len, status)
+ * is a template parameter and inlines into the parse loop.
+ */
+template<typename H>
+inline void upv_emit_packet(upv_s* upv, const uint8_t* data, int len, H& handler)
+{
+    uint32_t tick = upv->pkt_tick;
+    int status = upv->pkt_status;
+    upv_bw_stats* bw = upv->bw_stats.load(std::memory_order_acquire);
+    if(bw){
+        bw->on_packet(tick, data, len, status);
+    }
+    upv_trigger* tr = upv->trigger.load(std::memory_order_acquire);
+    if(tr){
+        tr->on_packet(tick, data, len, status);
+    }
+    upv_packet_ring* pr = upv->ring.load(std::memory_order_acquire);
+    if(pr){
+        pr->push(tick, data, len, status);
+    }
+    upv_shm_writer* sw = upv->shm.load(std::memory_order_acquire);
+    if(sw){
+        sw->push(tick, data, len, status);
+    }
+    upv_fanout* fo = upv->fanout.load(std::memory_order_acquire);
+    if(fo){
+        fo->push(tick, data, len, status);
+    }
+    upv_packet_ring* mr = upv->merge_ring.load(std::memory_order_acquire);
+    if(mr){
+        mr->push(tick, data, len, status);
+    }
+    upv_health* hl = upv->health.load(std::memory_order_acquire);
+    if(hl && hl->sample()){
+        uint64_t t0 = upv_now_ns();
+        handler(tick, data, len, status);
+        hl->on_handler(upv_now_ns() - t0);
+    }else{
+        handler(tick, data, len, status);
+    }
+}
+
+// packets from the stream parser, counted then passed through the hooks
+template<typename H>
+struct upv_s_emitter{
+    upv_s* upv;
+    H* handler;
+    inline void operator()(uint32_t tick, const uint8_t* data, int len, int status){
+        (void)tick;
+        if(len&1){
+            upv->stats.fifo_remain.store(data[len], std::memory_order_relaxed);
+        }
+        upv_stat_add(upv->stats.packets[GetPacketType(status)], (uint64_t)1);
+        upv_emit_packet(upv, data, len, *handler);
+    }
+};
+
+#endif
@@ -0,0 +1,197 @@
+#include "usbpv_enum.h"
+#include "string.h"
+#include "stdio.h"
+#include "stdlib.h"
+#ifdef __linux__
+#include <dirent.h>
+#endif
+
+upv_enum_cache::upv_enum_cache()
+    :valid(0)
+    ,scan_ns(0)
+    ,dirty(0)
+    ,ctx(NULL)
+    ,hotplug(0)
+    ,has_hotplug(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+upv_enum_cache::~upv_enum_cache()
+{
+    if(ctx){
+        if(has_hotplug){
+            libusb_hotplug_deregister_callback(ctx, hotplug);
+        }
+        libusb_exit(ctx);
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+int LIBUSB_CALL upv_enum_cache::hotplug_callback(libusb_context* ctx, libusb_device* dev, libusb_hotplug_event event, void* user_data)
+{
+    (void)ctx;
+    (void)dev;
+    (void)event;
+    ((upv_enum_cache*)user_data)->dirty = 1;
+    return 0;
+}
+
+// register for arrival and removal of analyzers once
+int upv_enum_cache::watch()
+{
+    if(ctx){
+        return has_hotplug;
+    }
+    if(libusb_init(&ctx) < 0){
+        ctx = NULL;
+        return 0;
+    }
+    if(libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)){
+        int r = libusb_hotplug_register_callback(ctx,
+                (libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+                LIBUSB_HOTPLUG_NO_FLAGS, UPV_VID, UPV_PID, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, this, &hotplug);
+        has_hotplug = r == LIBUSB_SUCCESS;
+    }
+    return has_hotplug;
+}
+
+void upv_enum_cache::invalidate()
+{
+    dirty = 1;
+}
+
+list<string> upv_enum_cache::devices()
+{
+    pthread_mutex_lock(&mutex);
+    uint64_t now = upv_now_ns();
+    if(watch()){
+        // runs the callbacks of hotplug events queued since the last call, does not wait
+        struct timeval tv = {0, 0};
+        libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    }else if(now - scan_ns >= UPV_ENUM_TTL_MS*1000000ull){
+        dirty = 1;
+    }
+    if(!valid || dirty){
+        dirty = 0;
+        list<string> res;
+        if(scan_sysfs(res) < 0){
+            scan_usb(res);
+        }
+        cache.swap(res);
+        valid = 1;
+        scan_ns = now;
+    }
+    list<string> res = cache;
+    pthread_mutex_unlock(&mutex);
+    return res;
+}
+
+#ifdef __linux__
+static int read_attr(const char* dir, const char* name, char* buf, int size)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s/%s", UPV_SYSFS_USB, dir, name);
+    FILE* f = fopen(path, "r");
+    if(f == NULL){
+        return -1;
+    }
+    if(fgets(buf, size, f) == NULL){
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    buf[strcspn(buf, "\r\n")] = 0;
+    return 0;
+}
+#endif
+
+// devices and their attributes in sysfs, -1 when there is no sysfs
+int upv_enum_cache::scan_sysfs(list<string>& res)
+{
+#ifdef __linux__
+    DIR* d = opendir(UPV_SYSFS_USB);
+    if(d == NULL){
+        return -1;
+    }
+    struct dirent* e;
+    char tmpstr[256];
+    while((e = readdir(d)) != NULL){
+        // interfaces are named bus-port:config.interface
+        if(e->d_name[0] == '.' || strchr(e->d_name, ':')){
+            continue;
+        }
+        if(read_attr(e->d_name, "idVendor", tmpstr, sizeof(tmpstr)) < 0 || strtol(tmpstr, NULL, 16) != UPV_VID){
+            continue;
+        }
+        if(read_attr(e->d_name, "idProduct", tmpstr, sizeof(tmpstr)) < 0 || strtol(tmpstr, NULL, 16) != UPV_PID){
+            continue;
+        }
+        if(read_attr(e->d_name, "manufacturer", tmpstr, sizeof(tmpstr)) < 0 || strcmp(tmpstr, UPV_MAN) != 0){
+            continue;
+        }
+        if(read_attr(e->d_name, "serial", tmpstr, sizeof(tmpstr)) == 0){
+            res.push_back(tmpstr);
+        }else{
+            res.push_back("XXX");
+        }
+    }
+    closedir(d);
+    return (int)res.size();
+#else
+    (void)res;
+    return -1;
+#endif
+}
+
+// open every analyzer for its string descriptors
+int upv_enum_cache::scan_usb(list<string>& res)
+{
+    libusb_device** devs;
+    libusb_context* ctx;
+    int r;
+    ssize_t cnt;
+
+    libusb_device* dev;
+    int i = 0;
+    char tmpstr[256];
+
+    r = libusb_init(&ctx);
+    if (r < 0) {
+      return -1;
+    }
+
+    cnt = libusb_get_device_list(ctx, &devs);
+    if (cnt < 0) {
+      libusb_exit(ctx);
+      return -1;
+    }
+
+    while ((dev = devs[i++]) != NULL) {
+      struct libusb_device_descriptor desc;
+      int r = libusb_get_device_descriptor(dev, &desc);
+      if (r < 0) {
+        break;
+      }
+      if (desc.idVendor == UPV_VID && desc.idProduct == UPV_PID) {
+        libusb_device_handle* hdev;
+        if (libusb_open(dev, &hdev) >= 0) {
+          if (libusb_get_string_descriptor_ascii(hdev, desc.iManufacturer, (unsigned char*)tmpstr, sizeof(tmpstr)) >= 0) {
+            if (strncmp(tmpstr, UPV_MAN, sizeof(tmpstr)) == 0) {
+              if (libusb_get_string_descriptor_ascii(hdev, desc.iSerialNumber, (unsigned char*)tmpstr, sizeof(tmpstr)) >= 0) {
+                res.push_back(tmpstr);
+              }
+              else {
+                res.push_back("XXX");
+              }
+            }
+          }
+          libusb_close(hdev);
+        }
+      }
+    }
+
+    libusb_free_device_list(devs, 1);
+    libusb_exit(ctx);
+    return (int)res.size();
+}
@@ -0,0 +1,46 @@
+#ifndef __USBPV_ENUM_H__
+#define __USBPV_ENUM_H__
+
+#include "usbpv_s.h"
+
+#ifndef UPV_SYSFS_USB
+#define UPV_SYSFS_USB      "/sys/bus/usb/devices"
+#endif
+#define UPV_ENUM_TTL_MS    1000    // rescan interval without hotplug events
+
+/**
+ * Serial numbers of the connected analyzers, kept between calls
+ * On Linux the list is read from the sysfs attributes of the USB devices,
+ * no device is opened so a capture of another process is not disturbed.
+ * Elsewhere each analyzer is opened to read its string descriptors. The
+ * list is scanned again after a libusb hotplug event, or after
+ * UPV_ENUM_TTL_MS where libusb has no hotplug support.
+ */
+class upv_enum_cache
+{
+public:
+    upv_enum_cache();
+    ~upv_enum_cache();
+
+    list<string> devices();
+    // scan again on the next call
+    void invalidate();
+
+protected:
+    int  watch();
+    static int scan_sysfs(list<string>& res);
+    static int scan_usb(list<string>& res);
+    static int LIBUSB_CALL hotplug_callback(libusb_context* ctx, libusb_device* dev, libusb_hotplug_event event, void* user_data);
+
+public:
+    pthread_mutex_t mutex;
+    list<string> cache;
+    int valid;
+    uint64_t scan_ns;
+    volatile int dirty;             // set by the hotplug callback
+    libusb_context* ctx;            // only for hotplug events
+    libusb_hotplug_callback_handle hotplug;
+    int has_hotplug;
+};
+
+#endif
@@ -0,0 +1,227 @@
+#include "usbpv_fanout.h"
+#include "usbpv_decode.h"
+#include "string.h"
+#include <unistd.h>
+
+upv_fanout::upv_fanout(const upv_s* upv)
+    :block_count(0)
+    ,pushing(0)
+    ,upv(upv)
+{
+    pthread_mutex_init(&mutex, NULL);
+    for(int i=0;i<UPV_SUB_MAX;i++){
+        subs[i].store(NULL);
+    }
+}
+
+upv_fanout::~upv_fanout()
+{
+    for(int i=0;i<UPV_SUB_MAX;i++){
+        upv_subscriber* sub = subs[i].load();
+        if(sub){
+            unsubscribe(sub);
+        }
+    }
+    writer.close();
+    pthread_mutex_destroy(&mutex);
+}
+
+void upv_fanout::init_param(upv_sub_param_t* param)
+{
+    memset(param, 0, sizeof(*param));
+    param->filter.addr = -1;
+    param->filter.ep = -1;
+    param->mode = UPV_SUB_CALLBACK;
+    param->overflow = UPV_SUB_DROP;
+    param->batch_size = 256;
+}
+
+void* upv_fanout::sub_thread_callback(void* arg)
+{
+    upv_subscriber* sub = (upv_subscriber*)arg;
+    return sub->fanout->sub_thread_func(sub);
+}
+
+upv_subscriber* upv_fanout::subscribe(const upv_sub_param_t* param)
+{
+    if(param->mode != UPV_SUB_RING && param->handler == NULL){
+        return NULL;
+    }
+    pthread_mutex_lock(&mutex);
+    int slot = -1;
+    for(int i=0;i<UPV_SUB_MAX;i++){
+        if(subs[i].load() == NULL){
+            slot = i;
+            break;
+        }
+    }
+    if(slot < 0 || (writer.hdr == NULL && writer.open_local(UPV_FANOUT_RING_SIZE) != 0)){
+        pthread_mutex_unlock(&mutex);
+        return NULL;
+    }
+    upv_subscriber* sub = new upv_subscriber();
+    sub->fanout = this;
+    sub->param = *param;
+    if(sub->param.batch_size <= 0){
+        sub->param.batch_size = 256;
+    }
+    sub->reader.attach(&writer);
+    sub->done_pos.store(sub->reader.pos);
+    sub->finish.store(0);
+    sub->has_thread = 0;
+    sub->cur_addr = -1;
+    sub->cur_ep = 0;
+    sub->packets = 0;
+    sub->buf = NULL;
+    if(param->mode != UPV_SUB_RING){
+        sub->buf = new uint8_t[UPV_SUB_BUF_SIZE];
+        if(pthread_create(&sub->thread, NULL, sub_thread_callback, sub) != 0){
+            delete[] sub->buf;
+            delete sub;
+            pthread_mutex_unlock(&mutex);
+            return NULL;
+        }
+        sub->has_thread = 1;
+    }
+    if(param->overflow == UPV_SUB_BLOCK){
+        block_count++;
+    }
+    subs[slot].store(sub);
+    pthread_mutex_unlock(&mutex);
+    return sub;
+}
+
+void upv_fanout::unsubscribe(upv_subscriber* sub)
+{
+    pthread_mutex_lock(&mutex);
+    for(int i=0;i<UPV_SUB_MAX;i++){
+        if(subs[i].load() == sub){
+            subs[i].store(NULL);
+            if(sub->param.overflow == UPV_SUB_BLOCK){
+                block_count--;
+            }
+            break;
+        }
+    }
+    sub->finish.store(1);
+    // the parser may still look at it in wait_blocking
+    while(pushing.load()){
+        usleep(10);
+    }
+    if(sub->has_thread){
+        pthread_join(sub->thread, NULL);
+    }
+    pthread_mutex_unlock(&mutex);
+    delete[] sub->buf;
+    delete sub;
+}
+
+void upv_fanout::wait_blocking(int len)
+{
+    pushing.store(1);
+    uint64_t end = writer.head_after(len);
+    for(int i=0;i<UPV_SUB_MAX;i++){
+        upv_subscriber* sub = subs[i].load();
+        if(sub == NULL || sub->param.overflow != UPV_SUB_BLOCK){
+            continue;
+        }
+        while(end - sub->done_pos.load(std::memory_order_acquire) > writer.size && !sub->finish.load()){
+            // a stop timed out or the analyzer was lost, stop_capture joins the parser
+            if(upv && (upv->capture_abort || upv->capture_finish)){
+                break;
+            }
+            usleep(50);
+        }
+    }
+    pushing.store(0);
+}
+
+int upv_fanout::filter(upv_subscriber* sub, uint8_t* buf, int n, int* used)
+{
+    const upv_sub_filter_t& f = sub->param.filter;
+    int kept = 0;
+    int out = 0;
+    int pos = 0;
+    for(int i=0;i<n;i++){
+        upv_packet_t* p = (upv_packet_t*)(buf + pos);
+        int sz = UPV_PACKET_SIZE(p->len);
+        int type = GetPacketType(p->status);
+        int keep = 1;
+        if(type == UPV_DATA_PACKET && p->len > 0){
+            const uint8_t* data = UPV_PACKET_DATA(p);
+            uint8_t pid = data[0];
+            if(pid == UPV_PID_IN || pid == UPV_PID_OUT || pid == UPV_PID_SETUP || pid == UPV_PID_PING){
+                if(p->len >= 3){
+                    sub->cur_addr = UPV_TOKEN_ADDR(data);
+                    sub->cur_ep = UPV_TOKEN_EP(data);
+                }
+            }else if(pid == UPV_PID_SOF){
+                sub->cur_addr = -1;
+            }
+            if(f.pid_mask && !(f.pid_mask & (1u << (pid & 0x0f)))){
+                keep = 0;
+            }
+            if(f.addr >= 0 && sub->cur_addr != f.addr){
+                keep = 0;
+            }
+            if(f.ep >= 0 && (sub->cur_addr < 0 || sub->cur_ep != f.ep)){
+                keep = 0;
+            }
+        }
+        if(f.type_mask && !(f.type_mask & (1u << type))){
+            keep = 0;
+        }
+        if(keep){
+            if(out != pos){
+                memmove(buf + out, p, sz);
+            }
+            out += sz;
+            kept++;
+        }
+        pos += sz;
+    }
+    if(used){
+        *used = out;
+    }
+    return kept;
+}
+
+void* upv_fanout::sub_thread_func(upv_subscriber* sub)
+{
+    int max_packets = sub->param.mode == UPV_SUB_BATCH ? sub->param.batch_size : 4096;
+    while(!sub->finish.load()){
+        int used;
+        int n = sub->reader.read(sub->buf, UPV_SUB_BUF_SIZE, max_packets, 100, &used);
+        sub->done_pos.store(sub->reader.pos, std::memory_order_release);
+        if(n < 0){
+            break;
+        }
+        n = filter(sub, sub->buf, n, &used);
+        if(n == 0){
+            continue;
+        }
+        if(sub->param.mode == UPV_SUB_BATCH){
+            sub->param.handler(sub->param.context, (const upv_packet_t*)sub->buf, n);
+        }else{
+            const upv_packet_t* p = (const upv_packet_t*)sub->buf;
+            for(int i=0;i<n;i++,p=UPV_PACKET_NEXT(p)){
+                sub->param.handler(sub->param.context, p, 1);
+            }
+        }
+        sub->packets += n;
+    }
+    return NULL;
+}
+
+int upv_fanout::read(upv_subscriber* sub, void* buf, int buf_size, int max_packets, int timeout_ms)
+{
+    int used;
+    int n = sub->reader.read(buf, buf_size, max_packets, timeout_ms, &used);
+    sub->done_pos.store(sub->reader.pos, std::memory_order_release);
+    if(n <= 0){
+        return n;
+    }
+    n = filter(sub, (uint8_t*)buf, n, &used);
+    sub->packets += n;
+    return n;
+}
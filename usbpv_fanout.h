@@ -0,0 +1,70 @@
+#ifndef __USBPV_FANOUT_H__
+#define __USBPV_FANOUT_H__
+
+#include "usbpv_shm.h"
+
+#define UPV_SUB_MAX             16
+#define UPV_FANOUT_RING_SIZE    (32*1024*1024)
+#define UPV_SUB_BUF_SIZE        (1024*1024)
+
+class upv_fanout;
+
+struct upv_subscriber{
+    upv_fanout* fanout;
+    upv_sub_param_t param;
+    upv_shm_reader reader;
+    std::atomic<uint64_t> done_pos;     // ring position already copied out, for UPV_SUB_BLOCK
+    std::atomic<int> finish;
+    pthread_t thread;
+    int has_thread;
+    int cur_addr;                       // address of the last token, -1 after SOF
+    int cur_ep;
+    uint64_t packets;
+    uint8_t* buf;
+};
+
+/**
+ * Packet fan out to subscribers
+ * The parser pushes each packet once into an in process broadcast ring,
+ * every subscriber has its own reader, filter and thread (except ring mode).
+ * Subscribers with UPV_SUB_BLOCK hold the parser back when they fall behind,
+ * the others lose the oldest packets. The parser stops waiting for them when
+ * the capture of upv is aborted or finished, so a subscriber that is never
+ * read can't hold up a stop or close.
+ */
+class upv_fanout
+{
+public:
+    explicit upv_fanout(const upv_s* upv = NULL);
+    ~upv_fanout();
+
+    upv_subscriber* subscribe(const upv_sub_param_t* param);
+    void unsubscribe(upv_subscriber* sub);
+    // ring mode read with the subscriber filter applied
+    int read(upv_subscriber* sub, void* buf, int buf_size, int max_packets, int timeout_ms);
+
+    inline void push(uint32_t tick, const void* data, int len, long status){
+        if(block_count.load(std::memory_order_relaxed)){
+            wait_blocking(len);
+        }
+        writer.push(tick, data, len, status);
+    }
+
+    static void init_param(upv_sub_param_t* param);
+
+protected:
+    void wait_blocking(int len);
+    int  filter(upv_subscriber* sub, uint8_t* buf, int n, int* used);
+    void* sub_thread_func(upv_subscriber* sub);
+    static void* sub_thread_callback(void* arg);
+
+public:
+    upv_shm_writer writer;
+    pthread_mutex_t mutex;                      // serializes subscribe and unsubscribe
+    std::atomic<upv_subscriber*> subs[UPV_SUB_MAX];
+    std::atomic<int> block_count;
+    std::atomic<int> pushing;                   // parser is inside wait_blocking
+    const upv_s* upv;                           // capture being fanned out, optional
+};
+
+#endif
@@ -0,0 +1,75 @@
+#include "usbpv_health.h"
+#include "string.h"
+
+upv_health::upv_health()
+    :pool_low_pct(25)
+    ,fifo_low(64)
+    ,busy_pct(90)
+    ,context(NULL)
+    ,handler(NULL)
+    ,window_start(0)
+    ,busy_ns(0)
+    ,handler_calls(0)
+    ,handler_samples(0)
+    ,handler_sampled_ns(0)
+{
+    memset(&last, 0, sizeof(last));
+    memset(last_raise, 0, sizeof(last_raise));
+}
+
+void upv_health::raise(int kind, uint64_t now_ns)
+{
+    // one warning per kind and second, the handler runs in the parser thread
+    if(handler == NULL || (last_raise[kind] && now_ns - last_raise[kind] < UPV_HEALTH_REPEAT_NS)){
+        return;
+    }
+    last_raise[kind] = now_ns;
+    upv_warning_t w = last;
+    w.kind = kind;
+    handler(context, &w);
+}
+
+void upv_health::on_block(upv_s* upv, uint64_t deq_ns, uint64_t done_ns)
+{
+    int pool_total = sizeof(upv->mem_pool.mem)/sizeof(upv->mem_pool.mem[0]);
+    int pool_free = upv->mem_pool.free_count(NULL);
+    uint32_t fifo = upv->stats.fifo_remain.load(std::memory_order_relaxed);
+    last.pool_free = pool_free;
+    last.pool_total = pool_total;
+    last.fifo_remain = fifo;
+
+    if(window_start == 0){
+        window_start = deq_ns;
+    }
+    busy_ns += done_ns - deq_ns;
+    uint64_t window_ns = done_ns - window_start;
+    if(window_ns >= UPV_HEALTH_WINDOW_NS){
+        uint64_t handler_ns = 0;
+        if(handler_samples){
+            last.handler_avg_ns = handler_sampled_ns / handler_samples;
+            handler_ns = last.handler_avg_ns * handler_calls;
+            if(handler_ns > busy_ns){
+                handler_ns = busy_ns;
+            }
+        }else{
+            last.handler_avg_ns = 0;
+        }
+        last.busy_permille = (uint32_t)(busy_ns * 1000 / window_ns);
+        last.handler_permille = busy_ns ? (uint32_t)(handler_ns * 1000 / busy_ns) : 0;
+        last.parse_permille = busy_ns ? 1000 - last.handler_permille : 0;
+        window_start = done_ns;
+        busy_ns = 0;
+        handler_calls = 0;
+        handler_samples = 0;
+        handler_sampled_ns = 0;
+        if((int)last.busy_permille > busy_pct * 10){
+            raise(UPV_WARN_PARSER_BUSY, done_ns);
+        }
+    }
+    if(pool_free * 100 < pool_total * pool_low_pct){
+        raise(UPV_WARN_POOL_LOW, done_ns);
+    }
+    if((int)fifo < fifo_low){
+        raise(UPV_WARN_FIFO_LOW, done_ns);
+    }
+}
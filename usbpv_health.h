@@ -0,0 +1,50 @@
+#ifndef __USBPV_HEALTH_H__
+#define __USBPV_HEALTH_H__
+
+#include "usbpv_s.h"
+#include "usbpv_lib.h"
+
+#define UPV_HEALTH_SAMPLE_MASK  63          // time one handler call of 64
+#define UPV_HEALTH_WINDOW_NS    100000000ull
+#define UPV_HEALTH_REPEAT_NS    1000000000ull
+
+/**
+ * Slow consumer detection in the parser thread
+ * Parser busy time is measured per transfer buffer, handler time by sampling
+ * one call in 64. Pool and device FIFO headroom are checked after each
+ * buffer, so a warning is raised while there is still room left.
+ */
+class upv_health
+{
+public:
+    upv_health();
+
+    inline bool sample(){
+        return ((handler_calls++) & UPV_HEALTH_SAMPLE_MASK) == 0;
+    }
+    inline void on_handler(uint64_t ns){
+        handler_sampled_ns += ns;
+        handler_samples++;
+    }
+    void on_block(upv_s* upv, uint64_t deq_ns, uint64_t done_ns);
+
+protected:
+    void raise(int kind, uint64_t now_ns);
+
+public:
+    int pool_low_pct;               // warn below this share of free buffers
+    int fifo_low;                   // warn below this device FIFO room, of 255
+    int busy_pct;                   // warn above this parser busy share of a window
+    void* context;
+    pfn_warning_handler handler;
+
+    upv_warning_t last;             // headroom and shares of the last window
+    uint64_t window_start;
+    uint64_t busy_ns;
+    uint64_t handler_calls;
+    uint64_t handler_samples;
+    uint64_t handler_sampled_ns;
+    uint64_t last_raise[UPV_WARN_MAX];
+};
+
+#endif
@@ -0,0 +1,275 @@
+#include "usbpv_index.h"
+#include "string.h"
+#include <algorithm>
+
+void upv_bitmap::add(uint64_t pos)
+{
+    uint64_t key = pos >> 16;
+    uint16_t low = pos & 0xffff;
+    if(containers.empty() || containers.back().key != key){
+        containers.push_back(upv_bm_container_t());
+        upv_bm_container_t& c = containers.back();
+        c.key = key;
+        c.card = 0;
+    }
+    upv_bm_container_t& c = containers.back();
+    if(c.bits.empty()){
+        if(c.card < UPV_BM_ARRAY_MAX){
+            c.arr.push_back(low);
+            c.card++;
+            return;
+        }
+        // dense now, switch to bitmap
+        c.bits.assign(UPV_BM_WORDS, 0);
+        for(size_t i=0;i<c.arr.size();i++){
+            c.bits[c.arr[i] >> 6] |= 1ull << (c.arr[i] & 63);
+        }
+        std::vector<uint16_t>().swap(c.arr);
+    }
+    c.bits[low >> 6] |= 1ull << (low & 63);
+    c.card++;
+}
+
+void upv_bitmap::clear()
+{
+    std::vector<upv_bm_container_t>().swap(containers);
+}
+
+uint64_t upv_bitmap::cardinality() const
+{
+    uint64_t n = 0;
+    for(size_t i=0;i<containers.size();i++){
+        n += containers[i].card;
+    }
+    return n;
+}
+
+static bool container_key_less(const upv_bm_container_t& c, uint64_t key)
+{
+    return c.key < key;
+}
+
+const upv_bm_container_t* upv_bitmap::find(uint64_t key) const
+{
+    std::vector<upv_bm_container_t>::const_iterator it =
+            std::lower_bound(containers.begin(), containers.end(), key, container_key_less);
+    if(it == containers.end() || it->key != key){
+        return NULL;
+    }
+    return &*it;
+}
+
+int upv_bitmap::or_into(uint64_t key, uint64_t* words) const
+{
+    const upv_bm_container_t* c = find(key);
+    if(c == NULL){
+        return 0;
+    }
+    if(c->bits.empty()){
+        for(size_t i=0;i<c->arr.size();i++){
+            words[c->arr[i] >> 6] |= 1ull << (c->arr[i] & 63);
+        }
+    }else{
+        for(int i=0;i<UPV_BM_WORDS;i++){
+            words[i] |= c->bits[i];
+        }
+    }
+    return 1;
+}
+
+upv_packet_index::upv_packet_index(const upv_packet_store* store)
+    :store(store)
+    ,indexed_count(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+    memset(addr_ep_bm, 0, sizeof(addr_ep_bm));
+}
+
+upv_packet_index::~upv_packet_index()
+{
+    clear();
+    pthread_mutex_destroy(&mutex);
+}
+
+void upv_packet_index::clear()
+{
+    pthread_mutex_lock(&mutex);
+    for(int i=0;i<4096;i++){
+        delete addr_ep_bm[i];
+        addr_ep_bm[i] = NULL;
+    }
+    for(int i=0;i<16;i++){
+        pid_bm[i].clear();
+        type_bm[i].clear();
+    }
+    sparse_tick.clear();
+    indexed_count = 0;
+    pthread_mutex_unlock(&mutex);
+}
+
+void upv_packet_index::init_query(upv_index_query_t* q)
+{
+    q->addr = -1;
+    q->ep = -1;
+    q->dir_in = -1;
+    q->pid = -1;
+    q->type = -1;
+    q->tick_begin = 0;
+    q->tick_end = 0;
+}
+
+uint64_t upv_packet_index::sync()
+{
+    pthread_mutex_lock(&mutex);
+    uint64_t n = store->count();
+    store->for_each(indexed_count, n, [this](uint64_t pos, const upv_stored_packet_t& p){
+        if((pos & ((1<<UPV_INDEX_SPARSE_SHIFT)-1)) == 0){
+            sparse_tick.push_back(p.tick);
+        }
+        int type = GetPacketType(p.status);
+        type_bm[type].add(pos);
+        if(type == UPV_DATA_PACKET && p.len > 0){
+            pid_bm[p.data[0] & 0x0f].add(pos);
+        }
+        if(p.addr_ep != UPV_STORE_NO_ADDR_EP){
+            upv_bitmap*& bm = addr_ep_bm[p.addr_ep & 0xfff];
+            if(bm == NULL){
+                bm = new upv_bitmap();
+            }
+            bm->add(pos);
+        }
+    });
+    indexed_count = n;
+    pthread_mutex_unlock(&mutex);
+    return n;
+}
+
+uint64_t upv_packet_index::position_of_locked(uint64_t tick) const
+{
+    size_t j = std::lower_bound(sparse_tick.begin(), sparse_tick.end(), tick) - sparse_tick.begin();
+    uint64_t lo = j > 0 ? (uint64_t)(j-1) << UPV_INDEX_SPARSE_SHIFT : 0;
+    uint64_t hi = j < sparse_tick.size() ? (uint64_t)j << UPV_INDEX_SPARSE_SHIFT : indexed_count;
+    while(lo < hi){
+        uint64_t mid = lo + (hi - lo)/2;
+        if(store->tick_at(mid) < tick){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+uint64_t upv_packet_index::position_of(uint64_t tick)
+{
+    pthread_mutex_lock(&mutex);
+    uint64_t r = position_of_locked(tick);
+    pthread_mutex_unlock(&mutex);
+    return r;
+}
+
+int upv_packet_index::collect(const upv_index_query_t& q, std::vector<const upv_bitmap*>* groups, std::vector<int>* group_size) const
+{
+    if(q.addr >= 0 || q.ep >= 0 || q.dir_in >= 0){
+        int n = 0;
+        for(int a=0;a<128;a++){
+            if(q.addr >= 0 && a != q.addr) continue;
+            for(int e=0;e<16;e++){
+                if(q.ep >= 0 && e != q.ep) continue;
+                for(int d=0;d<2;d++){
+                    if(q.dir_in >= 0 && d != (q.dir_in ? 1 : 0)) continue;
+                    const upv_bitmap* bm = addr_ep_bm[UPV_STORE_ADDR_EP(a, e, d)];
+                    if(bm){
+                        groups->push_back(bm);
+                        n++;
+                    }
+                }
+            }
+        }
+        if(n == 0){
+            return -1;
+        }
+        group_size->push_back(n);
+    }
+    if(q.pid >= 0){
+        groups->push_back(&pid_bm[q.pid & 0x0f]);
+        group_size->push_back(1);
+    }
+    if(q.type >= 0){
+        groups->push_back(&type_bm[q.type & 0x0f]);
+        group_size->push_back(1);
+    }
+    return 0;
+}
+
+uint64_t upv_packet_index::query(const upv_index_query_t& q, std::vector<uint64_t>* positions, uint64_t max_count)
+{
+    std::vector<const upv_bitmap*> groups;
+    std::vector<int> group_size;
+    uint64_t found = 0;
+
+    pthread_mutex_lock(&mutex);
+    uint64_t first = q.tick_begin ? position_of_locked(q.tick_begin) : 0;
+    uint64_t last = q.tick_end ? position_of_locked(q.tick_end) : indexed_count;
+    if(first >= last || collect(q, &groups, &group_size) < 0){
+        pthread_mutex_unlock(&mutex);
+        return 0;
+    }
+
+    if(groups.empty()){
+        // time range only
+        for(uint64_t p=first;p<last;p++){
+            if(positions && found < max_count){
+                positions->push_back(p);
+            }
+            found++;
+        }
+        pthread_mutex_unlock(&mutex);
+        return found;
+    }
+
+    uint64_t acc[UPV_BM_WORDS];
+    uint64_t tmp[UPV_BM_WORDS];
+    for(uint64_t key=first>>16; key<=(last-1)>>16; key++){
+        size_t g = 0;
+        int empty = 0;
+        for(size_t k=0;k<group_size.size() && !empty;k++){
+            memset(tmp, 0, sizeof(tmp));
+            int any = 0;
+            for(int i=0;i<group_size[k];i++){
+                any |= groups[g+i]->or_into(key, tmp);
+            }
+            g += group_size[k];
+            if(!any){
+                empty = 1;
+            }else if(k == 0){
+                memcpy(acc, tmp, sizeof(acc));
+            }else{
+                for(int w=0;w<UPV_BM_WORDS;w++){
+                    acc[w] &= tmp[w];
+                }
+            }
+        }
+        if(empty){
+            continue;
+        }
+        uint64_t base = key << 16;
+        for(int w=0;w<UPV_BM_WORDS;w++){
+            uint64_t word = acc[w];
+            while(word){
+                int bit = __builtin_ctzll(word);
+                word &= word - 1;
+                uint64_t p = base + (w<<6) + bit;
+                if(p < first || p >= last){
+                    continue;
+                }
+                if(positions && found < max_count){
+                    positions->push_back(p);
+                }
+                found++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    return found;
+}
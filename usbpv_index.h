@@ -0,0 +1,86 @@
+#ifndef __USBPV_INDEX_H__
+#define __USBPV_INDEX_H__
+
+#include "usbpv_store.h"
+
+#define UPV_BM_ARRAY_MAX      4096       // array container turns into bitmap beyond it
+#define UPV_BM_WORDS          1024       // 65536 bits
+#define UPV_INDEX_SPARSE_SHIFT 10        // one tick entry every 1024 packets
+
+// positions sharing the same high 48 bits
+struct upv_bm_container_t{
+    uint64_t key;
+    uint32_t card;
+    std::vector<uint16_t> arr;
+    std::vector<uint64_t> bits;
+};
+
+// compressed bitmap of packet positions, positions must be added in increasing order
+class upv_bitmap
+{
+public:
+    void add(uint64_t pos);
+    void clear();
+    uint64_t cardinality() const;
+    const upv_bm_container_t* find(uint64_t key) const;
+    // OR the container of key into words, returns 0 when there is none
+    int or_into(uint64_t key, uint64_t* words) const;
+
+public:
+    std::vector<upv_bm_container_t> containers;
+};
+
+// -1 in any field means no filter
+struct upv_index_query_t{
+    int addr;
+    int ep;
+    int dir_in;
+    int pid;                 // PID byte, data packets only
+    int type;                // GetPacketType of status
+    uint64_t tick_begin;
+    uint64_t tick_end;       // 0 for no limit
+};
+
+/**
+ * Indexes over a upv_packet_store
+ * sync() indexes the packets appended to the store since the last call, it
+ * may run on any thread while the parser is appending. sync() and the queries
+ * are serialized by an internal lock.
+ */
+class upv_packet_index
+{
+public:
+    upv_packet_index(const upv_packet_store* store);
+    ~upv_packet_index();
+    void clear();
+
+    // returns number of indexed packets
+    uint64_t sync();
+    uint64_t indexed() const { return indexed_count; }
+
+    // first position with tick >= tick
+    uint64_t position_of(uint64_t tick);
+
+    /**
+     * positions of packets matching q in increasing order
+     * \returns number of matches, positions holds at most max_count of them
+     */
+    uint64_t query(const upv_index_query_t& q, std::vector<uint64_t>* positions, uint64_t max_count = ~0ull);
+
+    static void init_query(upv_index_query_t* q);
+
+protected:
+    uint64_t position_of_locked(uint64_t tick) const;
+    int collect(const upv_index_query_t& q, std::vector<const upv_bitmap*>* groups, std::vector<int>* group_size) const;
+
+public:
+    const upv_packet_store* store;
+    pthread_mutex_t mutex;
+    uint64_t indexed_count;
+    upv_bitmap* addr_ep_bm[4096];
+    upv_bitmap pid_bm[16];
+    upv_bitmap type_bm[16];
+    std::vector<uint64_t> sparse_tick;
+};
+
+#endif
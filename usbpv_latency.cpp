@@ -0,0 +1,60 @@
+#include "usbpv_latency.h"
+#include "string.h"
+
+upv_latency_hist::upv_latency_hist()
+{
+    reset();
+}
+
+void upv_latency_hist::reset()
+{
+    for(int i=0;i<UPV_LAT_BUCKETS;i++){
+        counts[i].store(0, std::memory_order_relaxed);
+    }
+    max_ns.store(0, std::memory_order_relaxed);
+}
+
+uint64_t upv_latency_hist::bucket_high(int idx)
+{
+    if(idx < (1<<UPV_LAT_SUB_BITS)){
+        return idx;
+    }
+    int e = (idx >> UPV_LAT_SUB_BITS) + UPV_LAT_SUB_BITS - 1;
+    uint64_t sub = idx & ((1<<UPV_LAT_SUB_BITS) - 1);
+    uint64_t low = (((uint64_t)1 << UPV_LAT_SUB_BITS) + sub) << (e - UPV_LAT_SUB_BITS);
+    return low + ((uint64_t)1 << (e - UPV_LAT_SUB_BITS)) - 1;
+}
+
+void upv_latency_hist::query(upv_latency_info_t* info) const
+{
+    static const uint64_t per_mille[4] = {500, 900, 990, 999};
+    uint64_t* out[4] = {&info->p50_ns, &info->p90_ns, &info->p99_ns, &info->p999_ns};
+    uint64_t snap[UPV_LAT_BUCKETS];
+    uint64_t total = 0;
+    memset(info, 0, sizeof(*info));
+    for(int i=0;i<UPV_LAT_BUCKETS;i++){
+        snap[i] = counts[i].load(std::memory_order_relaxed);
+        total += snap[i];
+    }
+    info->count = total;
+    info->max_ns = max_ns.load(std::memory_order_relaxed);
+    if(total == 0){
+        return;
+    }
+    uint64_t acc = 0;
+    int q = 0;
+    for(int i=0;i<UPV_LAT_BUCKETS && q<4;i++){
+        acc += snap[i];
+        while(q<4 && acc*1000 >= total*per_mille[q]){
+            uint64_t v = bucket_high(i);
+            *out[q++] = v < info->max_ns ? v : info->max_ns;
+        }
+    }
+}
+
+void upv_latency::reset()
+{
+    queue.reset();
+    process.reset();
+    total.reset();
+}
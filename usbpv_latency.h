@@ -0,0 +1,67 @@
+#ifndef __USBPV_LATENCY_H__
+#define __USBPV_LATENCY_H__
+
+#include "usbpv_s.h"
+#include "usbpv_lib.h"
+
+// 8 linear buckets per power of two, about 12% error over the whole uint64 range
+#define UPV_LAT_SUB_BITS  3
+#define UPV_LAT_BUCKETS   ((64 - UPV_LAT_SUB_BITS + 1) << UPV_LAT_SUB_BITS)
+
+/**
+ * Log linear latency histogram in nanoseconds
+ * One thread records, queries may run from any thread without lock.
+ */
+class upv_latency_hist
+{
+public:
+    upv_latency_hist();
+    void reset();
+
+    static inline int bucket_of(uint64_t ns){
+        if(ns < (1u<<UPV_LAT_SUB_BITS)){
+            return (int)ns;
+        }
+        int e = 63 - __builtin_clzll(ns);
+        int sub = (int)(ns >> (e - UPV_LAT_SUB_BITS)) & ((1<<UPV_LAT_SUB_BITS) - 1);
+        return ((e - UPV_LAT_SUB_BITS + 1) << UPV_LAT_SUB_BITS) + sub;
+    }
+    // largest value of a bucket
+    static uint64_t bucket_high(int idx);
+
+    inline void record(uint64_t ns){
+        upv_stat_add(counts[bucket_of(ns)], (uint64_t)1);
+        if(ns > max_ns.load(std::memory_order_relaxed)){
+            max_ns.store(ns, std::memory_order_relaxed);
+        }
+    }
+    void query(upv_latency_info_t* info) const;
+
+public:
+    std::atomic<uint64_t> counts[UPV_LAT_BUCKETS];
+    std::atomic<uint64_t> max_ns;
+};
+
+/**
+ * Latency of each transfer buffer through the capture
+ * queue: usb_data_callback to parser dequeue
+ * process: parser dequeue to return of the last handler of the buffer
+ * total: usb_data_callback to handler return
+ */
+class upv_latency
+{
+public:
+    inline void on_block(uint64_t rx_ns, uint64_t deq_ns, uint64_t done_ns){
+        queue.record(deq_ns - rx_ns);
+        process.record(done_ns - deq_ns);
+        total.record(done_ns - rx_ns);
+    }
+    void reset();
+
+public:
+    upv_latency_hist queue;
+    upv_latency_hist process;
+    upv_latency_hist total;
+};
+
+#endif
@@ -1,5 +1,17 @@
 #include "usbpv_lib.h"
 #include "usbpv_s.h"
+#include "usbpv_class.h"
+#include "usbpv_bw.h"
+#include "usbpv_search.h"
+#include "usbpv_ring.h"
+#include "usbpv_shm.h"
+#include "usbpv_fanout.h"
+#include "usbpv_latency.h"
+#include "usbpv_health.h"
+#include "usbpv_thread.h"
+#include "usbpv_manager.h"
+#include "usbpv_merge.h"
+#include "usbpv_reconnect.h"
 #include "string.h"
 
 #ifdef _WIN32
@@ -9,6 +21,7 @@
 
 static char dev_list[4096];
 static int last_error_code;
+static upv_reconnect reconnector;
 
 int upv_get_last_error()
 {
@@ -26,6 +39,8 @@ const char* upv_get_error_string(int errorCode)
     case upv_s::R_WriteConfig: return "Device write data fail";
     case upv_s::R_EEInit: return "Device EE init fail";
     case upv_s::R_Thread: return "Device init process thread fail";
+    case upv_s::R_Shm: return "Shared memory create fail";
+    case upv_s::R_Timeout: return "Device operation timeout";
     }
     return "Device unkown error";
 }
@@ -43,6 +58,15 @@ const char* upv_list_devices()
     return dev_list;
 }
 
+// The hooks of upv_s are read by the parser thread without a lock. A hook is
+// turned off by publishing NULL, its object is kept until the handle is closed
+// because the parser may still be inside it, and reused when turned on again.
+template<typename T>
+static inline void publish_hook(std::atomic<T*>& hook, T* obj)
+{
+    hook.store(obj, std::memory_order_release);
+}
+
 #define UPV_FREQ_HZ (60000000)
 // convert tick to real timestamp
 struct upv_wrap : public upv_s{
@@ -52,10 +76,68 @@ struct upv_wrap : public upv_s{
     uint32_t last_ov_ts; /**< Last seen OpenVizsla timestamp. Used to detect overflows */
     uint32_t ts_offset;  /**< Timestamp offset in 1/OV_TIMESTAMP_FREQ_HZ units */
     struct timespec last_ts;
+    std::atomic<upv_class_decoder*> class_decoder;
+    list<upv_class_decoder*> retired_decoders;   // replaced while the parser may feed them
+    upv_bw_stats* bw;
+    upv_trigger* trig;
+    upv_packet_ring* pull_ring;
+    upv_shm_writer* shm_writer;
+    upv_fanout* fan;
+    upv_latency* lat;
+    list<upv_latency*> retired_lat;   // replaced while the parser may record into them
+    upv_health* hl;
+    list<upv_health*> retired_health;  // replaced while the parser may check them
+    upv_open_param_t open_param;
+    upv_manager* manager;
+    upv_merger* merger;
+    int auto_reconnect;
+
+    ~upv_wrap()
+    {
+        end_reconnect();
+        // stop the parser thread before the decoder goes away
+        close();
+        if(manager){
+            manager->detach(this);
+        }
+        if(merger){
+            merger->remove(this);
+        }
+        delete class_decoder.load();
+        for(list<upv_class_decoder*>::iterator it = retired_decoders.begin(); it != retired_decoders.end(); ++it){
+            delete *it;
+        }
+        delete bw;
+        delete trig;
+        delete pull_ring;
+        delete shm_writer;
+        delete fan;
+        delete lat;
+        for(list<upv_latency*>::iterator it = retired_lat.begin(); it != retired_lat.end(); ++it){
+            delete *it;
+        }
+        delete hl;
+        for(list<upv_health*>::iterator it = retired_health.begin(); it != retired_health.end(); ++it){
+            delete *it;
+        }
+    }
+
+    // no reopen from the watch thread after this
+    void end_reconnect()
+    {
+        if(auto_reconnect){
+            reconnector.remove(this);
+            auto_reconnect = 0;
+        }
+    }
 
     long on_packet(unsigned long tick_60MHz, const void* data, unsigned long len, long status)
     {
         uint32_t nsec;
+        upv_class_decoder* decoder = class_decoder.load(std::memory_order_acquire);
+        if(decoder){
+            decoder->feed(tick_60MHz, (const uint8_t*)data, len, status);
+        }
         /* Increment timestamp based on the 60 MHz 24-bit counter value.
          * Convert remaining clocks to nanoseconds: 1 clk = 1 / 60 MHz = 16.(6) ns
          */
@@ -109,7 +191,14 @@ long UPV_CB on_packet(upv_wrap* wrap, unsigned long tick_60MHz, const void* data
 
 long UPV_CB on_packet_fast(upv_wrap* wrap, unsigned long tick_60MHz, const void* data, unsigned long len, long status)
 {
-    return wrap->callback(wrap->context, 0, tick_60MHz, data, len, status);
+    upv_class_decoder* decoder = wrap->class_decoder.load(std::memory_order_acquire);
+    if(decoder){
+        decoder->feed(tick_60MHz, (const uint8_t*)data, len, status);
+    }
+    if(wrap->callback){
+        return wrap->callback(wrap->context, 0, tick_60MHz, data, len, status);
+    }
+    return 0;
 }
 
 UPV_HANDLE upv_open_device(
@@ -137,6 +226,67 @@ error:
     return NULL;
 }
 
+void upv_init_open_param(upv_open_param_t* param)
+{
+    static const char* names[UPV_THREAD_MAX] = {"upv_reader", "upv_parser", "upv_stats"};
+    memset(param, 0, sizeof(*param));
+    for(int i=0;i<UPV_THREAD_MAX;i++){
+        param->thread[i].policy = UPV_SCHED_OTHER;
+        strcpy(param->thread[i].name, names[i]);
+    }
+}
+
+static UPV_HANDLE open_device_on(
+        upv_manager* manager,
+        const char* option,
+        int opt_len,
+        void* context,
+        pfn_packet_handler callback,
+        const upv_open_param_t* param)
+{
+
+    upv_wrap* pv = new upv_wrap();
+    pv->context = context;
+    pv->callback = callback;
+    if(manager){
+        if(manager->attach(pv) != 0){
+            delete pv;
+            last_error_code = upv_s::R_Thread;
+            return NULL;
+        }
+        pv->manager = manager;
+    }
+    if(param){
+        pv->open_param = *param;
+        pv->thread_param = pv->open_param.thread;
+        pv->inline_parse = param->inline_parse;
+        pv->latency_target_ms = param->latency_target_ms;
+    }
+    int r = pv->open(option, opt_len);
+    if(r != upv_s::R_Success){
+        goto error;
+    }
+    r = pv->start_capture(pv, (pfnt_on_packet)on_packet);
+    if(r != upv_s::R_Success){
+        goto error;
+    }
+    return pv;
+error:
+    delete pv;
+    last_error_code = r;
+    return NULL;
+}
+
+UPV_HANDLE upv_open_device_ex(
+        const char* option,
+        int opt_len,
+        void* context,
+        pfn_packet_handler callback,
+        const upv_open_param_t* param)
+{
+    return open_device_on(NULL, option, opt_len, context, callback, param);
+}
+
 UPV_HANDLE upv_open_device_fast(
         const char* option,
         int opt_len,
@@ -162,11 +312,37 @@ error:
     return NULL;
 }
 
+UPV_HANDLE upv_open_device_pull(
+        const char* option,
+        int opt_len,
+        int ring_size)
+{
+
+    upv_wrap* pv = new upv_wrap();
+    pv->pull_ring = new upv_packet_ring(ring_size > 0 ? ring_size : UPV_RING_DEFAULT_SIZE);
+    publish_hook(pv->ring, pv->pull_ring);
+    int r = pv->open(option, opt_len);
+    if(r != upv_s::R_Success){
+        goto error;
+    }
+    // packets go to the ring, the handler only feeds the decoders
+    r = pv->start_capture(pv, (pfnt_on_packet)on_packet_fast);
+    if(r != upv_s::R_Success){
+        goto error;
+    }
+    return pv;
+error:
+    delete pv;
+    last_error_code = r;
+    return NULL;
+}
+
 int upv_close_device(UPV_HANDLE upv)
 {
     upv_wrap* pv = (upv_wrap*)upv;
     upv_s::upv_result r = upv_s::R_Success;
     if(pv != NULL){
+        pv->end_reconnect();
         r = pv->close();
         delete pv;
     }
@@ -181,3 +357,495 @@ int upv_get_monitor_speed(UPV_HANDLE upv)
     }
     return pv->bcdUSB >= 0x300?1:0;
 }
+
+int upv_set_class_handler(UPV_HANDLE upv, void* context, pfn_class_handler callback)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    // the parser may be inside the current decoder, it is never changed but
+    // replaced by a new one with the handler set before it is published
+    upv_class_decoder* old = pv->class_decoder.load();
+    upv_class_decoder* decoder = NULL;
+    if(callback){
+        decoder = new upv_class_decoder();
+        decoder->context = context;
+        decoder->record_handler = callback;
+    }
+    publish_hook(pv->class_decoder, decoder);
+    if(old){
+        pv->retired_decoders.push_back(old);
+    }
+    return upv_s::R_Success;
+}
+
+int upv_enable_bandwidth(UPV_HANDLE upv, int enable)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    if(enable && pv->bw == NULL){
+        pv->bw = new upv_bw_stats();
+    }
+    publish_hook(pv->bw_stats, enable ? pv->bw : NULL);
+    return upv_s::R_Success;
+}
+
+int upv_get_bandwidth(UPV_HANDLE upv, upv_bw_info_t* info, int max_count)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    if(pv->bw == NULL || info == NULL || max_count <= 0){
+        return 0;
+    }
+    return pv->bw->query(info, max_count);
+}
+
+static upv_trigger* get_trigger(upv_wrap* pv)
+{
+    if(pv->trig == NULL){
+        pv->trig = new upv_trigger();
+        publish_hook(pv->trigger, pv->trig);
+    }
+    return pv->trig;
+}
+
+int upv_set_trigger_handler(UPV_HANDLE upv, void* context, pfn_trigger_handler callback)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    upv_trigger* trig = get_trigger(pv);
+    trig->set_handler(context, callback);
+    return upv_s::R_Success;
+}
+
+int upv_add_trigger_pattern(UPV_HANDLE upv, const uint8_t* bytes, const uint8_t* mask, int len)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    return get_trigger(pv)->matcher.add(bytes, mask, len);
+}
+
+int upv_read_packets(UPV_HANDLE upv, void* buf, int buf_size, int max_packets, int timeout_ms)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL || pv->pull_ring == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    if(buf == NULL || max_packets <= 0){
+        return 0;
+    }
+    return pv->pull_ring->read(buf, buf_size, max_packets, timeout_ms, NULL);
+}
+
+int upv_get_read_fd(UPV_HANDLE upv)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL || pv->pull_ring == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    return pv->pull_ring->fd();
+}
+
+int upv_publish_shm(UPV_HANDLE upv, const char* name, int ring_size)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    if(name == NULL){
+        publish_hook(pv->shm, (upv_shm_writer*)NULL);
+        return upv_s::R_Success;
+    }
+    if(pv->shm_writer == NULL){
+        upv_shm_writer* writer = new upv_shm_writer();
+        if(writer->open(name, ring_size > 0 ? ring_size : UPV_SHM_DEFAULT_SIZE) != 0){
+            delete writer;
+            return upv_s::R_Shm;
+        }
+        pv->shm_writer = writer;
+    }else if(pv->shm_writer->name != name){
+        // the ring can't be renamed while the parser may write it
+        return upv_s::R_Shm;
+    }
+    publish_hook(pv->shm, pv->shm_writer);
+    return upv_s::R_Success;
+}
+
+UPV_SHM upv_shm_open(const char* name)
+{
+    upv_shm_reader* reader = new upv_shm_reader();
+    if(name == NULL || reader->open(name) != 0){
+        delete reader;
+        return NULL;
+    }
+    return reader;
+}
+
+int upv_shm_read(UPV_SHM shm, void* buf, int buf_size, int max_packets, int timeout_ms)
+{
+    upv_shm_reader* reader = (upv_shm_reader*)shm;
+    if(reader == NULL){
+        return -1;
+    }
+    if(buf == NULL || max_packets <= 0){
+        return 0;
+    }
+    return reader->read(buf, buf_size, max_packets, timeout_ms, NULL);
+}
+
+int upv_shm_get_overruns(UPV_SHM shm, uint64_t* overruns, uint64_t* lost_bytes)
+{
+    upv_shm_reader* reader = (upv_shm_reader*)shm;
+    if(reader == NULL){
+        return -1;
+    }
+    if(overruns){
+        *overruns = reader->overruns;
+    }
+    if(lost_bytes){
+        *lost_bytes = reader->lost_bytes;
+    }
+    return 0;
+}
+
+void upv_shm_close(UPV_SHM shm)
+{
+    delete (upv_shm_reader*)shm;
+}
+
+void upv_init_sub_param(upv_sub_param_t* param)
+{
+    upv_fanout::init_param(param);
+}
+
+UPV_SUB upv_subscribe(UPV_HANDLE upv, const upv_sub_param_t* param)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL || param == NULL){
+        return NULL;
+    }
+    if(pv->fan == NULL){
+        pv->fan = new upv_fanout(pv);
+    }
+    upv_subscriber* sub = pv->fan->subscribe(param);
+    if(sub){
+        // the ring exists now, let the parser write it
+        publish_hook(pv->fanout, pv->fan);
+    }
+    return sub;
+}
+
+int upv_sub_read(UPV_SUB sub, void* buf, int buf_size, int max_packets, int timeout_ms)
+{
+    upv_subscriber* s = (upv_subscriber*)sub;
+    if(s == NULL || s->param.mode != UPV_SUB_RING){
+        return -1;
+    }
+    if(buf == NULL || max_packets <= 0){
+        return 0;
+    }
+    return s->fanout->read(s, buf, buf_size, max_packets, timeout_ms);
+}
+
+int upv_sub_get_stats(UPV_SUB sub, uint64_t* packets, uint64_t* lost_bytes)
+{
+    upv_subscriber* s = (upv_subscriber*)sub;
+    if(s == NULL){
+        return -1;
+    }
+    if(packets){
+        *packets = s->packets;
+    }
+    if(lost_bytes){
+        *lost_bytes = s->reader.lost_bytes;
+    }
+    return 0;
+}
+
+void upv_unsubscribe(UPV_SUB sub)
+{
+    upv_subscriber* s = (upv_subscriber*)sub;
+    if(s){
+        s->fanout->unsubscribe(s);
+    }
+}
+
+int upv_get_stats(UPV_HANDLE upv, upv_stats_t* stats, int size)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    if(stats == NULL || size < (int)(2*sizeof(uint32_t))){
+        return -1;
+    }
+    upv_stats_t st;
+    upv_s_stats& c = pv->stats;
+    memset(&st, 0, sizeof(st));
+    st.version = UPV_STATS_VERSION;
+    st.size = size < (int)sizeof(st) ? size : (int)sizeof(st);
+    st.rx_bytes = c.rx_bytes.load(std::memory_order_relaxed);
+    st.parsed_bytes = c.parsed_bytes.load(std::memory_order_relaxed);
+    st.transfers = c.transfers.load(std::memory_order_relaxed);
+    for(int i=0;i<16;i++){
+        st.packets[i] = c.packets[i].load(std::memory_order_relaxed);
+    }
+    st.recoveries = pv->recover_count.load(std::memory_order_relaxed);
+    st.overflows = st.packets[UPV_OVERFLOW];
+    int min_free = 0;
+    st.pool_total = sizeof(pv->mem_pool.mem)/sizeof(pv->mem_pool.mem[0]);
+    st.pool_free = pv->mem_pool.free_count(&min_free);
+    st.pool_free_min = min_free;
+    upv_queue<buf_data_t>* q = pv->buf_data_q;
+    st.queue_depth = q ? q->count() : 0;
+    st.fifo_remain = c.fifo_remain.load(std::memory_order_relaxed);
+    st.last_rx_len = c.last_rx_len.load(std::memory_order_relaxed);
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    st.elapsed_ms = (uint64_t)(now.tv_sec - c.start_time.tv_sec) * 1000
+            + (now.tv_usec - c.start_time.tv_usec) / 1000;
+    for(int i=0;i<UPV_THREAD_MAX;i++){
+        st.ctx_switches[i] = upv_thread_ctx_switches(pv->thread_tid[i].load());
+    }
+    upv_open_times& o = pv->open_times;
+    st.open_time.usb_open_us = (uint32_t)(o.usb_open_ns / 1000);
+    st.open_time.reset_us = (uint32_t)(o.reset_ns / 1000);
+    st.open_time.load_us = (uint32_t)(o.load_ns / 1000);
+    st.open_time.start_us = (uint32_t)(o.start_ns / 1000);
+    st.open_time.config_us = (uint32_t)(o.config_ns / 1000);
+    st.open_time.total_us = (uint32_t)(o.total_ns / 1000);
+    st.open_time.config_writes = o.config_writes;
+    st.open_time.config_batched = o.config_batched;
+    st.load_skipped = o.load_skipped;
+    st.reconnects = pv->reconnects;
+    st.init_us = (uint32_t)(o.init_ns / 1000);
+    st.match_us = (uint32_t)(o.match_ns / 1000);
+    st.check_us = (uint32_t)(o.check_ns / 1000);
+    st.drain_us = (uint32_t)(o.drain_ns / 1000);
+    st.status_polls = o.status_polls;
+    st.pool_stalls = c.pool_stalls.load(std::memory_order_relaxed);
+    if(pv->lat){
+        pv->lat->queue.query(&st.queue_latency);
+        pv->lat->process.query(&st.process_latency);
+        pv->lat->total.query(&st.total_latency);
+    }
+    memcpy(stats, &st, st.size);
+    return st.size;
+}
+
+int upv_set_stats_print(UPV_HANDLE upv, int interval_ms)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    return pv->set_stats_print(interval_ms) == 0 ? upv_s::R_Success : upv_s::R_Thread;
+}
+
+int upv_enable_latency(UPV_HANDLE upv, int enable)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    if(enable){
+        if(pv->lat == NULL){
+            pv->lat = new upv_latency();
+        }else if(pv->capture_running){
+            // start from empty histograms without touching the ones being recorded
+            pv->retired_lat.push_back(pv->lat);
+            pv->lat = new upv_latency();
+        }else{
+            pv->lat->reset();
+        }
+    }
+    publish_hook(pv->latency, enable ? pv->lat : NULL);
+    return upv_s::R_Success;
+}
+
+// The parser reads handler, context and limits of the published upv_health
+// without a lock, so they are never changed there. A change goes into a copy
+// of the settings that is published in place of the old one.
+static upv_health* next_health(upv_wrap* pv)
+{
+    upv_health* hl = new upv_health();
+    if(pv->hl){
+        hl->pool_low_pct = pv->hl->pool_low_pct;
+        hl->fifo_low = pv->hl->fifo_low;
+        hl->busy_pct = pv->hl->busy_pct;
+        hl->context = pv->hl->context;
+        hl->handler = pv->hl->handler;
+        pv->retired_health.push_back(pv->hl);
+    }
+    pv->hl = hl;
+    return hl;
+}
+
+int upv_set_warning_handler(UPV_HANDLE upv, void* context, pfn_warning_handler callback)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    upv_health* hl = next_health(pv);
+    hl->context = context;
+    hl->handler = callback;
+    publish_hook(pv->health, callback ? hl : NULL);
+    return upv_s::R_Success;
+}
+
+int upv_set_warning_limits(UPV_HANDLE upv, int pool_low_pct, int fifo_low, int busy_pct)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    upv_health* hl = next_health(pv);
+    hl->pool_low_pct = pool_low_pct;
+    hl->fifo_low = fifo_low;
+    hl->busy_pct = busy_pct;
+    publish_hook(pv->health, hl->handler ? hl : NULL);
+    return upv_s::R_Success;
+}
+
+int upv_set_capture_config(UPV_HANDLE upv, const char* config, int config_len)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    return pv->reconfigure(config, config_len);
+}
+
+int upv_pause_capture(UPV_HANDLE upv, int timeout_ms)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    return pv->pause_capture(timeout_ms);
+}
+
+int upv_resume_capture(UPV_HANDLE upv)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    return pv->resume_capture();
+}
+
+int upv_set_auto_reconnect(UPV_HANDLE upv, int enable)
+{
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(pv == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    if(!enable){
+        pv->end_reconnect();
+        return upv_s::R_Success;
+    }
+    if(pv->auto_reconnect){
+        return upv_s::R_Success;
+    }
+    if(reconnector.add(pv) != 0){
+        return upv_s::R_Thread;
+    }
+    pv->auto_reconnect = 1;
+    return upv_s::R_Success;
+}
+
+UPV_MANAGER upv_manager_create(int event_threads, const upv_thread_param_t* param)
+{
+    upv_manager* mgr = new upv_manager();
+    if(mgr->start(event_threads, param) != 0){
+        delete mgr;
+        last_error_code = upv_s::R_Thread;
+        return NULL;
+    }
+    return mgr;
+}
+
+UPV_HANDLE upv_manager_open_device(
+        UPV_MANAGER manager,
+        const char* option,
+        int option_len,
+        void* context,
+        pfn_packet_handler callback,
+        const upv_open_param_t* param)
+{
+    if(manager == NULL){
+        last_error_code = upv_s::R_DeviceNotOpen;
+        return NULL;
+    }
+    return open_device_on((upv_manager*)manager, option, option_len, context, callback, param);
+}
+
+int upv_manager_destroy(UPV_MANAGER manager)
+{
+    upv_manager* mgr = (upv_manager*)manager;
+    if(mgr == NULL){
+        return upv_s::R_Success;
+    }
+    if(mgr->stop() != 0){
+        return upv_s::R_DeviceStatus;
+    }
+    delete mgr;
+    return upv_s::R_Success;
+}
+
+UPV_MERGE upv_merge_create(void* context, pfn_merge_handler callback, int window_ms)
+{
+    upv_merger* merger = new upv_merger();
+    if(merger->start(context, callback, window_ms) != 0){
+        delete merger;
+        last_error_code = upv_s::R_Thread;
+        return NULL;
+    }
+    return merger;
+}
+
+int upv_merge_add(UPV_MERGE merge, UPV_HANDLE upv)
+{
+    upv_merger* merger = (upv_merger*)merge;
+    upv_wrap* pv = (upv_wrap*)upv;
+    if(merger == NULL || pv == NULL || pv->merger){
+        return -1;
+    }
+    int device = merger->add(pv);
+    if(device >= 0){
+        pv->merger = merger;
+    }
+    return device;
+}
+
+int upv_merge_get_info(UPV_MERGE merge, int device, upv_merge_info_t* info)
+{
+    upv_merger* merger = (upv_merger*)merge;
+    if(merger == NULL || info == NULL){
+        return -1;
+    }
+    return merger->get_info(device, info);
+}
+
+int upv_merge_destroy(UPV_MERGE merge)
+{
+    upv_merger* merger = (upv_merger*)merge;
+    if(merger == NULL){
+        return upv_s::R_Success;
+    }
+    if(merger->stop() != 0){
+        return upv_s::R_DeviceStatus;
+    }
+    delete merger;
+    return upv_s::R_Success;
+}
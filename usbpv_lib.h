@@ -1,6 +1,8 @@
 #ifndef __USBPV_LIB_H__
 #define __USBPV_LIB_H__
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -63,11 +65,258 @@ enum UPV_CaptureSpeed {
 #define UPV_RESET_END       2
 #define UPV_SUSPEND_BEGIN   3
 #define UPV_SUSPEND_END     4
+#define UPV_CAPTURE_GAP     0xe
 #define UPV_OVERFLOW        0xf
 #define GetPacketType(status)   (((status)>>4) & 0x0f)
 
+// class decoder record type
+#define UPV_CLASS_MSC       1
+#define UPV_CLASS_HID       2
+#define UPV_CLASS_CDC       3
+
+#define UPV_HID_MAX_FIELDS  64
+
+typedef struct {
+    uint32_t tag;
+    uint8_t  lun;
+    uint8_t  dir_in;
+    uint8_t  status;       /**< CSW status, 0 passed, 1 failed, 2 phase error */
+    uint8_t  opcode;       /**< SCSI operation code */
+    uint8_t  cdb_len;
+    uint8_t  cdb[16];
+    uint64_t lba;          /**< logical block address of read/write commands */
+    uint32_t blocks;       /**< transfer length in blocks of read/write commands */
+    uint32_t data_len;     /**< dCBWDataTransferLength */
+    uint32_t data_seen;    /**< bytes seen in the data phase */
+    uint32_t residue;      /**< dCSWDataResidue */
+    uint64_t latency;      /**< CBW to CSW in 60MHz tick */
+} upv_msc_record_t;
+
+typedef struct {
+    uint16_t usage_page;
+    uint16_t usage;
+    uint16_t bit_offset;   /**< offset in the report, report id excluded */
+    uint8_t  bit_size;
+    uint8_t  flags;        /**< main item data, bit1 variable, bit2 relative */
+    int32_t  value;
+} upv_hid_field_t;
+
+typedef struct {
+    uint8_t  report_id;    /**< 0 when the device does not use report id */
+    uint8_t  field_count;  /**< 0 when the report descriptor was not captured */
+    uint16_t len;
+    const uint8_t* data;
+    upv_hid_field_t fields[UPV_HID_MAX_FIELDS];
+} upv_hid_record_t;
+
+typedef struct {
+    uint8_t  dir_in;
+    uint16_t len;
+    const uint8_t* data;
+    uint64_t offset;       /**< stream offset of data in this direction */
+} upv_cdc_record_t;
+
+typedef struct {
+    int      type;         /**< UPV_CLASS_xxx */
+    uint64_t tick;         /**< 60MHz tick extended to 64 bit, of the first packet of the record */
+    uint8_t  addr;
+    uint8_t  ep;
+    uint8_t  iface;
+    union {
+        upv_msc_record_t msc;
+        upv_hid_record_t hid;
+        upv_cdc_record_t cdc;
+    };
+} upv_class_record_t;
+
+typedef struct {
+    uint8_t  addr;         /**< UPV_NO_ADDR for the whole bus */
+    uint8_t  ep;
+    uint8_t  dir_in;
+    uint32_t util_1ms;     /**< bus time used in the last 1ms, in ppm */
+    uint32_t util_1s;      /**< bus time used in the last 1s, in ppm */
+    uint32_t util_1min;    /**< bus time used in the last 1 minute, in ppm */
+    uint64_t bytes_1ms;    /**< payload bytes in the last 1ms */
+    uint64_t bytes_1s;
+    uint64_t bytes_1min;
+    uint64_t packets;      /**< since accounting enabled */
+    uint64_t bytes;
+} upv_bw_info_t;
+
+/**
+ * Packet record filled by upv_read_packets, len bytes of data follow the
+ * header, the next record starts at UPV_PACKET_NEXT
+ */
+typedef struct {
+    uint32_t tick_60MHz;   /**< 60MHz tick count in 24 bit */
+    uint16_t len;
+    uint16_t status;       /**< same as status of pfn_packet_handler */
+} upv_packet_t;
+
+#define UPV_PACKET_SIZE(len)    ((sizeof(upv_packet_t) + (len) + 7) & ~(size_t)7)
+#define UPV_PACKET_MAX_SIZE     UPV_PACKET_SIZE(1027)
+#define UPV_PACKET_DATA(pkt)    ((const uint8_t*)(pkt) + sizeof(upv_packet_t))
+#define UPV_PACKET_NEXT(pkt)    ((const upv_packet_t*)((const uint8_t*)(pkt) + UPV_PACKET_SIZE((pkt)->len)))
+
+#define UPV_SUB_CALLBACK   0   /**< handler called for each packet in the subscriber thread */
+#define UPV_SUB_BATCH      1   /**< handler called with batches in the subscriber thread */
+#define UPV_SUB_RING       2   /**< no thread, read with upv_sub_read */
+
+#define UPV_SUB_DROP       0   /**< a slow subscriber skips to the newest packets */
+#define UPV_SUB_BLOCK      1   /**< the parser waits until the subscriber has room */
+
+typedef struct {
+    int addr;              /**< device address, -1 for any */
+    int ep;                /**< endpoint, -1 for any */
+    uint32_t type_mask;    /**< bit GetPacketType to accept, 0 for all */
+    uint32_t pid_mask;     /**< bit (PID & 0x0f) of data packets to accept, 0 for all */
+} upv_sub_filter_t;
+
+#define UPV_THREAD_READER     0   /**< USB transfer thread */
+#define UPV_THREAD_PARSER     1   /**< stream parser, runs the packet handler */
+#define UPV_THREAD_STATS      2   /**< stats print thread */
+#define UPV_THREAD_MAX        3
+
+#define UPV_SCHED_OTHER       0
+#define UPV_SCHED_FIFO        1
+#define UPV_SCHED_RR          2
+
+typedef struct upv_thread_param {
+    uint64_t cpu_mask;     /**< bit n allows CPU n, 0 for any CPU */
+    int policy;            /**< UPV_SCHED_xxx */
+    int priority;          /**< real time priority for UPV_SCHED_FIFO and UPV_SCHED_RR */
+    int nice;              /**< nice level for UPV_SCHED_OTHER */
+    char name[16];         /**< thread name, empty to keep the default */
+} upv_thread_param_t;
+
+typedef struct {
+    upv_thread_param_t thread[UPV_THREAD_MAX];  /**< indexed by UPV_THREAD_xxx */
+    int inline_parse;      /**< 1 parses in the reader thread on USB completion, no parser thread */
+    int latency_target_ms; /**< most time data waits in a partly filled transfer, 0 for 8MB transfers with 1s timeout */
+} upv_open_param_t;
+
+#define UPV_STATS_VERSION  8
+
+/**
+ * Latency percentiles in nanoseconds, values are bucket bounds within 12%
+ */
+typedef struct {
+    uint64_t count;        /**< transfer buffers measured */
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+} upv_latency_info_t;
+
+/**
+ * Time spent in each step of the last successful upv_open_device in microseconds
+ */
+typedef struct {
+    uint32_t usb_open_us;  /**< find and claim the USB device */
+    uint32_t reset_us;     /**< wait for the device to report idle */
+    uint32_t load_us;      /**< FPGA image upload */
+    uint32_t start_us;     /**< wait for loaded status and start */
+    uint32_t config_us;    /**< speed, flag and filter register writes */
+    uint32_t total_us;
+    uint32_t config_writes;  /**< registers written */
+    uint32_t config_batched; /**< 1 when written in one batch, 0 after falling back to one by one */
+} upv_open_time_t;
+
+/**
+ * Runtime counters of a device, filled by upv_get_stats
+ * New fields are only appended, size tells how much the library filled.
+ */
+typedef struct {
+    uint32_t version;      /**< UPV_STATS_VERSION of the library */
+    uint32_t size;         /**< bytes filled */
+    uint64_t rx_bytes;     /**< received from the device since capture start */
+    uint64_t parsed_bytes; /**< passed to the parser */
+    uint64_t transfers;    /**< completed bulk transfers */
+    uint64_t packets[16];  /**< packets and bus events by GetPacketType(status) */
+    uint64_t recoveries;   /**< parser resyncs after a bad packet length */
+    uint64_t overflows;    /**< device buffer overflow events */
+    uint32_t pool_total;   /**< transfer buffers */
+    uint32_t pool_free;    /**< transfer buffers free now */
+    uint32_t pool_free_min;/**< lowest pool_free since capture start */
+    uint32_t queue_depth;  /**< filled buffers waiting for the parser */
+    uint32_t fifo_remain;  /**< last reported device FIFO room, of 255 */
+    uint32_t last_rx_len;  /**< length of the last transfer */
+    uint64_t elapsed_ms;   /**< since capture start */
+    /* version 2, zero until upv_enable_latency */
+    upv_latency_info_t queue_latency;   /**< transfer completion to parser dequeue */
+    upv_latency_info_t process_latency; /**< parser dequeue to handler return */
+    upv_latency_info_t total_latency;   /**< transfer completion to handler return */
+    /* version 3 */
+    uint64_t ctx_switches[UPV_THREAD_MAX]; /**< involuntary context switches by UPV_THREAD_xxx, Linux only */
+    /* version 4 */
+    upv_open_time_t open_time;
+    /* version 5 */
+    uint32_t load_skipped; /**< 1 when the last open found the FPGA image loaded and skipped the upload */
+    /* version 6 */
+    uint32_t reconnects;   /**< reopened after the analyzer was lost, see upv_set_auto_reconnect */
+    /* version 7, more steps of the last open in microseconds */
+    uint32_t init_us;      /**< libusb_init, 0 for analyzers opened on a manager */
+    uint32_t match_us;     /**< part of usb_open_us: device list and descriptor reads until the match */
+    uint32_t check_us;     /**< serial, image hash and status read before the load decision */
+    uint32_t drain_us;     /**< part of config_us: stale data read when the batch write failed */
+    uint32_t status_polls; /**< status reads, 3 for a load without retries, 1 when skipped */
+    /* version 8 */
+    uint32_t pool_stalls;  /**< times the transfer waited for a free buffer, analyzers opened on a manager */
+} upv_stats_t;
+
+#define UPV_WARN_POOL_LOW     1   /**< few free transfer buffers, the USB reader will stall */
+#define UPV_WARN_FIFO_LOW     2   /**< device FIFO almost full, packets will be lost */
+#define UPV_WARN_PARSER_BUSY  3   /**< parser thread busy most of the time */
+#define UPV_WARN_MAX          4
+
+/**
+ * Slow consumer warning, shares are of the last 100ms window
+ */
+typedef struct {
+    int kind;                  /**< UPV_WARN_xxx */
+    uint32_t pool_free;        /**< free transfer buffers */
+    uint32_t pool_total;
+    uint32_t fifo_remain;      /**< last reported device FIFO room, of 255 */
+    uint32_t busy_permille;    /**< parser busy time per wall time */
+    uint32_t handler_permille; /**< share of busy time in the packet handler */
+    uint32_t parse_permille;   /**< share of busy time in parsing and the other hooks */
+    uint64_t handler_avg_ns;   /**< sampled mean time of one handler call */
+} upv_warning_t;
+
+#define UPV_MERGE_ALIGN_NONE   0   /**< reference analyzer or no timing seen yet */
+#define UPV_MERGE_ALIGN_HOST   1   /**< placed by the host time packets were read, ~ms */
+#define UPV_MERGE_ALIGN_SOF    2   /**< offset and drift from SOF packets of equal frame number */
+
+typedef struct {
+    int aligned;           /**< UPV_MERGE_ALIGN_xxx */
+    int64_t offset_ns;     /**< reference time - device time at the last SOF sample */
+    int64_t drift_ppb;     /**< clock rate to the reference, parts per billion */
+    uint64_t packets;      /**< emitted packets */
+    uint64_t dropped;      /**< lost because the merge input ring was full */
+    uint64_t late;         /**< got the time of an already emitted packet to keep the order */
+} upv_merge_info_t;
+
 typedef void* UPV_HANDLE;
+typedef void* UPV_SHM;
+typedef void* UPV_SUB;
+typedef void* UPV_MANAGER;
+typedef void* UPV_MERGE;
 typedef long(UPV_CB* pfn_packet_handler)(void* context, unsigned long ts, unsigned long nano, const void* data, unsigned long len, long status);
+typedef void(UPV_CB* pfn_class_handler)(void* context, const upv_class_record_t* record);
+typedef void(UPV_CB* pfn_sub_handler)(void* context, const upv_packet_t* packets, int count);
+typedef void(UPV_CB* pfn_warning_handler)(void* context, const upv_warning_t* warning);
+typedef void(UPV_CB* pfn_trigger_handler)(void* context, unsigned long tick_60MHz, int pattern, int offset, const void* data, unsigned long len);
+typedef void(UPV_CB* pfn_merge_handler)(void* context, int device, uint64_t ts_ns, const void* data, unsigned long len, long status);
+
+typedef struct {
+    upv_sub_filter_t filter;
+    int mode;              /**< UPV_SUB_CALLBACK, UPV_SUB_BATCH or UPV_SUB_RING */
+    int overflow;          /**< UPV_SUB_DROP or UPV_SUB_BLOCK */
+    int batch_size;        /**< most packets per handler call in batch mode */
+    void* context;         /**< context used in the handler */
+    pfn_sub_handler handler;
+} upv_sub_param_t;
 
 typedef const char* (UPV_CALL *pfnt_upv_list_devices)();
 typedef UPV_HANDLE (UPV_CALL *pfnt_upv_open_device)(
@@ -84,6 +333,56 @@ typedef int (UPV_CALL *pfnt_upv_close_device)(UPV_HANDLE upv);
 typedef int (UPV_CALL *pfnt_upv_get_last_error)();
 typedef const char* (UPV_CALL *pfnt_upv_get_error_string)(int errorCode);
 typedef int (UPV_CALL *pfnt_upv_get_monitor_speed)(UPV_HANDLE upv);
+typedef int (UPV_CALL *pfnt_upv_set_class_handler)(UPV_HANDLE upv, void* context, pfn_class_handler callback);
+typedef int (UPV_CALL *pfnt_upv_enable_bandwidth)(UPV_HANDLE upv, int enable);
+typedef int (UPV_CALL *pfnt_upv_get_bandwidth)(UPV_HANDLE upv, upv_bw_info_t* info, int max_count);
+typedef int (UPV_CALL *pfnt_upv_set_trigger_handler)(UPV_HANDLE upv, void* context, pfn_trigger_handler callback);
+typedef int (UPV_CALL *pfnt_upv_add_trigger_pattern)(UPV_HANDLE upv, const uint8_t* bytes, const uint8_t* mask, int len);
+typedef UPV_HANDLE (UPV_CALL *pfnt_upv_open_device_pull)(
+        const char* option,
+        int option_len,
+        int ring_size);
+typedef int (UPV_CALL *pfnt_upv_read_packets)(UPV_HANDLE upv, void* buf, int buf_size, int max_packets, int timeout_ms);
+typedef int (UPV_CALL *pfnt_upv_get_read_fd)(UPV_HANDLE upv);
+typedef int (UPV_CALL *pfnt_upv_publish_shm)(UPV_HANDLE upv, const char* name, int ring_size);
+typedef UPV_SHM (UPV_CALL *pfnt_upv_shm_open)(const char* name);
+typedef int (UPV_CALL *pfnt_upv_shm_read)(UPV_SHM shm, void* buf, int buf_size, int max_packets, int timeout_ms);
+typedef int (UPV_CALL *pfnt_upv_shm_get_overruns)(UPV_SHM shm, uint64_t* overruns, uint64_t* lost_bytes);
+typedef void (UPV_CALL *pfnt_upv_shm_close)(UPV_SHM shm);
+typedef void (UPV_CALL *pfnt_upv_init_sub_param)(upv_sub_param_t* param);
+typedef UPV_SUB (UPV_CALL *pfnt_upv_subscribe)(UPV_HANDLE upv, const upv_sub_param_t* param);
+typedef int (UPV_CALL *pfnt_upv_sub_read)(UPV_SUB sub, void* buf, int buf_size, int max_packets, int timeout_ms);
+typedef int (UPV_CALL *pfnt_upv_sub_get_stats)(UPV_SUB sub, uint64_t* packets, uint64_t* lost_bytes);
+typedef void (UPV_CALL *pfnt_upv_unsubscribe)(UPV_SUB sub);
+typedef int (UPV_CALL *pfnt_upv_get_stats)(UPV_HANDLE upv, upv_stats_t* stats, int size);
+typedef int (UPV_CALL *pfnt_upv_set_stats_print)(UPV_HANDLE upv, int interval_ms);
+typedef int (UPV_CALL *pfnt_upv_enable_latency)(UPV_HANDLE upv, int enable);
+typedef int (UPV_CALL *pfnt_upv_set_warning_handler)(UPV_HANDLE upv, void* context, pfn_warning_handler callback);
+typedef int (UPV_CALL *pfnt_upv_set_warning_limits)(UPV_HANDLE upv, int pool_low_pct, int fifo_low, int busy_pct);
+typedef void (UPV_CALL *pfnt_upv_init_open_param)(upv_open_param_t* param);
+typedef UPV_HANDLE (UPV_CALL *pfnt_upv_open_device_ex)(
+        const char* option,
+        int option_len,
+        void* context,
+        pfn_packet_handler callback,
+        const upv_open_param_t* param);
+typedef int (UPV_CALL *pfnt_upv_set_capture_config)(UPV_HANDLE upv, const char* config, int config_len);
+typedef int (UPV_CALL *pfnt_upv_pause_capture)(UPV_HANDLE upv, int timeout_ms);
+typedef int (UPV_CALL *pfnt_upv_resume_capture)(UPV_HANDLE upv);
+typedef int (UPV_CALL *pfnt_upv_set_auto_reconnect)(UPV_HANDLE upv, int enable);
+typedef UPV_MANAGER (UPV_CALL *pfnt_upv_manager_create)(int event_threads, const upv_thread_param_t* param);
+typedef UPV_HANDLE (UPV_CALL *pfnt_upv_manager_open_device)(
+        UPV_MANAGER manager,
+        const char* option,
+        int option_len,
+        void* context,
+        pfn_packet_handler callback,
+        const upv_open_param_t* param);
+typedef int (UPV_CALL *pfnt_upv_manager_destroy)(UPV_MANAGER manager);
+typedef UPV_MERGE (UPV_CALL *pfnt_upv_merge_create)(void* context, pfn_merge_handler callback, int window_ms);
+typedef int (UPV_CALL *pfnt_upv_merge_add)(UPV_MERGE merge, UPV_HANDLE upv);
+typedef int (UPV_CALL *pfnt_upv_merge_get_info)(UPV_MERGE merge, int device, upv_merge_info_t* info);
+typedef int (UPV_CALL *pfnt_upv_merge_destroy)(UPV_MERGE merge);
 
 /**
  * List connected devices' SN
@@ -107,6 +406,12 @@ UPV_API const char* UPV_CALL upv_list_devices();
  *              "1234567\x00\x00\xff\x00\x01\x01"
  *                  open device 1234567 with high speed, accept all packet type, and drop addr:1, endpoint:1
  *
+ * The FPGA image upload is skipped when the analyzer is idle, reports a loaded
+ * image and the record left by the last open in XDG_RUNTIME_DIR (TEMP on
+ * Windows) holds the hash of this image. Without that directory the image is
+ * always uploaded. The record can't see another program loading a different
+ * image without a power cycle, power cycle the analyzer after using one.
+ *
  * \param option_len length of the option. When option_len longer than SN length in option, means the option contains
  *                   more parameter
  * \param context context used in the callback function
@@ -159,6 +464,353 @@ UPV_API const char* UPV_CALL upv_get_error_string(int errorCode);
  */
 UPV_API int UPV_CALL upv_get_monitor_speed(UPV_HANDLE upv);
 
+/**
+ * Decode mass storage, HID and CDC traffic out of the packet stream
+ * The device tree is learned from the enumeration, so the capture should start
+ * before the device is plugged in or reset. Setting a handler again starts a
+ * new decoder, which has to learn the device tree again.
+ * \param upv device handler open by upv_open_device
+ * \param context context used in the callback function
+ * \param callback record callback, called in the parser thread, NULL to disable
+ * \returns 0 for succes, otherwise fail
+ */
+UPV_API int UPV_CALL upv_set_class_handler(UPV_HANDLE upv, void* context, pfn_class_handler callback);
+
+/**
+ * Enable or disable per endpoint bus time accounting in the parser thread
+ * \param upv device handler open by upv_open_device
+ * \param enable 1 to enable, 0 to disable, counters are kept when disabled
+ * \returns 0 for succes, otherwise fail
+ */
+UPV_API int UPV_CALL upv_enable_bandwidth(UPV_HANDLE upv, int enable);
+
+/**
+ * Get bus utilization and bandwidth of the whole bus and each seen endpoint
+ * The windows end at the last received packet, 1s and 1 minute window are
+ * counted in 100ms and 1s granularity.
+ * \param upv device handler open by upv_open_device
+ * \param info output array, info[0] is the whole bus
+ * \param max_count size of info array
+ * \returns number of filled entries, <0 error
+ */
+UPV_API int UPV_CALL upv_get_bandwidth(UPV_HANDLE upv, upv_bw_info_t* info, int max_count);
+
+/**
+ * Set the handler called when a data packet matches a trigger pattern
+ * \param upv device handler open by upv_open_device
+ * \param context context used in the callback function
+ * \param callback called in the parser thread with the 24 bit 60MHz tick, NULL to disable
+ * \returns 0 for succes, otherwise fail
+ */
+UPV_API int UPV_CALL upv_set_trigger_handler(UPV_HANDLE upv, void* context, pfn_trigger_handler callback);
+
+/**
+ * Add a trigger pattern, may be called while capturing
+ * A data byte matches when (data & mask) == (bytes & mask), the PID is the first byte.
+ * \param upv device handler open by upv_open_device
+ * \param bytes pattern bytes
+ * \param mask pattern mask, NULL for exact match
+ * \param len pattern length, at most 64
+ * \returns pattern index passed to the trigger handler, <0 error
+ */
+UPV_API int UPV_CALL upv_add_trigger_pattern(UPV_HANDLE upv, const uint8_t* bytes, const uint8_t* mask, int len);
+
+/**
+ * Open device without packet callback, packets are read by upv_read_packets
+ * The parser thread fills a lock free ring, one thread reads it. When the ring
+ * is full packets are dropped and a UPV_OVERFLOW event marks the gap.
+ * \param option same as upv_open_device
+ * \param option_len length of the option
+ * \param ring_size ring size in bytes, 0 for 16MB
+ * \returns the device handler
+ */
+UPV_API UPV_HANDLE UPV_CALL upv_open_device_pull(
+        const char* option,
+        int option_len,
+        int ring_size);
+
+/**
+ * Read packets of a device opened by upv_open_device_pull
+ * \param upv device handler
+ * \param buf receives upv_packet_t records, at least UPV_PACKET_MAX_SIZE bytes
+ * \param buf_size size of buf
+ * \param max_packets most packets to read
+ * \param timeout_ms wait time when no packet is available, 0 no wait, <0 wait forever
+ * \returns number of packets read, <0 error
+ */
+UPV_API int UPV_CALL upv_read_packets(UPV_HANDLE upv, void* buf, int buf_size, int max_packets, int timeout_ms);
+
+/**
+ * Get a descriptor for poll/select/epoll that is readable when packets may be available
+ * Read with timeout 0 until upv_read_packets returns 0, that clears the descriptor.
+ * \param upv device handler open by upv_open_device_pull
+ * \returns the descriptor, <0 when not supported
+ */
+UPV_API int UPV_CALL upv_get_read_fd(UPV_HANDLE upv);
+
+/**
+ * Publish the packets of a device into a named shared memory ring
+ * Readers in any process attach by name with upv_shm_open. The capture never
+ * waits for readers, a slow reader loses packets and sees it as an overrun.
+ * \param upv device handler
+ * \param name shared memory name, e.g. "/usbpv0", NULL to stop publishing
+ * \param ring_size ring size in bytes, 0 for 64MB
+ * \returns 0 for succes, otherwise fail
+ */
+UPV_API int UPV_CALL upv_publish_shm(UPV_HANDLE upv, const char* name, int ring_size);
+
+/**
+ * Attach to a shared memory ring, reading starts at the newest packet
+ * \param name same name as upv_publish_shm
+ * \returns the reader handler, NULL when the ring doesn't exist
+ */
+UPV_API UPV_SHM UPV_CALL upv_shm_open(const char* name);
+
+/**
+ * Read packets from a shared memory ring
+ * \param shm reader handler
+ * \param buf receives upv_packet_t records, at least UPV_PACKET_MAX_SIZE bytes
+ * \param buf_size size of buf
+ * \param max_packets most packets to read
+ * \param timeout_ms wait time when no packet is available, 0 no wait, <0 wait forever
+ * \returns number of packets read, -1 when the capture is closed and all packets are read
+ */
+UPV_API int UPV_CALL upv_shm_read(UPV_SHM shm, void* buf, int buf_size, int max_packets, int timeout_ms);
+
+/**
+ * Get how often the reader was overrun by the writer and the bytes it skipped
+ * \returns 0 for succes, otherwise fail
+ */
+UPV_API int UPV_CALL upv_shm_get_overruns(UPV_SHM shm, uint64_t* overruns, uint64_t* lost_bytes);
+
+/**
+ * Detach from a shared memory ring
+ */
+UPV_API void UPV_CALL upv_shm_close(UPV_SHM shm);
+
+/**
+ * Fill a subscription with defaults: no filter, callback mode, drop on overflow
+ */
+UPV_API void UPV_CALL upv_init_sub_param(upv_sub_param_t* param);
+
+/**
+ * Subscribe to the packets of a device
+ * The parser writes each packet once into a ring shared by all subscribers,
+ * every subscriber reads it at its own pace with its own filter. Data and
+ * handshake packets are matched against the address of the preceding token,
+ * bus events only against type_mask.
+ * \param upv device handler
+ * \param param filter, delivery mode and overflow policy
+ * \returns the subscription, valid until upv_unsubscribe or upv_close_device
+ */
+UPV_API UPV_SUB UPV_CALL upv_subscribe(UPV_HANDLE upv, const upv_sub_param_t* param);
+
+/**
+ * Read packets of a UPV_SUB_RING subscription
+ * \param buf receives upv_packet_t records, at least UPV_PACKET_MAX_SIZE bytes
+ * \param timeout_ms wait time when no packet is available, 0 no wait, <0 wait forever
+ * \returns number of packets read, <0 error
+ */
+UPV_API int UPV_CALL upv_sub_read(UPV_SUB sub, void* buf, int buf_size, int max_packets, int timeout_ms);
+
+/**
+ * Get delivered packets and bytes lost by overruns of a subscription
+ * \returns 0 for succes, otherwise fail
+ */
+UPV_API int UPV_CALL upv_sub_get_stats(UPV_SUB sub, uint64_t* packets, uint64_t* lost_bytes);
+
+/**
+ * Remove a subscription, waits for its handler to return
+ */
+UPV_API void UPV_CALL upv_unsubscribe(UPV_SUB sub);
+
+/**
+ * Get the runtime counters of a device, safe to call from any thread
+ * \param upv device handler
+ * \param stats receives the counters
+ * \param size sizeof(upv_stats_t) of the caller, a smaller struct of an older
+ *             header is filled up to its size
+ * \returns bytes filled, <0 error
+ */
+UPV_API int UPV_CALL upv_get_stats(UPV_HANDLE upv, upv_stats_t* stats, int size);
+
+/**
+ * Print the counters to stdout periodically, off by default
+ * \param upv device handler
+ * \param interval_ms print interval, 0 to stop
+ * \returns 0 for succes, otherwise fail
+ */
+UPV_API int UPV_CALL upv_set_stats_print(UPV_HANDLE upv, int interval_ms);
+
+/**
+ * Enable or disable latency histograms of the capture path
+ * Each transfer buffer is timestamped at USB completion, at parser dequeue
+ * and after the handlers of all its packets returned. When disabled the
+ * capture path only tests a pointer. Enabling clears the histograms.
+ * \param upv device handler
+ * \param enable 1 enable, 0 disable
+ * \returns 0 for succes, otherwise fail
+ */
+UPV_API int UPV_CALL upv_enable_latency(UPV_HANDLE upv, int enable);
+
+/**
+ * Set a handler for slow consumer warnings
+ * The parser checks transfer pool and device FIFO headroom after each
+ * transfer buffer and its busy time every 100ms, a warning of each kind is
+ * raised at most once per second. The handler runs in the parser thread and
+ * must return quickly.
+ * \param upv device handler
+ * \param context context used in the handler
+ * \param callback warning handler, NULL to stop monitoring
+ * \returns 0 for succes, otherwise fail
+ */
+UPV_API int UPV_CALL upv_set_warning_handler(UPV_HANDLE upv, void* context, pfn_warning_handler callback);
+
+/**
+ * Change the warning limits, defaults are 25, 64 and 90
+ * \param pool_low_pct warn when less than this percent of transfer buffers are free
+ * \param fifo_low warn when the device FIFO room drops below this, of 255
+ * \param busy_pct warn when the parser is busy more than this percent of the time
+ * \returns 0 for succes, otherwise fail
+ */
+UPV_API int UPV_CALL upv_set_warning_limits(UPV_HANDLE upv, int pool_low_pct, int fifo_low, int busy_pct);
+
+/**
+ * Fill open parameters with defaults: any CPU, normal scheduling, threads
+ * named upv_reader, upv_parser and upv_stats
+ */
+UPV_API void UPV_CALL upv_init_open_param(upv_open_param_t* param);
+
+/**
+ * Open device like upv_open_device with CPU affinity, scheduling and names
+ * of the capture threads. Real time policies need CAP_SYS_NICE, the open
+ * fails with the thread error otherwise.
+ * With inline_parse the packet handler runs in the reader thread as each of
+ * 4 64KB transfers completes, this saves the queue hop to the parser thread
+ * but a slow handler delays the next transfer directly.
+ * With latency_target_ms transfers are sized from the received data rate,
+ * small when the bus is idle and up to the buffer size when busy, and time
+ * out after the target so partly filled transfers are delivered.
+ * \param option same as upv_open_device
+ * \param option_len length of the option
+ * \param context context used in the callback function
+ * \param callback packet handler
+ * \param param thread settings, NULL same as upv_open_device
+ * \returns the device handler
+ */
+UPV_API UPV_HANDLE UPV_CALL upv_open_device_ex(
+        const char* option,
+        int option_len,
+        void* context,
+        pfn_packet_handler callback,
+        const upv_open_param_t* param);
+
+/**
+ * Change speed, packet type flag and address/endpoint filter of an open device.
+ * While capturing the device is stopped, the registers are written and it is
+ * started again, the threads and buffers are kept and packets are lost only
+ * for the few milliseconds in between.
+ * \param config option bytes after the SN of upv_open_device,
+ *        "speed flag filter_type addr1 ep1 addr2 ep2 addr3 ep3 addr4 ep4"
+ *        e.g. "\x03\xff\x01\x01\x01" accept addr:1, endpoint:1 only
+ *        missing bytes take the same defaults as in upv_open_device
+ * \param config_len length of config
+ * \returns 0 on success, register echoes are checked
+ */
+UPV_API int UPV_CALL upv_set_capture_config(UPV_HANDLE upv, const char* config, int config_len);
+
+/**
+ * Stop the capture stream of the device but keep the capture threads and
+ * buffers, upv_resume_capture starts it again within milliseconds.
+ * upv_set_capture_config also works while paused.
+ * \param timeout_ms most time to wait for the packets sent before the pause
+ *        to reach the packet handler
+ * \returns 0 on success, -14 when the device is paused but packets
+ *          sent before the pause are still being handled, call it again to wait
+ */
+UPV_API int UPV_CALL upv_pause_capture(UPV_HANDLE upv, int timeout_ms);
+
+/**
+ * Restart the capture stream after upv_pause_capture
+ * \returns 0 on success
+ */
+UPV_API int UPV_CALL upv_resume_capture(UPV_HANDLE upv);
+
+/**
+ * Reopen the analyzer when it is unplugged or re-enumerates
+ * A library thread waits for a device with the same SN through libusb
+ * hotplug events, or retries every second without hotplug support. It is
+ * opened with the options of the last open and upv_set_capture_config, and
+ * capture goes on after a packet with GetPacketType(status) ==
+ * UPV_CAPTURE_GAP, packets in between are lost.
+ * \param enable 1 to reconnect, 0 to end the capture on a USB error
+ * \returns 0 on success
+ */
+UPV_API int UPV_CALL upv_set_auto_reconnect(UPV_HANDLE upv, int enable);
+
+/**
+ * Create a manager that captures several analyzers with shared libusb
+ * contexts. Each event thread handles the USB transfers of all analyzers
+ * opened on it, instead of one context and reader thread per analyzer.
+ * Every analyzer keeps its own parser thread.
+ * \param event_threads number of libusb contexts with one event thread each,
+ *        analyzers are spread over them, 1 is enough unless inline_parse is used
+ * \param param event thread settings, NULL for defaults named upv_events
+ * \returns the manager, NULL on failure
+ */
+UPV_API UPV_MANAGER UPV_CALL upv_manager_create(int event_threads, const upv_thread_param_t* param);
+
+/**
+ * Open an analyzer like upv_open_device_ex, its transfers are handled by an
+ * event thread of the manager. Close it with upv_close_device.
+ * The reader thread entry of param is not used.
+ */
+UPV_API UPV_HANDLE UPV_CALL upv_manager_open_device(
+        UPV_MANAGER manager,
+        const char* option,
+        int option_len,
+        void* context,
+        pfn_packet_handler callback,
+        const upv_open_param_t* param);
+
+/**
+ * Stop the event threads and free the manager
+ * \returns 0, or an error while analyzers opened on it are not closed
+ */
+UPV_API int UPV_CALL upv_manager_destroy(UPV_MANAGER manager);
+
+/**
+ * Create a merge of several analyzers into one stream ordered by time, e.g.
+ * upstream and downstream of a hub. callback gets the device tag returned by
+ * upv_merge_add and the time in ns of the first analyzer's clock. The other
+ * analyzers are aligned to it with SOF packets of equal frame number, so
+ * capture SOF on all of them, without SOF the host read time is used.
+ * callback runs in the merge thread.
+ * \param window_ms longest time a packet waits for the other analyzers,
+ *        0 for 100ms
+ * \returns the merge, NULL on failure
+ */
+UPV_API UPV_MERGE UPV_CALL upv_merge_create(void* context, pfn_merge_handler callback, int window_ms);
+
+/**
+ * Feed the packets of an opened analyzer into the merge, at most 8
+ * The packet handler of the analyzer is still called.
+ * \returns the device tag, <0 on failure
+ */
+UPV_API int UPV_CALL upv_merge_add(UPV_MERGE merge, UPV_HANDLE upv);
+
+/**
+ * Get the alignment and counters of one analyzer of the merge
+ * \returns 0 on success
+ */
+UPV_API int UPV_CALL upv_merge_get_info(UPV_MERGE merge, int device, upv_merge_info_t* info);
+
+/**
+ * Emit the remaining packets, stop the merge thread and free the merge
+ * \returns 0, or an error while added analyzers are not closed
+ */
+UPV_API int UPV_CALL upv_merge_destroy(UPV_MERGE merge);
+
 #ifdef __cplusplus
 }
 #endif
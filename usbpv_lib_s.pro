@@ -23,8 +23,8 @@ DEFINES += QT_DEPRECATED_WARNINGS USBPV_LIB
 
 
 SOURCES += \
-        usbpv_lib.cpp usbpv_s.cpp usbpv_util.cpp
-HEADERS += usbpv_s.h
+        usbpv_lib.cpp usbpv_s.cpp usbpv_util.cpp usbpv_decode.cpp usbpv_class.cpp usbpv_bw.cpp usbpv_store.cpp usbpv_index.cpp usbpv_search.cpp usbpv_ring.cpp usbpv_shm.cpp usbpv_fanout.cpp usbpv_latency.cpp usbpv_health.cpp usbpv_thread.cpp usbpv_manager.cpp usbpv_merge.cpp usbpv_reconnect.cpp usbpv_enum.cpp
+HEADERS += usbpv_s.h usbpv_decode.h usbpv_class.h usbpv_bw.h usbpv_store.h usbpv_index.h usbpv_search.h usbpv_ring.h usbpv_shm.h usbpv_fanout.h usbpv_latency.h usbpv_health.h usbpv_thread.h usbpv_manager.h usbpv_merge.h usbpv_reconnect.h usbpv_enum.h usbpv_lib.h usbpv_parse.h usbpv_emit.h usbpv.hpp
 # -------------------------------------------------
 # sources for libusb
 # -------------------------------------------------
@@ -60,7 +60,7 @@ SOURCES += ./libusb-1.0.23/libusb/os/poll_posix.c \
            ./libusb-1.0.23/libusb/os/threads_posix.c \
            ./libusb-1.0.23/libusb/os/linux_usbfs.c \
            ./libusb-1.0.23/libusb/os/linux_udev.c
-LIBS+=-ludev
+LIBS+=-ludev -lrt
 }
 
 
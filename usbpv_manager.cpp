@@ -0,0 +1,123 @@
+#include "usbpv_manager.h"
+#include "usbpv_thread.h"
+#include "string.h"
+
+upv_manager::upv_manager()
+    :loop_count(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+    memset(loops, 0, sizeof(loops));
+    memset(&thread_param, 0, sizeof(thread_param));
+}
+
+upv_manager::~upv_manager()
+{
+    stop();
+    pthread_mutex_destroy(&mutex);
+}
+
+void* upv_manager::loop_callback(void* arg)
+{
+    upv_event_loop* loop = (upv_event_loop*)arg;
+    return loop->manager->loop_func(loop);
+}
+
+void* upv_manager::loop_func(upv_event_loop* loop)
+{
+    upv_thread_enter(&thread_param);
+    while(!loop->finish){
+        libusb_handle_events_completed(loop->ctx, NULL);
+    }
+    return NULL;
+}
+
+int upv_manager::start(int count, const upv_thread_param_t* param)
+{
+    if(loop_count > 0){
+        return 0;
+    }
+    if(count <= 0){
+        count = 1;
+    }
+    if(count > UPV_MANAGER_LOOPS_MAX){
+        count = UPV_MANAGER_LOOPS_MAX;
+    }
+    if(param){
+        thread_param = *param;
+    }else{
+        memset(&thread_param, 0, sizeof(thread_param));
+        thread_param.policy = UPV_SCHED_OTHER;
+        strcpy(thread_param.name, "upv_events");
+    }
+    for(int i=0;i<count;i++){
+        upv_event_loop* loop = &loops[i];
+        loop->manager = this;
+        loop->finish = 0;
+        loop->devices = 0;
+        if(libusb_init(&loop->ctx) < 0){
+            loop->ctx = NULL;
+            stop();
+            return -1;
+        }
+        if(upv_thread_create(&loop->thread, &thread_param, loop_callback, loop) != 0){
+            libusb_exit(loop->ctx);
+            loop->ctx = NULL;
+            stop();
+            return -1;
+        }
+        loop_count++;
+    }
+    return 0;
+}
+
+int upv_manager::stop()
+{
+    pthread_mutex_lock(&mutex);
+    for(int i=0;i<loop_count;i++){
+        if(loops[i].devices){
+            pthread_mutex_unlock(&mutex);
+            return -1;
+        }
+    }
+    for(int i=0;i<loop_count;i++){
+        upv_event_loop* loop = &loops[i];
+        loop->finish = 1;
+        libusb_interrupt_event_handler(loop->ctx);
+        pthread_join(loop->thread, NULL);
+        libusb_exit(loop->ctx);
+        loop->ctx = NULL;
+    }
+    loop_count = 0;
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+int upv_manager::attach(upv_s* upv)
+{
+    pthread_mutex_lock(&mutex);
+    upv_event_loop* best = NULL;
+    for(int i=0;i<loop_count;i++){
+        if(best == NULL || loops[i].devices < best->devices){
+            best = &loops[i];
+        }
+    }
+    if(best){
+        best->devices++;
+        upv->shared_ctx = best->ctx;
+    }
+    pthread_mutex_unlock(&mutex);
+    return best ? 0 : -1;
+}
+
+void upv_manager::detach(upv_s* upv)
+{
+    pthread_mutex_lock(&mutex);
+    for(int i=0;i<loop_count;i++){
+        if(loops[i].ctx == upv->shared_ctx){
+            loops[i].devices--;
+            break;
+        }
+    }
+    upv->shared_ctx = NULL;
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,52 @@
+#ifndef __USBPV_MANAGER_H__
+#define __USBPV_MANAGER_H__
+
+#include "usbpv_s.h"
+#include "usbpv_lib.h"
+
+#define UPV_MANAGER_LOOPS_MAX   8
+
+class upv_manager;
+
+struct upv_event_loop{
+    upv_manager* manager;
+    libusb_context* ctx;
+    pthread_t thread;
+    volatile int finish;
+    int devices;                    // attached analyzers
+};
+
+/**
+ * Capture of several analyzers with shared libusb event threads
+ * Each event loop is one libusb context and one thread handling the
+ * transfers of all analyzers attached to it, an analyzer goes to the loop
+ * with the fewest. Every analyzer keeps its own parser thread.
+ * libusb handles the events of a context in one thread at a time, so more
+ * than one loop only helps when packets are parsed in the event thread.
+ */
+class upv_manager
+{
+public:
+    upv_manager();
+    ~upv_manager();
+
+    int start(int loop_count, const upv_thread_param_t* param);
+    // all analyzers have to be detached, returns -1 otherwise
+    int stop();
+    // before upv_s::open, the analyzer uses the context of a loop
+    int attach(upv_s* upv);
+    // after upv_s::close
+    void detach(upv_s* upv);
+
+protected:
+    void* loop_func(upv_event_loop* loop);
+    static void* loop_callback(void* arg);
+
+public:
+    pthread_mutex_t mutex;          // serializes attach and detach
+    upv_event_loop loops[UPV_MANAGER_LOOPS_MAX];
+    int loop_count;
+    upv_thread_param_t thread_param;
+};
+
+#endif
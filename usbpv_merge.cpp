@@ -0,0 +1,373 @@
+#include "usbpv_merge.h"
+#include "usbpv_ring.h"
+#include "usbpv_decode.h"
+#include "usbpv_thread.h"
+#include "string.h"
+#include "errno.h"
+#include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#endif
+
+#define TICK_NS(t)              ((t)*50/3)
+#define SOF_MATCH_NS            500000000ull    // frame numbers repeat every 2.048s
+#define SAMPLE_MIN_NS           100000000ull    // shortest span for a drift sample
+#define SAMPLE_JUMP_NS          1000000         // larger prediction error restarts the estimate
+#define ENV_WINDOW_NS           1000000000ull
+
+upv_merger::upv_merger()
+    :input_count(0)
+    ,context(NULL)
+    ,handler(NULL)
+    ,window_ns(UPV_MERGE_WINDOW_MS*1000000ull)
+    ,last_ts(0)
+    ,running(0)
+    ,finish(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+    memset(inputs, 0, sizeof(inputs));
+}
+
+upv_merger::~upv_merger()
+{
+    stop();
+    for(int i=0;i<input_count;i++){
+        upv_merge_input* in = &inputs[i];
+        delete in->ring;
+        delete[] in->stage;
+        delete[] in->stage_ns;
+        delete[] in->sof_dev;
+        delete[] in->sof_host;
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+void* upv_merger::merge_callback(void* arg)
+{
+    return ((upv_merger*)arg)->merge_func();
+}
+
+int upv_merger::start(void* ctx, pfn_merge_handler cb, int window_ms)
+{
+    if(running){
+        return 0;
+    }
+    context = ctx;
+    handler = cb;
+    if(window_ms <= 0){
+        window_ms = UPV_MERGE_WINDOW_MS;
+    }
+    window_ns = (uint64_t)window_ms*1000000;
+    finish = 0;
+    upv_thread_param_t param;
+    memset(&param, 0, sizeof(param));
+    param.policy = UPV_SCHED_OTHER;
+    strcpy(param.name, "upv_merge");
+    if(upv_thread_create(&thread, &param, merge_callback, this) != 0){
+        return -1;
+    }
+    running = 1;
+    return 0;
+}
+
+int upv_merger::stop()
+{
+    pthread_mutex_lock(&mutex);
+    for(int i=0;i<input_count;i++){
+        if(!inputs[i].closed){
+            pthread_mutex_unlock(&mutex);
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    if(running){
+        finish = 1;
+        pthread_join(thread, NULL);
+        running = 0;
+    }
+    return 0;
+}
+
+int upv_merger::add(upv_s* upv)
+{
+    pthread_mutex_lock(&mutex);
+    int index = input_count.load(std::memory_order_relaxed);
+    if(index >= UPV_MERGE_MAX){
+        pthread_mutex_unlock(&mutex);
+        return -1;
+    }
+    upv_merge_input* in = &inputs[index];
+    memset(in, 0, sizeof(*in));
+    in->ring = new upv_packet_ring(UPV_MERGE_RING_SIZE);
+    in->upv = upv;
+    in->stage = new uint8_t[UPV_MERGE_STAGE_SIZE];
+    in->stage_ns = new uint64_t[UPV_MERGE_STAGE_PACKETS];
+    in->sof_dev = new uint64_t[UPV_MERGE_SOF_SLOTS];
+    in->sof_host = new uint64_t[UPV_MERGE_SOF_SLOTS];
+    memset(in->sof_host, 0, sizeof(uint64_t)*UPV_MERGE_SOF_SLOTS);
+    in->last_frame = -1;
+    // the merge thread only looks at inputs below input_count
+    input_count.store(index + 1, std::memory_order_release);
+    upv->merge_ring.store(in->ring, std::memory_order_release);
+    pthread_mutex_unlock(&mutex);
+    return index;
+}
+
+void upv_merger::remove(upv_s* upv)
+{
+    pthread_mutex_lock(&mutex);
+    for(int i=0;i<input_count;i++){
+        if(inputs[i].upv == upv){
+            upv->merge_ring.store(NULL, std::memory_order_release);
+            inputs[i].upv = NULL;
+            inputs[i].closed = 1;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+int upv_merger::get_info(int device, upv_merge_info_t* info)
+{
+    pthread_mutex_lock(&mutex);
+    if(device < 0 || device >= input_count){
+        pthread_mutex_unlock(&mutex);
+        return -1;
+    }
+    // written by the merge thread, a torn read only shows a mixed sample
+    upv_merge_input* in = &inputs[device];
+    info->aligned = in->aligned;
+    info->offset_ns = in->offset_ns;
+    info->drift_ppb = in->drift_ppb;
+    info->packets = in->packets;
+    info->dropped = in->ring->dropped();
+    info->late = in->late;
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+void upv_merger::sample_offset(upv_merge_input* in, int64_t offset, uint64_t dev_ns)
+{
+    if(in->aligned != UPV_MERGE_ALIGN_SOF){
+        in->aligned = UPV_MERGE_ALIGN_SOF;
+        in->offset_ns = offset;
+        in->sample_ns = dev_ns;
+        in->drift_ppb = 0;
+        in->drift_valid = 0;
+        return;
+    }
+    int64_t span = (int64_t)(dev_ns - in->sample_ns);
+    if(span < (int64_t)SAMPLE_MIN_NS){
+        return;
+    }
+    int64_t err = offset - to_ref(in, dev_ns) + (int64_t)dev_ns;
+    if(err > SAMPLE_JUMP_NS || err < -SAMPLE_JUMP_NS){
+        // analyzer restarted or a wrong frame match, start over
+        in->offset_ns = offset;
+        in->sample_ns = dev_ns;
+        in->drift_ppb = 0;
+        in->drift_valid = 0;
+        return;
+    }
+    int64_t drift = (offset - in->offset_ns) * 1000000000ll / span;
+    if(in->drift_valid){
+        in->drift_ppb += (drift - in->drift_ppb) / 8;
+    }else{
+        in->drift_ppb = drift;
+        in->drift_valid = 1;
+    }
+    in->offset_ns = offset;
+    in->sample_ns = dev_ns;
+}
+
+void upv_merger::on_sof(int index, uint64_t dev_ns, uint64_t host_ns, const uint8_t* data)
+{
+    upv_merge_input* in = &inputs[index];
+    int frame = data[1] | ((data[2]&7)<<8);
+    int first = in->last_frame >= 0 && ((in->last_frame + 1) & 0x7ff) == frame;
+    if(frame == in->last_frame){
+        // later microframe of a high speed frame
+        return;
+    }
+    in->last_frame = frame;
+    if(!first){
+        // may be inside the frame, the previous one was not seen
+        in->sof_host[frame] = 0;
+        return;
+    }
+    in->sof_dev[frame] = dev_ns;
+    in->sof_host[frame] = host_ns;
+    // the reference frame matches every other analyzer, others only the reference
+    upv_merge_input* ref = &inputs[0];
+    int count = index == 0 ? input_count.load(std::memory_order_acquire) : index + 1;
+    for(int i = index == 0 ? 1 : index;i<count;i++){
+        upv_merge_input* a = &inputs[i];
+        uint64_t ha = a->sof_host[frame];
+        uint64_t hr = ref->sof_host[frame];
+        if(ha == 0 || hr == 0 || (ha > hr ? ha - hr : hr - ha) > SOF_MATCH_NS){
+            continue;
+        }
+        sample_offset(a, (int64_t)(ref->sof_dev[frame] - a->sof_dev[frame]), a->sof_dev[frame]);
+    }
+}
+
+int64_t upv_merger::to_ref(upv_merge_input* in, uint64_t dev_ns)
+{
+    if(in == &inputs[0]){
+        return (int64_t)dev_ns;
+    }
+    if(in->aligned == UPV_MERGE_ALIGN_SOF){
+        int64_t d = (int64_t)(dev_ns - in->sample_ns);
+        return (int64_t)dev_ns + in->offset_ns + d / 1000 * in->drift_ppb / 1000000;
+    }
+    if(in->env_valid && inputs[0].env_valid){
+        return (int64_t)dev_ns + in->env_ns - inputs[0].env_ns;
+    }
+    return (int64_t)dev_ns;
+}
+
+int upv_merger::fill(upv_merge_input* in, uint64_t now)
+{
+    int used = 0;
+    int n = in->ring->read(in->stage, UPV_MERGE_STAGE_SIZE, UPV_MERGE_STAGE_PACKETS, 0, &used);
+    in->stage_count = n;
+    in->stage_idx = 0;
+    in->stage_pos = 0;
+    if(n <= 0){
+        in->stage_count = 0;
+        return 0;
+    }
+    in->read_ns = now;
+    int index = (int)(in - inputs);
+    // a long pause may hide whole tick wraps, count them from the host clock
+    if(in->started && now - in->last_read_ns > 250000000ull){
+        uint64_t host_ticks = (now - in->last_read_ns) * 3 / 50;
+        uint32_t d = (((const upv_packet_t*)in->stage)->tick_60MHz - in->last_tick) & 0xffffff;
+        if(host_ticks > d + (1<<23)){
+            in->tick_base += ((host_ticks - d + (1<<23)) >> 24) << 24;
+        }
+    }
+    in->last_read_ns = now;
+    const upv_packet_t* p = (const upv_packet_t*)in->stage;
+    for(int i=0;i<n;i++,p=UPV_PACKET_NEXT(p)){
+        uint32_t tick = p->tick_60MHz & 0xffffff;
+        if(in->started && tick < in->last_tick){
+            in->tick_base += 1<<24;
+        }
+        in->started = 1;
+        in->last_tick = tick;
+        uint64_t dev_ns = TICK_NS(in->tick_base + tick);
+        in->stage_ns[i] = dev_ns;
+        if(GetPacketType(p->status) == UPV_DATA_PACKET && p->len >= 3 && UPV_PACKET_DATA(p)[0] == UPV_PID_SOF){
+            on_sof(index, dev_ns, now, UPV_PACKET_DATA(p));
+        }
+    }
+    // host time is after the packet time, the smallest difference is closest
+    int64_t env = (int64_t)(now - in->stage_ns[n-1]);
+    if(in->env_start == 0 || now - in->env_start >= ENV_WINDOW_NS){
+        if(in->env_start){
+            in->env_ns = in->env_cur;
+            in->env_valid = 1;
+        }
+        in->env_start = now;
+        in->env_cur = env;
+    }else if(env < in->env_cur){
+        in->env_cur = env;
+    }
+    if(!in->env_valid){
+        in->env_ns = in->env_cur;
+        in->env_valid = 1;
+    }
+    if(in->aligned == UPV_MERGE_ALIGN_NONE && in->env_valid && index != 0){
+        in->aligned = UPV_MERGE_ALIGN_HOST;
+    }
+    return n;
+}
+
+// emit packets in time order until an analyzer has to be waited for
+int upv_merger::emit(uint64_t now, int flush)
+{
+    int emitted = 0;
+    while(true){
+        int count = input_count.load(std::memory_order_acquire);
+        int best = -1;
+        int64_t best_ts = 0;
+        int waiting = 0;
+        for(int i=0;i<count;i++){
+            upv_merge_input* in = &inputs[i];
+            if(in->stage_idx >= in->stage_count && !fill(in, now)){
+                if(!in->closed){
+                    waiting = 1;
+                }
+                continue;
+            }
+            int64_t ts = to_ref(in, in->stage_ns[in->stage_idx]);
+            if(best < 0 || ts < best_ts){
+                best = i;
+                best_ts = ts;
+            }
+        }
+        if(best < 0){
+            break;
+        }
+        upv_merge_input* in = &inputs[best];
+        if(waiting && !flush && now - in->read_ns < window_ns){
+            break;
+        }
+        const upv_packet_t* p = (const upv_packet_t*)(in->stage + in->stage_pos);
+        if(best_ts < last_ts){
+            in->late++;
+            best_ts = last_ts;
+        }
+        last_ts = best_ts;
+        if(handler){
+            handler(context, best, (uint64_t)best_ts, UPV_PACKET_DATA(p), p->len, p->status);
+        }
+        in->packets++;
+        in->stage_pos += UPV_PACKET_SIZE(p->len);
+        in->stage_idx++;
+        emitted++;
+    }
+    return emitted;
+}
+
+void* upv_merger::merge_func()
+{
+    while(!finish){
+        uint64_t now = upv_now_ns();
+        emit(now, 0);
+        // wake on new packets of the analyzers waited for, or when the oldest head times out
+        int count = input_count.load(std::memory_order_acquire);
+        int wait_ms = 100;
+        for(int i=0;i<count;i++){
+            upv_merge_input* in = &inputs[i];
+            if(in->stage_idx < in->stage_count){
+                uint64_t age = now - in->read_ns;
+                int ms = age >= window_ns ? 1 : (int)((window_ns - age + 999999) / 1000000);
+                if(ms < wait_ms){
+                    wait_ms = ms;
+                }
+            }
+        }
+#ifdef __linux__
+        struct pollfd pfd[UPV_MERGE_MAX];
+        int nfd = 0;
+        for(int i=0;i<count;i++){
+            upv_merge_input* in = &inputs[i];
+            if(in->stage_idx >= in->stage_count && !in->closed){
+                pfd[nfd].fd = in->ring->fd();
+                pfd[nfd].events = POLLIN;
+                pfd[nfd].revents = 0;
+                nfd++;
+            }
+        }
+        if(poll(pfd, nfd, wait_ms) > 0){
+            // the ring clears its descriptor when read empty
+        }
+#else
+        usleep(1000);
+#endif
+    }
+    // all analyzers are closed, nothing else arrives
+    emit(upv_now_ns(), 1);
+    return NULL;
+}
@@ -0,0 +1,101 @@
+#ifndef __USBPV_MERGE_H__
+#define __USBPV_MERGE_H__
+
+#include "usbpv_s.h"
+#include "usbpv_lib.h"
+#include <atomic>
+
+#define UPV_MERGE_MAX            8
+#define UPV_MERGE_RING_SIZE      (8*1024*1024)
+#define UPV_MERGE_STAGE_SIZE     (1024*1024)     // bytes read from a ring at once
+#define UPV_MERGE_STAGE_PACKETS  16384
+#define UPV_MERGE_WINDOW_MS      100
+#define UPV_MERGE_SOF_SLOTS      2048            // 11 bit frame number
+
+class upv_packet_ring;
+
+// one analyzer feeding the merge, the ring is written by its parser thread
+struct upv_merge_input{
+    upv_packet_ring* ring;
+    upv_s* upv;
+    volatile int closed;            // analyzer closed, only the ring is left
+    // packets read from the ring and not emitted yet
+    uint8_t* stage;
+    uint64_t* stage_ns;             // device time of each staged packet
+    int stage_count;
+    int stage_idx;
+    int stage_pos;
+    uint64_t read_ns;               // host time the stage was read
+    // 24 bit tick to device ns
+    uint64_t tick_base;
+    uint32_t last_tick;
+    uint64_t last_read_ns;
+    int started;
+    // SOF alignment to the reference analyzer
+    uint64_t* sof_dev;              // device ns of the first SOF of each frame number
+    uint64_t* sof_host;
+    int last_frame;
+    int aligned;                    // UPV_MERGE_ALIGN_xxx
+    int64_t offset_ns;              // reference ns - device ns at sample_ns
+    int64_t drift_ppb;
+    uint64_t sample_ns;             // device ns of the last offset sample
+    int drift_valid;
+    // host clock lower envelope, used without SOF
+    int64_t env_ns;                 // min(host ns - device ns) of the last window
+    int64_t env_cur;
+    uint64_t env_start;
+    int env_valid;
+    // counters
+    uint64_t packets;
+    uint64_t late;                  // placed behind an emitted packet of another analyzer
+};
+
+/**
+ * k-way time merge of several analyzers
+ * Each analyzer pushes its packets into a ring, the merge thread reads them
+ * in batches into per analyzer stages and emits the packet with the smallest
+ * time of all stage heads. The 60MHz ticks are extended to 64 bit and
+ * mapped to the timebase of the first analyzer, with an offset and drift
+ * taken from SOF packets of equal frame number. Analyzers without matching
+ * SOFs are placed by the host time their packets were read.
+ * A packet waits for the other analyzers at most window_ms, nothing is
+ * allocated after add.
+ */
+class upv_merger
+{
+public:
+    upv_merger();
+    ~upv_merger();
+
+    int start(void* context, pfn_merge_handler handler, int window_ms);
+    // emits what is left, all analyzers have to be removed, returns -1 otherwise
+    int stop();
+    // returns the device tag, the first analyzer added is the time reference
+    int add(upv_s* upv);
+    // after upv_s::close, staged packets are still emitted
+    void remove(upv_s* upv);
+    int get_info(int device, upv_merge_info_t* info);
+
+protected:
+    void* merge_func();
+    static void* merge_callback(void* arg);
+    int  fill(upv_merge_input* in, uint64_t now);
+    void on_sof(int index, uint64_t dev_ns, uint64_t host_ns, const uint8_t* data);
+    void sample_offset(upv_merge_input* in, int64_t offset, uint64_t dev_ns);
+    int64_t to_ref(upv_merge_input* in, uint64_t dev_ns);
+    int  emit(uint64_t now, int flush);
+
+public:
+    pthread_mutex_t mutex;          // serializes add, remove and get_info
+    upv_merge_input inputs[UPV_MERGE_MAX];
+    std::atomic<int> input_count;
+    void* context;
+    pfn_merge_handler handler;
+    uint64_t window_ns;
+    int64_t last_ts;
+    pthread_t thread;
+    int running;
+    volatile int finish;
+};
+
+#endif
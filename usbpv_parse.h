@@ -0,0 +1,137 @@
+#ifndef __USBPV_PARSE_H__
+#define __USBPV_PARSE_H__
+
+#include <stdint.h>
+#include <atomic>
+
+#define UPV_START_CMD 0x57010155
+#define UPV_STOP_CMD  0x56000155
+
+// state of the device word stream parser
+struct upv_parse_state{
+    int data_state;
+    uint32_t last_header;
+    uint32_t data_buf[1024+16]; // USB max packet size <= 4096bytes
+    int32_t data_buf_idx;
+    int32_t pkt_len;
+    int32_t pkt_status;
+    int32_t pkt_tick;
+    std::atomic<uint64_t> recover_count;   // written by the parser only
+    std::atomic<int> pause_on_stop;        // next stop command pauses until start instead of ending
+    std::atomic<int> echo_count;           // config echoes seen while paused
+    uint32_t echo[16];
+};
+
+static const uint8_t upv_speed_cvt[16] = {
+  0x03,
+  0x02,
+  0x01,
+};
+
+/**
+ * Parse the device word stream, emit(tick, data, len, status) is called for
+ * each packet and bus event. Bus events pass the input buffer with len 0.
+ * The emitter is a template parameter so it inlines into the loop.
+ * \returns -1 when the stop command is seen, otherwise 0
+ */
+template<typename E>
+inline int upv_parse_data(upv_parse_state& st, const uint8_t* data, int len, E& emit)
+{
+    const uint32_t* buf = (const uint32_t*)data;
+    int count = len/4;
+    int ret = 0;
+    for(;count>0;count--,buf++){
+        uint32_t header = *buf;
+        switch(st.data_state){
+        case 0:
+            if(header == UPV_START_CMD){
+                st.data_state = 1;
+            }
+            break;
+        case 1:
+            if(header == UPV_STOP_CMD){
+                if(st.pause_on_stop.load(std::memory_order_relaxed)){
+                    st.pause_on_stop.store(0, std::memory_order_relaxed);
+                    st.data_state = 5;
+                    break;
+                }
+                ret = -1;
+                break;
+            }
+            st.pkt_tick = header>>8;
+            st.pkt_status = upv_speed_cvt[header&0x0f] | (header & 0xf0);
+            st.data_buf_idx = 0;
+            if((header & 0xf0) == 0x60){
+                st.pkt_status&=0xffffff0f;
+                st.data_state = 2;
+            }else{
+                emit(st.pkt_tick, data, 0, st.pkt_status);
+            }
+            break;
+        case 2:
+            st.pkt_len = header & 0xffff;
+            if(st.pkt_len > (1024+3)){
+                // wrong packet data
+                st.data_state = 10; // goto recover mode
+                break;
+            }
+            st.data_buf[st.data_buf_idx++] = header;
+            if(st.pkt_len <= 2){
+                emit(st.pkt_tick, ((const uint8_t*)st.data_buf)+2, st.pkt_len, st.pkt_status);
+                st.data_state = 1;
+            }else{
+                st.data_state = 3;
+            }
+            break;
+        case 3:
+            st.data_buf[st.data_buf_idx++] = header;
+            if(st.data_buf_idx * 4 - 2 >= st.pkt_len){
+                emit(st.pkt_tick, ((const uint8_t*)st.data_buf)+2, st.pkt_len, st.pkt_status);
+                st.data_state = 1;
+            }
+            break;
+        case 4:
+            if(header == UPV_STOP_CMD){
+                ret = -1;
+                break;
+            }
+            break;
+        case 5:
+            // paused for reconfiguration, register echoes until start
+            if(header == UPV_START_CMD){
+                st.data_state = 1;
+            }else if(header == UPV_STOP_CMD){
+                ret = -1;
+            }else{
+                int n = st.echo_count.load(std::memory_order_relaxed);
+                if(n < 16){
+                    st.echo[n] = header;
+                    st.echo_count.store(n + 1, std::memory_order_release);
+                }
+            }
+            break;
+        case 10:
+            st.pkt_len = header & 0xffff;
+            if((st.last_header & 0xf0) == 0x60 && st.pkt_len<=(1024+3)){
+                st.data_buf[st.data_buf_idx++] = header;
+                st.recover_count.store(st.recover_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                if(st.pkt_len <= 2){
+                    emit(st.pkt_tick, ((const uint8_t*)st.data_buf)+2, st.pkt_len, st.pkt_status);
+                    st.data_state = 1;
+                }else{
+                    st.data_state = 3;
+                }
+                break;
+            }
+            break;
+        default:
+            st.data_state = 1;
+            break;
+        }
+        st.last_header = header;
+        if(ret<0)break;
+    }
+    return ret;
+}
+
+#endif
@@ -0,0 +1,155 @@
+#include "usbpv_reconnect.h"
+#include "usbpv_thread.h"
+#include "string.h"
+#include <unistd.h>
+
+upv_reconnect::upv_reconnect()
+    :ctx(NULL)
+    ,hotplug(0)
+    ,has_hotplug(0)
+    ,arrived(0)
+    ,running(0)
+    ,finish(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+upv_reconnect::~upv_reconnect()
+{
+    stop();
+    pthread_mutex_destroy(&mutex);
+}
+
+int LIBUSB_CALL upv_reconnect::hotplug_callback(libusb_context* ctx, libusb_device* dev, libusb_hotplug_event event, void* user_data)
+{
+    (void)ctx;
+    (void)dev;
+    (void)event;
+    // the device is opened later from the watch thread, not inside the callback
+    ((upv_reconnect*)user_data)->arrived = 1;
+    return 0;
+}
+
+void* upv_reconnect::watch_callback(void* arg)
+{
+    return ((upv_reconnect*)arg)->watch_func();
+}
+
+void* upv_reconnect::watch_func()
+{
+    while(!finish){
+        if(has_hotplug){
+            struct timeval tv = {0, UPV_RECONNECT_POLL_MS*1000};
+            libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+        }else{
+            usleep(UPV_RECONNECT_POLL_MS*1000);
+        }
+        int arrival = arrived;
+        arrived = 0;
+        uint64_t now = upv_now_ns();
+        pthread_mutex_lock(&mutex);
+        for(list<upv_reconnect_entry>::iterator it = devices.begin(); it != devices.end(); ++it){
+            upv_s* upv = it->upv;
+            if(!it->lost && upv->device_lost && upv->capture_running){
+                UPV_LOG("analyzer %s lost, waiting for it\n", upv->open_option.c_str());
+                upv->stop_capture(0);
+                upv->close();
+                it->lost = 1;
+                it->retry_ns = now;
+            }
+            if(it->lost && (arrival || now >= it->retry_ns)){
+                if(upv->reopen() == upv_s::R_Success){
+                    UPV_LOG("analyzer %s reconnected\n", upv->open_option.c_str());
+                    it->lost = 0;
+                }else{
+                    upv->close();
+                    it->retry_ns = now + UPV_RECONNECT_RETRY_MS*1000000ull;
+                }
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+int upv_reconnect::start()
+{
+    if(running){
+        return 0;
+    }
+    if(libusb_init(&ctx) < 0){
+        ctx = NULL;
+        return -1;
+    }
+    has_hotplug = 0;
+    if(libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)){
+        int r = libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+                UPV_VID, UPV_PID, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, this, &hotplug);
+        has_hotplug = r == LIBUSB_SUCCESS;
+    }
+    finish = 0;
+    upv_thread_param_t param;
+    memset(&param, 0, sizeof(param));
+    param.policy = UPV_SCHED_OTHER;
+    strcpy(param.name, "upv_reconnect");
+    if(upv_thread_create(&thread, &param, watch_callback, this) != 0){
+        if(has_hotplug){
+            libusb_hotplug_deregister_callback(ctx, hotplug);
+        }
+        libusb_exit(ctx);
+        ctx = NULL;
+        return -1;
+    }
+    running = 1;
+    return 0;
+}
+
+void upv_reconnect::stop()
+{
+    if(!running){
+        return;
+    }
+    finish = 1;
+    if(has_hotplug){
+        libusb_interrupt_event_handler(ctx);
+    }
+    pthread_join(thread, NULL);
+    if(has_hotplug){
+        libusb_hotplug_deregister_callback(ctx, hotplug);
+    }
+    libusb_exit(ctx);
+    ctx = NULL;
+    running = 0;
+}
+
+int upv_reconnect::add(upv_s* upv)
+{
+    pthread_mutex_lock(&mutex);
+    if(start() != 0){
+        pthread_mutex_unlock(&mutex);
+        return -1;
+    }
+    for(list<upv_reconnect_entry>::iterator it = devices.begin(); it != devices.end(); ++it){
+        if(it->upv == upv){
+            pthread_mutex_unlock(&mutex);
+            return 0;
+        }
+    }
+    upv_reconnect_entry e = {upv, 0, 0};
+    devices.push_back(e);
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+void upv_reconnect::remove(upv_s* upv)
+{
+    // waits for a reopen of this analyzer in progress
+    pthread_mutex_lock(&mutex);
+    for(list<upv_reconnect_entry>::iterator it = devices.begin(); it != devices.end(); ++it){
+        if(it->upv == upv){
+            devices.erase(it);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
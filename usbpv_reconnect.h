@@ -0,0 +1,53 @@
+#ifndef __USBPV_RECONNECT_H__
+#define __USBPV_RECONNECT_H__
+
+#include "usbpv_s.h"
+
+#define UPV_RECONNECT_POLL_MS    200
+#define UPV_RECONNECT_RETRY_MS   1000
+
+struct upv_reconnect_entry{
+    upv_s* upv;
+    int lost;                       // capture stopped, waiting for the analyzer
+    uint64_t retry_ns;
+};
+
+/**
+ * Reopen analyzers that were unplugged or re-enumerated
+ * One thread watches all added analyzers. When the transfers of one end
+ * with a USB error its capture is stopped, and it is opened again by serial
+ * with the last options when a matching device arrives, or every
+ * UPV_RECONNECT_RETRY_MS where libusb has no hotplug support. The packet
+ * handler gets a UPV_CAPTURE_GAP event before the packets after the gap.
+ */
+class upv_reconnect
+{
+public:
+    upv_reconnect();
+    ~upv_reconnect();
+
+    // starts the thread with the first analyzer
+    int add(upv_s* upv);
+    // before upv_s::close
+    void remove(upv_s* upv);
+    void stop();
+
+protected:
+    int  start();
+    void* watch_func();
+    static void* watch_callback(void* arg);
+    static int LIBUSB_CALL hotplug_callback(libusb_context* ctx, libusb_device* dev, libusb_hotplug_event event, void* user_data);
+
+public:
+    pthread_mutex_t mutex;          // serializes add, remove and the reopen
+    list<upv_reconnect_entry> devices;
+    libusb_context* ctx;
+    libusb_hotplug_callback_handle hotplug;
+    int has_hotplug;
+    volatile int arrived;           // set by the hotplug callback
+    pthread_t thread;
+    int running;
+    volatile int finish;
+};
+
+#endif
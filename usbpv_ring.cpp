@@ -0,0 +1,142 @@
+#include "usbpv_ring.h"
+#include "string.h"
+#include "errno.h"
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+upv_packet_ring::upv_packet_ring(uint32_t ring_size)
+    :event_fd(-1)
+    ,head(0)
+    ,tail_cache(0)
+    ,lost_count(0)
+    ,lost_tick(0)
+    ,drop_count(0)
+    ,tail(0)
+{
+    size = 64*1024;
+    while(size < ring_size && size < 0x80000000u){
+        size <<= 1;
+    }
+    mask = size - 1;
+    buf = new uint8_t[size];
+#ifdef __linux__
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+    sem_init(&sem, 0, 0);
+#endif
+}
+
+upv_packet_ring::~upv_packet_ring()
+{
+#ifdef __linux__
+    if(event_fd >= 0){
+        ::close(event_fd);
+    }
+#else
+    sem_destroy(&sem);
+#endif
+    delete[] buf;
+}
+
+void upv_packet_ring::signal()
+{
+#ifdef __linux__
+    uint64_t v = 1;
+    if(::write(event_fd, &v, sizeof(v)) < 0){
+        // counter full, the reader is signaled anyway
+    }
+#else
+    sem_post(&sem);
+#endif
+}
+
+void upv_packet_ring::clear_signal()
+{
+#ifdef __linux__
+    uint64_t v;
+    if(::read(event_fd, &v, sizeof(v)) < 0){
+        // EAGAIN, nothing signaled
+    }
+#else
+    while(sem_trywait(&sem) == 0);
+#endif
+}
+
+int upv_packet_ring::wait(int timeout_ms)
+{
+    // clear before the last look, a push after it signals again
+    clear_signal();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(head.load(std::memory_order_acquire) != tail.load(std::memory_order_relaxed)){
+        return 1;
+    }
+    if(timeout_ms == 0){
+        return 0;
+    }
+#ifdef __linux__
+    struct pollfd pfd;
+    pfd.fd = event_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int r;
+    do{
+        r = poll(&pfd, 1, timeout_ms);
+    }while(r < 0 && errno == EINTR);
+    return r > 0;
+#else
+    int r;
+    if(timeout_ms < 0){
+        r = sem_wait(&sem);
+    }else{
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        long ns = ts.tv_nsec + (timeout_ms%1000)*1000000L;
+        ts.tv_sec += timeout_ms/1000 + ns/1000000000;
+        ts.tv_nsec = ns%1000000000;
+        r = sem_timedwait(&sem, &ts);
+    }
+    return r == 0;
+#endif
+}
+
+int upv_packet_ring::read(void* out, int buf_size, int max_packets, int timeout_ms, int* used)
+{
+    uint8_t* dst = (uint8_t*)out;
+    int n = 0;
+    int pos = 0;
+    int waited = 0;
+    while(true){
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        uint64_t h = head.load(std::memory_order_acquire);
+        while(t < h && n < max_packets){
+            const upv_packet_t* p = (const upv_packet_t*)(buf + (t & mask));
+            if(p->status == UPV_RING_PAD){
+                t += size - (t & mask);
+                continue;
+            }
+            int sz = UPV_PACKET_SIZE(p->len);
+            if(pos + sz > buf_size){
+                break;
+            }
+            memcpy(dst + pos, p, sz);
+            pos += sz;
+            t += sz;
+            n++;
+        }
+        tail.store(t, std::memory_order_release);
+        if(n > 0 || waited){
+            break;
+        }
+        waited = 1;
+        if(!wait(timeout_ms)){
+            break;
+        }
+    }
+    if(used){
+        *used = pos;
+    }
+    return n;
+}
@@ -0,0 +1,109 @@
+#ifndef __USBPV_RING_H__
+#define __USBPV_RING_H__
+
+#include "usbpv_s.h"
+#include "usbpv_lib.h"
+#include <atomic>
+
+#define UPV_RING_DEFAULT_SIZE  (16*1024*1024)
+#define UPV_RING_PAD           0xffff        // status of the filler record before the wrap
+
+/**
+ * Single producer single consumer packet ring
+ * The parser thread pushes upv_packet_t records, one reader thread reads them
+ * in batches. Neither side takes a lock, the reader is woken through an
+ * eventfd (a semaphore on other systems) only when the ring was empty. A full
+ * ring drops packets, the next pushed record is then a UPV_OVERFLOW event.
+ */
+class upv_packet_ring
+{
+public:
+    upv_packet_ring(uint32_t ring_size = UPV_RING_DEFAULT_SIZE);
+    ~upv_packet_ring();
+
+    inline void push(uint32_t tick, const void* data, int len, long status){
+        if(lost_count){
+            if(!put(lost_tick, NULL, 0, (UPV_OVERFLOW<<4) | GetPacketSpeed(status))){
+                drop_count++;
+                return;
+            }
+            lost_count = 0;
+        }
+        if(!put(tick, data, len, status)){
+            if(lost_count == 0){
+                lost_tick = tick;
+            }
+            lost_count++;
+            drop_count++;
+        }
+    }
+
+    /**
+     * copy packets into buf as upv_packet_t records
+     * \param timeout_ms wait time when the ring is empty, <0 wait forever
+     * \returns number of packets, *used gets the copied bytes
+     */
+    int read(void* buf, int buf_size, int max_packets, int timeout_ms, int* used);
+
+    // readable when packets may be available, -1 when not supported
+    int fd() const { return event_fd; }
+    uint64_t dropped() const { return drop_count; }
+
+protected:
+    inline int put(uint32_t tick, const void* data, int len, long status){
+        uint64_t h0 = head.load(std::memory_order_relaxed);
+        uint64_t h = h0;
+        uint32_t need = UPV_PACKET_SIZE(len);
+        uint32_t off = h & mask;
+        uint32_t pad = off + need > size ? size - off : 0;
+        if(h + pad + need > tail_cache + size){
+            tail_cache = tail.load(std::memory_order_acquire);
+            if(h + pad + need > tail_cache + size){
+                return 0;
+            }
+        }
+        if(pad){
+            ((upv_packet_t*)(buf + off))->status = UPV_RING_PAD;
+            h += pad;
+            off = 0;
+        }
+        upv_packet_t* p = (upv_packet_t*)(buf + off);
+        p->tick_60MHz = tick;
+        p->len = len;
+        p->status = (uint16_t)status;
+        if(len > 0){
+            memcpy(p + 1, data, len);
+        }
+        head.store(h + need, std::memory_order_release);
+        // pairs with the fence in wait(), either the reader sees the packet or we see the reader caught up
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(tail.load(std::memory_order_relaxed) == h0){
+            signal();
+        }
+        return 1;
+    }
+    void signal();
+    void clear_signal();
+    int  wait(int timeout_ms);
+
+public:
+    uint8_t* buf;
+    uint32_t size;
+    uint32_t mask;
+    int event_fd;
+#ifndef __linux__
+    sem_t sem;
+#endif
+    // producer side, padded so head and tail stay on separate cache lines
+    char pad0[64];
+    std::atomic<uint64_t> head;
+    uint64_t tail_cache;
+    uint64_t lost_count;         // dropped since the last pushed record
+    uint32_t lost_tick;
+    uint64_t drop_count;
+    char pad1[64];
+    // consumer side
+    std::atomic<uint64_t> tail;
+};
+
+#endif
@@ -1,4 +1,8 @@
 #include "usbpv_s.h"
+#include "usbpv_emit.h"
+#include "usbpv_latency.h"
+#include "usbpv_thread.h"
+#include "usbpv_enum.h"
 #include "string.h"
 #include "pthread.h"
 #include "signal.h"
@@ -12,24 +16,34 @@ const uint8_t init_data[] = {
 #include "init_data.txt"
 };
 
-#define UPV_VID 0x16C0
-#define UPV_PID 0x05DC
-#define UPV_MAN "tusb.org"
-
-#define UPV_START_CMD 0x57010155
-#define UPV_STOP_CMD  0x56000155
-
 #define DBG_PRINTF   printf
 
 
 int upv_usb_open_serial(libusb_context *usb_ctx, libusb_device_handle **usb_dev, int vendor, int product,
-                             const char* description, const char* serial, uint16_t* bcdUSB, const char** error_string);
+                             const char* description, const char* serial, uint16_t* bcdUSB, const char** error_string,
+                             uint64_t* match_ns);
 
 int upv_get_status(libusb_device_handle *usb_dev, const char** error_string);
 int upv_reset_device(libusb_device_handle *usb_dev, const char** error_string);
 int upv_start_device(libusb_device_handle *usb_dev, const char** error_string);
+int upv_dummy_read_data(libusb_device_handle *usb_dev, const char** error_string);
 int upv_write_data(libusb_device_handle *usb_dev, unsigned char *buf, int size, const char** error_string);
 int upv_write_config_data(libusb_device_handle *usb_dev, uint8_t id, uint8_t val);
+int upv_write_data_async(libusb_context *usb_ctx, libusb_device_handle *usb_dev, unsigned char *buf, int size, const char** error_string);
+int upv_get_serial(libusb_device_handle *usb_dev, char* buf, int size);
+int upv_load_cache_match(const char* serial, uint64_t hash);
+void upv_load_cache_store(const char* serial, uint64_t hash);
+int upv_write_config_batch(libusb_context *usb_ctx, libusb_device_handle *usb_dev, const uint8_t* id, const uint8_t* val, int count);
+
+// FNV-1a of the FPGA image, tells a loaded device apart from one loaded by another build
+static uint64_t init_data_hash()
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for(size_t i=0;i<sizeof(init_data);i++){
+        h = (h ^ init_data[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
 
 static void msleep(unsigned int ms) {
 #ifdef WIN32
@@ -51,103 +65,67 @@ upv_s::upv_s()
     ,data_reader_q(NULL)
     ,data_parser_q(NULL)
     ,packet_handler(NULL)
+    ,bw_stats(NULL)
+    ,trigger(NULL)
+    ,ring(NULL)
+    ,shm(NULL)
+    ,fanout(NULL)
+    ,merge_ring(NULL)
+    ,latency(NULL)
+    ,health(NULL)
+    ,data_processor(NULL)
+    ,thread_param(NULL)
+    ,shared_ctx(NULL)
+    ,inline_parse(0)
+    ,transfer_count(0)
+    ,transfers_active(0)
+    ,parked_transfer(NULL)
+    ,held_buffer(NULL)
+    ,latency_target_ms(0)
+    ,rx_rate(0)
+    ,rx_rate_ns(0)
+    ,processor_context(NULL)
     ,capture_finish(1)
-    ,data_state(0)
+    ,capture_running(0)
+    ,capture_abort(0)
+    ,paused(0)
+    ,device_lost(0)
+    ,reconnects(0)
+    ,dbg_running(0)
+    ,dbg_finish(1)
+    ,dbg_interval_ms(0)
 {
-
+    data_state = 0;
+    pause_on_stop.store(0);
+    echo_count.store(0);
+    memset(&open_times, 0, sizeof(open_times));
+    for(int i=0;i<UPV_THREAD_MAX;i++){
+        thread_tid[i].store(0);
+    }
+    reset_stats();
 }
 upv_s::~upv_s(){
     close();
+    set_stats_print(0);
 }
 
-upv_s::upv_result upv_s::open(const char* option, int opt_len)
+// speed, flag and filter registers from the option bytes after the SN
+static int build_config(const char* option, int opt_len, int param_index, uint8_t* cfg_id, uint8_t* cfg_val)
 {
-    close();
-    if(libusb_init(&usb_ctx)<0){
-        return upv_s::R_EEInit;
-    }
-    char sn[128] = "";
-    if(opt_len > 0){
-        strncpy(sn, option, opt_len);
-    }else{
-        strncpy(sn, option, sizeof(sn));
-    }
-    int sn_len = strlen(sn);
-    int r = upv_usb_open_serial(usb_ctx, &usb_dev, UPV_VID, UPV_PID, UPV_MAN, sn, &bcdUSB, &last_error_string);
-    if(r < 0){
-        if(r == -3){
-            return upv_s::R_DeviceNotFound;
-        }
-        return upv_s::R_DeviceNotOpen;
-    }
-
-    int retry = 3;
-    do{
-        r = upv_get_status(usb_dev, NULL);
-        if(r < 0){
-            return upv_s::R_DeviceStatus;
-        }
-        if((r & 0xf0) == 0){
-            break;
-        }
-        retry--;
-        if(retry <= 0){
-            return upv_s::R_Load;
-            break;
-        }
-        msleep(1);
-        r = upv_reset_device(usb_dev, NULL);
-        if(r < 0){
-            return upv_s::R_Load;
-        }
-    }while(retry>0);
-
-    r = upv_write_data(usb_dev, (uint8_t*)init_data, sizeof(init_data), NULL);
-    if(r < 0){
-        return upv_s::R_Load;
-    }
-
-    retry = 3;
-    do{
-        r = upv_get_status(usb_dev, NULL);
-        if(r < 0){
-            return upv_s::R_DeviceStatus;
-        }
-        if((r & 0x0f) == 3){
-            break;
-        }
-        retry--;
-        if(retry <= 0){
-            return upv_s::R_Load;
-            break;
-        }
-    }while(retry>0);
-
-    r = upv_start_device(usb_dev, NULL);
-    if(r < 0){
-        return upv_s::R_Load;
-    }
-
+    int cfg_count = 0;
     int speed = CS_AutoSpeed;
-    int param_index = sn_len+1;
     if(opt_len > param_index){
         speed = option[param_index++];
     }
-    r = upv_write_config_data(usb_dev, 8, 0x0c | (speed & 0x03));
-    if( r < 0){
-        UPV_LOG("Fail to write speed data\n");
-        return upv_s::R_WriteConfig;
-    }
+    cfg_id[cfg_count] = 8;
+    cfg_val[cfg_count++] = 0x0c | (speed & 0x03);
 
     uint8_t flag = UPV_FLAG_ALL;
     if(opt_len > param_index){
         flag = option[param_index++];
     }
-    r = upv_write_config_data(usb_dev, 31, flag^0xff);
-    if( r < 0) {
-        UPV_LOG("Fail to write flag data\n");
-        return upv_s::R_WriteConfig;
-    }
+    cfg_id[cfg_count] = 31;
+    cfg_val[cfg_count++] = flag^0xff;
 
     {
         struct AddrEpFilter_t{
@@ -209,35 +187,307 @@ upv_s::upv_result upv_s::open(const char* option, int opt_len)
             }
         }
 
-        uint8_t addr = 32;
         for(int i=0;i<8;i++){
-            uint8_t v = filter[i];
-            r = upv_write_config_data(usb_dev, addr, v);
-            if(r!=R_Success){
-                UPV_LOG("Fail to write filter data %d\n", i);
-                return upv_s::R_WriteConfig;
+            cfg_id[cfg_count] = 32 + i;
+            cfg_val[cfg_count++] = filter[i];
+        }
+    }
+
+    return cfg_count;
+}
+
+upv_s::upv_result upv_s::open(const char* option, int opt_len)
+{
+    close();
+    memset(&open_times, 0, sizeof(open_times));
+    uint64_t t0 = upv_now_ns();
+    uint64_t t = t0;
+    if(shared_ctx){
+        usb_ctx = shared_ctx;
+    }else if(libusb_init(&usb_ctx)<0){
+        return upv_s::R_EEInit;
+    }
+    open_times.init_ns = upv_now_ns() - t;
+    t = upv_now_ns();
+    char sn[128] = "";
+    if(opt_len > 0){
+        strncpy(sn, option, opt_len);
+    }else{
+        strncpy(sn, option, sizeof(sn));
+    }
+    int sn_len = strlen(sn);
+    int r = upv_usb_open_serial(usb_ctx, &usb_dev, UPV_VID, UPV_PID, UPV_MAN, sn, &bcdUSB, &last_error_string, &open_times.match_ns);
+    if(r < 0){
+        if(r == -3){
+            return upv_s::R_DeviceNotFound;
+        }
+        return upv_s::R_DeviceNotOpen;
+    }
+    open_times.usb_open_ns = upv_now_ns() - t;
+    t = upv_now_ns();
+
+    char dev_sn[128];
+    upv_get_serial(usb_dev, dev_sn, sizeof(dev_sn));
+    uint64_t hash = init_data_hash();
+    r = upv_get_status(usb_dev, NULL);
+    open_times.status_polls++;
+    if(r < 0){
+        return upv_s::R_DeviceStatus;
+    }
+    open_times.check_ns = upv_now_ns() - t;
+    t = upv_now_ns();
+    // idle and still loaded with this image by an earlier open, power loss clears the status
+    if((r & 0xff) == 3 && upv_load_cache_match(dev_sn, hash)){
+        open_times.load_skipped = 1;
+    }else{
+        upv_load_cache_store(dev_sn, 0);
+        r = upv_reset_device(usb_dev, NULL);
+        if(r < 0){
+            return upv_s::R_DeviceNotOpen;
+        }
+        int retry = 3;
+        do{
+            r = upv_get_status(usb_dev, NULL);
+            open_times.status_polls++;
+            if(r < 0){
+                return upv_s::R_DeviceStatus;
+            }
+            if((r & 0xf0) == 0){
+                break;
+            }
+            retry--;
+            if(retry <= 0){
+                return upv_s::R_Load;
+                break;
+            }
+            msleep(1);
+            r = upv_reset_device(usb_dev, NULL);
+            if(r < 0){
+                return upv_s::R_Load;
+            }
+        }while(retry>0);
+
+        open_times.reset_ns = upv_now_ns() - t;
+        t = upv_now_ns();
+
+        r = upv_write_data_async(usb_ctx, usb_dev, (uint8_t*)init_data, sizeof(init_data), NULL);
+        if(r < 0){
+            return upv_s::R_Load;
+        }
+        open_times.load_ns = upv_now_ns() - t;
+        t = upv_now_ns();
+
+        retry = 3;
+        do{
+            r = upv_get_status(usb_dev, NULL);
+            open_times.status_polls++;
+            if(r < 0){
+                return upv_s::R_DeviceStatus;
             }
-            addr++;
+            if((r & 0x0f) == 3){
+                break;
+            }
+            retry--;
+            if(retry <= 0){
+                return upv_s::R_Load;
+                break;
+            }
+        }while(retry>0);
+        upv_load_cache_store(dev_sn, hash);
+    }
+
+    r = upv_start_device(usb_dev, NULL);
+    if(r < 0){
+        upv_load_cache_store(dev_sn, 0);
+        return upv_s::R_Load;
+    }
+    open_times.start_ns = upv_now_ns() - t;
+    t = upv_now_ns();
+
+    uint8_t cfg_id[UPV_CONFIG_REGS];
+    uint8_t cfg_val[UPV_CONFIG_REGS];
+    int cfg_count = build_config(option, opt_len, sn_len+1, cfg_id, cfg_val);
+    open_times.config_writes = cfg_count;
+    r = write_config(cfg_id, cfg_val, cfg_count, &open_times);
+    if(r != R_Success){
+        return (upv_result)r;
+    }
+    open_times.config_ns = upv_now_ns() - t;
+    open_times.total_ns = upv_now_ns() - t0;
+
+    // reopen the same analyzer with the same config after it was lost
+    string keep(dev_sn);
+    keep.push_back('\0');
+    if(opt_len > sn_len + 1){
+        keep.append(option + sn_len + 1, opt_len - sn_len - 1);
+    }
+    open_option.swap(keep);
+
+    return upv_s::R_Success;
+}
+
+// all registers in one batch, one by one when the firmware does not take it
+upv_s::upv_result upv_s::write_config(const uint8_t* cfg_id, const uint8_t* cfg_val, int cfg_count, upv_open_times* times)
+{
+    int r = upv_write_config_batch(usb_ctx, usb_dev, cfg_id, cfg_val, cfg_count);
+    if(r == 0){
+        if(times){
+            times->config_batched = 1;
+        }
+        return upv_s::R_Success;
+    }
+    // drop stale echoes and write one by one
+    UPV_LOG("Batched config failed %d, write one by one\n", r);
+    uint64_t t = upv_now_ns();
+    upv_dummy_read_data(usb_dev, NULL);
+    if(times){
+        times->drain_ns = upv_now_ns() - t;
+    }
+    for(int i=0;i<cfg_count;i++){
+        r = upv_write_config_data(usb_dev, cfg_id[i], cfg_val[i]);
+        if(r!=R_Success){
+            UPV_LOG("Fail to write config register %d\n", cfg_id[i]);
+            return upv_s::R_WriteConfig;
+        }
+    }
+    if(times){
+        times->config_batched = 0;
+    }
+    return upv_s::R_Success;
+}
+
+// config bytes after the SN of the open option, used by reopen
+static void keep_config(string& option, const char* config, int len)
+{
+    string keep(option.c_str());
+    keep.push_back('\0');
+    keep.append(config, len);
+    option.swap(keep);
+}
+
+upv_s::upv_result upv_s::reconfigure(const char* config, int len)
+{
+    static uint32_t stop_cmd = UPV_STOP_CMD;
+    static uint32_t start_cmd = UPV_START_CMD;
+    uint8_t cfg_id[UPV_CONFIG_REGS];
+    uint8_t cfg_val[UPV_CONFIG_REGS];
+    int cfg_count = build_config(config, len, 0, cfg_id, cfg_val);
+    if(usb_dev == NULL){
+        return upv_s::R_DeviceNotOpen;
+    }
+    if(capture_finish){
+        // nothing reads the stream, the echoes come back directly
+        upv_dummy_read_data(usb_dev, NULL);
+        upv_result res = write_config(cfg_id, cfg_val, cfg_count, NULL);
+        if(res == upv_s::R_Success){
+            keep_config(open_option, config, len);
         }
+        return res;
     }
 
+    // capturing: the parser takes the stop as a pause and collects the echoes
+    // from the stream until the start command comes back
+    uint8_t cmd[UPV_CONFIG_REGS*4];
+    for(int i=0;i<cfg_count;i++){
+        cmd[i*4] = 0x55;
+        cmd[i*4+1] = cfg_id[i];
+        cmd[i*4+2] = cfg_val[i];
+        cmd[i*4+3] = (uint8_t)0x55+cfg_id[i]+cfg_val[i];
+    }
+    int was_paused = paused;
+    int r = 0;
+    echo_count.store(0);
+    if(!was_paused){
+        pause_on_stop.store(1);
+        r = upv_write_data(usb_dev, (uint8_t*)&stop_cmd, 4, NULL);
+        if (r < 0) {
+            pause_on_stop.store(0);
+            return upv_s::R_WriteConfig;
+        }
+    }
+    for(int i=0;i<cfg_count && r>=0;i++){
+        r = upv_write_data(usb_dev, cmd+i*4, 4, NULL);
+    }
+    // parser may be behind by queued buffers
+    uint64_t end_ns = upv_now_ns() + UPV_RECONFIG_TIMEOUT*1000000ull;
+    while(r >= 0 && echo_count.load(std::memory_order_acquire) < cfg_count && upv_now_ns() < end_ns){
+        msleep(1);
+    }
+    // restart even on error, the capture must go on
+    int rs = was_paused ? 0 : upv_write_data(usb_dev, (uint8_t*)&start_cmd, 4, NULL);
+    if (r < 0 || rs < 0) {
+        return upv_s::R_WriteConfig;
+    }
+    if(echo_count.load(std::memory_order_acquire) < cfg_count){
+        UPV_LOG("Reconfig got %d of %d echoes\n", echo_count.load(), cfg_count);
+        return upv_s::R_WriteConfig;
+    }
+    if(memcmp(echo, cmd, cfg_count*4) != 0){
+        UPV_LOG("Reconfig, data mismatch\n");
+        return upv_s::R_WriteConfig;
+    }
+    keep_config(open_option, config, len);
     return upv_s::R_Success;
 }
 
+static const upv_thread_param_t* thread_param_of(upv_s* upv, int idx)
+{
+    return upv->thread_param ? &upv->thread_param[idx] : NULL;
+}
 static void* reader_thread_callback(void* upv)
 {
-    return ((upv_s*)upv)->reader_thread_func();
+    upv_s* pv = (upv_s*)upv;
+    pv->thread_tid[UPV_THREAD_READER] = upv_thread_enter(thread_param_of(pv, UPV_THREAD_READER));
+    return pv->reader_thread_func();
 }
 static void* parser_thread_callback(void* upv)
 {
-    return ((upv_s*)upv)->parser_thread_func();
+    upv_s* pv = (upv_s*)upv;
+    pv->thread_tid[UPV_THREAD_PARSER] = upv_thread_enter(thread_param_of(pv, UPV_THREAD_PARSER));
+    return pv->parser_thread_func();
 }
-#ifdef UPV_PKT_DEBUG
 static void* dbg_thread_callback(void* upv)
 {
-    return ((upv_s*)upv)->dbg_thread_func();
+    upv_s* pv = (upv_s*)upv;
+    pv->thread_tid[UPV_THREAD_STATS] = upv_thread_enter(thread_param_of(pv, UPV_THREAD_STATS));
+    return pv->dbg_thread_func();
+}
+
+void upv_s::reset_stats()
+{
+    stats.rx_bytes.store(0);
+    stats.parsed_bytes.store(0);
+    stats.transfers.store(0);
+    for(int i=0;i<16;i++){
+        stats.packets[i].store(0);
+    }
+    stats.fifo_remain.store(255);
+    stats.last_rx_len.store(0);
+    stats.pool_stalls.store(0);
+    recover_count.store(0);
+    mem_pool.reset_min();
+    gettimeofday(&stats.start_time, NULL);
+}
+
+int upv_s::set_stats_print(int interval_ms)
+{
+    void* thread_res;
+    if(interval_ms > 0){
+        dbg_interval_ms = interval_ms;
+        if(!dbg_running){
+            dbg_finish = 0;
+            if(upv_thread_create(&dbg_thread, thread_param_of(this, UPV_THREAD_STATS), dbg_thread_callback, this) != 0){
+                return -1;
+            }
+            dbg_running = 1;
+        }
+    }else if(dbg_running){
+        dbg_finish = 1;
+        pthread_join(dbg_thread, &thread_res);
+        dbg_running = 0;
+    }
+    return 0;
 }
-#endif
 upv_s::upv_result upv_s::start_capture(void* context, pfnt_on_packet callback)
 {
     capture_context = context;
@@ -246,35 +496,52 @@ upv_s::upv_result upv_s::start_capture(void* context, pfnt_on_packet callback)
         return upv_s::R_DeviceNotOpen;
     }
 
+    if(capture_running){
+        return upv_s::R_Success;
+    }
+
+    reset_stats();
+    // queues of the last capture may hold end marks
+    delete buf_data_q;
+    delete data_reader_q;
+    delete data_parser_q;
     buf_data_q = new upv_queue<buf_data_t>;
     data_reader_q = new upv_queue<int>;
     data_parser_q = new upv_queue<int>;
 
     capture_finish = 0;
+    capture_abort = 0;
+    paused = 0;
+    device_lost = 0;
+    pause_on_stop.store(0);
 
-    int r = pthread_create(&reader_thread, NULL, reader_thread_callback, this);
-    if(r != 0){
-        return upv_s::R_Thread;
+    int r;
+    if(shared_ctx){
+        // the event thread of the manager handles the transfers
+        r = submit_transfers();
+        if(r < 0){
+            capture_finish = 1;
+            cancel_transfers();
+            return upv_s::R_Thread;
+        }
+    }else{
+        r = upv_thread_create(&reader_thread, thread_param_of(this, UPV_THREAD_READER), reader_thread_callback, this);
+        if(r != 0){
+            capture_finish = 1;
+            return upv_s::R_Thread;
+        }
     }
-    r = pthread_create(&parser_thread, NULL, parser_thread_callback, this);
+    r = inline_parse ? 0 : upv_thread_create(&parser_thread, thread_param_of(this, UPV_THREAD_PARSER), parser_thread_callback, this);
     if(r != 0){
+        capture_finish = 1;
+        end_reader();
+        if(held_buffer){
+            mem_pool.put(held_buffer);
+            held_buffer = NULL;
+        }
         return upv_s::R_Thread;
     }
-
-#ifdef UPV_PKT_DEBUG
-    gettimeofday(&dbg_start_time, NULL);
-    dbg_finish = 0;
-    dbg_recv_len = 0;
-    dbg_process_len = 0;
-    dbg_pkt_count = 0;
-    dbg_recover_count = 0;
-    dbg_last_remain = 0;
-    dbg_last_rx_len = 0;
-    int dbg_r = pthread_create(&dbg_thread, NULL, dbg_thread_callback, this);
-    if(dbg_r!=0){
-        printf("Fail to start debug thread\n");
-    }
-#endif
+    capture_running = 1;
 
     data_state = 0;
     uint32_t data = UPV_START_CMD;
@@ -283,21 +550,103 @@ upv_s::upv_result upv_s::start_capture(void* context, pfnt_on_packet callback)
     return upv_s::R_Success;
 }
 
+// cancel the transfers and queue the end mark for the parser, the own
+// reader thread does it when woken from libusb event handling
+void upv_s::end_reader()
+{
+    if(shared_ctx){
+        buf_data_q->en_q({0,0,0});
+        cancel_transfers();
+    }else{
+        libusb_interrupt_event_handler(usb_ctx);
+        pthread_join(reader_thread, NULL);
+    }
+}
+
+static inline void count_rx(upv_s* upv, int len)
+{
+    upv_stat_add(upv->stats.rx_bytes, (uint64_t)len);
+    upv_stat_add(upv->stats.transfers, (uint64_t)1);
+    upv->stats.last_rx_len.store(len, std::memory_order_relaxed);
+}
+
+// Gives the transfer the next pool buffer after its data was queued. The own
+// reader thread waits for one, the event thread of a manager serves other
+// analyzers too, so there the transfer is parked until the parser returns a
+// buffer and the device FIFO takes the data meanwhile. false when parked.
+bool upv_s::next_buffer(struct libusb_transfer* t)
+{
+    if (shared_ctx == NULL) {
+        t->buffer = mem_pool.get();
+        return true;
+    }
+    t->buffer = mem_pool.try_get();
+    if (t->buffer) {
+        return true;
+    }
+    upv_stat_add(stats.pool_stalls, (uint32_t)1);
+    // sized here, rx_rate is left to the event thread
+    adapt_transfer(t, mem_pool.size);
+    parked_transfer.store(t);
+    // a buffer returned before the transfer was parked doesn't resume it
+    resume_transfer();
+    return false;
+}
+
+// submit the parked transfer once a buffer is free, the parser calls it after
+// each buffer it returns
+void upv_s::resume_transfer()
+{
+    while (parked_transfer.load() != NULL) {
+        struct libusb_transfer* t = parked_transfer.exchange(NULL);
+        if (t == NULL) {
+            return;
+        }
+        t->buffer = mem_pool.try_get();
+        if (t->buffer == NULL) {
+            parked_transfer.store(t);
+            if (mem_pool.free_count(NULL) == 0) {
+                return;
+            }
+            // returned but not posted yet
+            continue;
+        }
+        int ret = -1;
+        if (!capture_finish) {
+            ret = libusb_submit_transfer(t);
+            if (ret < 0) {
+                device_lost = 1;
+                capture_finish = 1;
+            }
+        }
+        if (ret < 0) {
+            transfers_active--;
+        }
+        return;
+    }
+}
+
 static void LIBUSB_CALL usb_data_callback(struct libusb_transfer* transfer) {
     int ret = 0;
     upv_s* upv = (upv_s*)transfer->user_data;
     switch (transfer->status) {
     case LIBUSB_TRANSFER_COMPLETED: {
         if (transfer->actual_length > 0) {
-            upv->buf_data_q->en_q({transfer->buffer, transfer->actual_length});
-#ifdef UPV_PKT_DEBUG
-            upv->dbg_recv_len += transfer->actual_length;
-            upv->dbg_last_rx_len = transfer->actual_length;
-#endif
-            transfer->buffer = upv->mem_pool.get();
+            upv->buf_data_q->en_q({transfer->buffer, transfer->actual_length, upv->latency.load(std::memory_order_relaxed) ? upv_now_ns() : 0});
+            count_rx(upv, transfer->actual_length);
+            if (!upv->next_buffer(transfer)) {
+                break;
+            }
+        }
+        // a transfer completing while being cancelled must not come back
+        if (upv->capture_finish) {
+            ret = -1;
+            break;
         }
+        upv->adapt_transfer(transfer, upv->mem_pool.size);
         ret = libusb_submit_transfer(transfer);
         if (ret < 0) {
+            upv->device_lost = 1;
             upv->capture_finish = 1;
         }
     } break;
@@ -305,11 +654,23 @@ static void LIBUSB_CALL usb_data_callback(struct libusb_transfer* transfer) {
         upv->capture_finish = 1;
     } break;
     case LIBUSB_TRANSFER_TIMED_OUT: {
+        // data received before the timeout is valid
+        if (transfer->actual_length > 0) {
+            upv->buf_data_q->en_q({transfer->buffer, transfer->actual_length, upv->latency.load(std::memory_order_relaxed) ? upv_now_ns() : 0});
+            count_rx(upv, transfer->actual_length);
+            if (!upv->next_buffer(transfer)) {
+                break;
+            }
+        }
         if (!upv->capture_finish) {
+            upv->adapt_transfer(transfer, upv->mem_pool.size);
             ret = libusb_submit_transfer(transfer);
             if (ret < 0) {
+                upv->device_lost = 1;
                 upv->capture_finish = 1;
             }
+        }else{
+            ret = -1;
         }
     }break;
     case LIBUSB_TRANSFER_ERROR:
@@ -317,52 +678,190 @@ static void LIBUSB_CALL usb_data_callback(struct libusb_transfer* transfer) {
     case LIBUSB_TRANSFER_NO_DEVICE:
     case LIBUSB_TRANSFER_OVERFLOW:
     default: {
+        // unplugged or re-enumerated, unless the capture was ending anyway
+        if (!upv->capture_finish) {
+            upv->device_lost = 1;
+        }
         upv->capture_finish = 1;
+        ret = -1;
     } break;
     }
+    if (ret < 0 || transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+        upv->transfers_active--;
+    }
 }
 
-void* upv_s::reader_thread_func()
+// inline mode, the block is parsed in the libusb event thread and the buffer reused
+static void LIBUSB_CALL usb_inline_callback(struct libusb_transfer* transfer) {
+    upv_s* upv = (upv_s*)transfer->user_data;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED || transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+        // data received before a timeout is valid
+        if (transfer->actual_length > 0) {
+            count_rx(upv, transfer->actual_length);
+            if (upv->process_block(transfer->buffer, transfer->actual_length, upv->latency.load(std::memory_order_relaxed) ? upv_now_ns() : 0) < 0) {
+                upv->capture_finish = 1;
+            }
+        }
+        if (!upv->capture_finish) {
+            upv->adapt_transfer(transfer, UPV_INLINE_TRANSFER_SIZE);
+            if (libusb_submit_transfer(transfer) == 0) {
+                return;
+            }
+            upv->device_lost = 1;
+        }
+    }else if (transfer->status != LIBUSB_TRANSFER_CANCELLED && !upv->capture_finish) {
+        upv->device_lost = 1;
+    }
+    upv->capture_finish = 1;
+    upv->transfers_active--;
+}
+
+// with a latency target the next transfer is sized to fill in half the
+// target at the current rate, a full transfer doubles it
+void upv_s::adapt_transfer(struct libusb_transfer* t, int capacity)
 {
-    struct libusb_transfer* usb_transfer = libusb_alloc_transfer(0);
-    capture_finish = 0;
-    libusb_fill_bulk_transfer(usb_transfer, usb_dev, 0x81, mem_pool.get(), mem_pool.size,
-              &usb_data_callback, this, 1000);
+    if (latency_target_ms <= 0) {
+        return;
+    }
+    uint64_t now = upv_now_ns();
+    uint64_t dt = now - rx_rate_ns;
+    rx_rate_ns = now;
+    if (dt > 0) {
+        uint64_t r = (uint64_t)t->actual_length * 1000000 / dt;
+        rx_rate = (uint32_t)((rx_rate * 3ull + r) / 4);
+    }
+    uint64_t want = (uint64_t)rx_rate * latency_target_ms / 2;
+    if (t->actual_length == t->length && want < (uint64_t)t->length * 2) {
+        want = (uint64_t)t->length * 2;
+    }
+    if (want > (uint64_t)capacity) {
+        want = capacity;
+    }
+    if (want < UPV_MIN_TRANSFER_SIZE) {
+        want = UPV_MIN_TRANSFER_SIZE;
+    }
+    t->length = (int)(want & ~511ull);
+    t->timeout = latency_target_ms;
+}
+
+int upv_s::submit_transfers()
+{
+    int count = inline_parse ? UPV_INLINE_TRANSFERS : 1;
+    transfers_active = 0;
+    transfer_count = 0;
+    rx_rate = 0;
+    rx_rate_ns = upv_now_ns();
+    for (int i = 0; i < count; i++) {
+        struct libusb_transfer* t = libusb_alloc_transfer(0);
+        if (t == NULL) {
+            return -1;
+        }
+        if (inline_parse) {
+            libusb_fill_bulk_transfer(t, usb_dev, 0x81, new uint8_t[UPV_INLINE_TRANSFER_SIZE], UPV_INLINE_TRANSFER_SIZE,
+                      &usb_inline_callback, this, 1000);
+        } else {
+            libusb_fill_bulk_transfer(t, usb_dev, 0x81, mem_pool.get(), mem_pool.size,
+                      &usb_data_callback, this, 1000);
+        }
+        if (latency_target_ms > 0) {
+            t->length = UPV_MIN_TRANSFER_SIZE;
+            t->timeout = latency_target_ms;
+        }
+        transfers[transfer_count++] = t;
+        // counted first, with a manager the callback may run before submit returns
+        transfers_active++;
+        if (libusb_submit_transfer(t) < 0) {
+            transfers_active--;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void upv_s::cancel_transfers()
+{
+    // a parked transfer is not submitted, nothing to wait for
+    if (parked_transfer.exchange(NULL)) {
+        transfers_active--;
+    }
+    for (int i = 0; i < transfer_count; i++) {
+        libusb_cancel_transfer(transfers[i]);
+    }
+    // the transfers can be freed once their callbacks ran
+    struct timeval tv = {0, 100000};
+    for (int i = 0; i < 20 && transfers_active > 0; i++) {
+        libusb_handle_events_timeout_completed(usb_ctx, &tv, NULL);
+    }
+    if (transfers_active > 0) {
+        UPV_LOG("%d transfers not cancelled\n", transfers_active.load());
+        transfer_count = 0;
+        return;
+    }
+    for (int i = 0; i < transfer_count; i++) {
+        if (inline_parse) {
+            delete[] transfers[i]->buffer;
+        } else {
+            // newest buffer of the pool, returned after the parser is done
+            held_buffer = transfers[i]->buffer;
+        }
+        libusb_free_transfer(transfers[i]);
+    }
+    transfer_count = 0;
+}
 
+void* upv_s::reader_thread_func()
+{
     int ret = 0;
-    if ((ret = libusb_submit_transfer(usb_transfer)) < 0) {
-        libusb_free_transfer(usb_transfer);
+    if (submit_transfers() < 0) {
         capture_finish = 1;
-        buf_data_q->en_q({0,0});
+        cancel_transfers();
+        buf_data_q->en_q({0,0,0});
         data_reader_q->en_q(0);
         return NULL;
     }
 
     do {
         if ((ret = libusb_handle_events_completed(usb_ctx, NULL)) < 0) {
+            device_lost = 1;
             capture_finish = 1;
         }
     } while (!capture_finish);
 
-    buf_data_q->en_q({0,0});
-    libusb_cancel_transfer(usb_transfer);
+    buf_data_q->en_q({0,0,0});
+    cancel_transfers();
     data_reader_q->en_q(0);
 
     return NULL;
 }
 
+int upv_s::process_block(uint8_t* data, int len, uint64_t rx_ns)
+{
+    upv_latency* lat = rx_ns ? latency.load(std::memory_order_acquire) : NULL;
+    upv_health* hl = health.load(std::memory_order_acquire);
+    uint64_t deq_ns = (lat || hl) ? upv_now_ns() : 0;
+    int ret = data_processor ? data_processor(processor_context, data, len) : process_data(data, len);
+    if(deq_ns){
+        uint64_t done_ns = upv_now_ns();
+        if(lat){
+            lat->on_block(rx_ns, deq_ns, done_ns);
+        }
+        if(hl){
+            hl->on_block(this, deq_ns, done_ns);
+        }
+    }
+    upv_stat_add(stats.parsed_bytes, (uint64_t)len);
+    return ret;
+}
+
 void* upv_s::parser_thread_func()
 {
     buf_data_t msg;
     while (buf_data_q->de_q(msg)) {
         if (msg.buffer && msg.len) {
-            int len = (int)msg.len;
             uint8_t* data = (uint8_t*)msg.buffer;
-            int ret = process_data(data, len);
-#ifdef UPV_PKT_DEBUG
-            dbg_process_len += len;
-#endif
+            int ret = capture_abort ? 0 : process_block(data, (int)msg.len, msg.rx_ns);
             mem_pool.put(data);
+            resume_transfer();
             if (ret < 0) {
                 capture_finish = 1;
                 break;
@@ -376,12 +875,17 @@ void* upv_s::parser_thread_func()
     return NULL;
 }
 
-#ifdef UPV_PKT_DEBUG
 void* upv_s::dbg_thread_func()
 {
     int show_desc = 1;
     while(!dbg_finish){
-        msleep(1000);
+        // sleep in short steps so set_stats_print(0) returns quickly
+        for(int t=0;t<dbg_interval_ms && !dbg_finish;t+=100){
+            msleep(dbg_interval_ms - t < 100 ? dbg_interval_ms - t : 100);
+        }
+        if(dbg_finish){
+            break;
+        }
         if(show_desc){
             show_desc = 0;
             printf("\n"
@@ -397,7 +901,7 @@ void* upv_s::dbg_thread_func()
         struct timeval now;
         long seconds, microseconds;
         gettimeofday(&now, NULL);
-        long elapsed = now.tv_sec - dbg_start_time.tv_sec;
+        long elapsed = now.tv_sec - stats.start_time.tv_sec;
         printf("T: ");
         if(elapsed>=24*3600){
             printf("%dd", elapsed/(24*3600));
@@ -420,175 +924,171 @@ void* upv_s::dbg_thread_func()
         }else{
             printf("%ds", elapsed);
         }
-        printf(" Rx:%llu Px:%llu Pkt:%llu Rcv:%llu, Rm:%d LRx:%d     \r", dbg_recv_len, dbg_process_len, dbg_pkt_count, dbg_recover_count, dbg_last_remain, dbg_last_rx_len);
+        uint64_t pkt_count = 0;
+        for(int i=0;i<16;i++){
+            pkt_count += stats.packets[i].load(std::memory_order_relaxed);
+        }
+        printf(" Rx:%llu Px:%llu Pkt:%llu Rcv:%llu, Rm:%d LRx:%d     \r",
+               (unsigned long long)stats.rx_bytes.load(std::memory_order_relaxed),
+               (unsigned long long)stats.parsed_bytes.load(std::memory_order_relaxed),
+               (unsigned long long)pkt_count, (unsigned long long)recover_count.load(std::memory_order_relaxed),
+               (int)stats.fifo_remain.load(std::memory_order_relaxed),
+               (int)stats.last_rx_len.load(std::memory_order_relaxed));
         fflush(stdout);
     }
+    return NULL;
 }
-#endif
 
-const uint8_t speed_cvt[16] = {
-  0x03,
-  0x02,
-  0x01,
+// the packet callback of start_capture as the end of the hook chain
+struct upv_s_callback{
+    upv_s* upv;
+    inline void operator()(uint32_t tick, const uint8_t* data, int len, int status){
+        if(upv->packet_handler){
+            upv->packet_handler(upv->capture_context, tick, data, len, status);
+        }
+    }
 };
 
+inline void upv_s::emit_packet(const void* data, int len)
+{
+    upv_s_callback cb = {this};
+    upv_emit_packet(this, (const uint8_t*)data, len, cb);
+}
+
 __attribute__((weak)) int usbpv_record_data(const uint8_t* data, int len){ (void)data; (void)len; return 0; }
 int upv_s::process_data(const uint8_t* data, int len)
 {
-    const uint32_t* buf = (const uint32_t*)data;
-    int count = len/4;
-    int ret = 0;
-    for(;count>0;count--,buf++){
-        uint32_t header = *buf;
-        switch(data_state){
-        case 0:
-            if(header == UPV_START_CMD){
-                data_state = 1;
-            }
-            break;
-        case 1:
-            if(header == UPV_STOP_CMD){
-                ret = -1;
-                break;
-            }
-            pkt_tick = header>>8;
-            pkt_status = speed_cvt[header&0x0f] | (header & 0xf0);
-            data_buf_idx = 0;
-            if((header & 0xf0) == 0x60){
-                pkt_status&=0xffffff0f;
-                data_state = 2;
-            }else{
-#ifdef UPV_PKT_DEBUG
-                dbg_pkt_count++;
-#endif
-                if(packet_handler){
-                    packet_handler(capture_context, pkt_tick, data, 0, pkt_status);
-                }
-            }
-            break;
-        case 2:
-            pkt_len = header & 0xffff;
-            if(pkt_len > (1024+3)){
-                // wrong packet data
-                data_state = 10; // goto recover mode
-                break;
-            }
-            data_buf[data_buf_idx++] = header;
-            if(pkt_len <= 2){
-#ifdef UPV_PKT_DEBUG
-                if(pkt_len&1){
-                    dbg_last_remain = ((uint8_t*)data_buf)[pkt_len+2];
-                }
-                dbg_pkt_count++;
-#endif
-                if(packet_handler){
-                    packet_handler(capture_context, pkt_tick, ((char*)data_buf)+2, pkt_len, pkt_status);
-                }
-                data_state = 1;
-            }else{
-                data_state = 3;
-            }
-            break;
-        case 3:
-            data_buf[data_buf_idx++] = header;
-            if(data_buf_idx * 4 - 2 >= pkt_len){
-#ifdef UPV_PKT_DEBUG
-                if(pkt_len&1){
-                    dbg_last_remain = ((uint8_t*)data_buf)[pkt_len+2];
-                }
-                dbg_pkt_count++;
-#endif
-                if(packet_handler){
-                    packet_handler(capture_context, pkt_tick, ((char*)data_buf)+2, pkt_len, pkt_status);
-                }
-                data_state = 1;
-            }
-            break;
-        case 4:
-            if(header == UPV_STOP_CMD){
-                ret = -1;
-                break;
-            }
-            break;
-        case 10:
-             pkt_len = header & 0xffff;
-             if((last_header & 0xf0) == 0x60 && pkt_len<=(1024+3)){
-                 data_buf[data_buf_idx++] = header;
-#ifdef UPV_PKT_DEBUG
-                 dbg_recover_count++;
-#endif
-                if(pkt_len <= 2){
-#ifdef UPV_PKT_DEBUG
-                    if(pkt_len&1){
-                        dbg_last_remain = ((uint8_t*)data_buf)[pkt_len+2];
-                    }
-                    dbg_pkt_count++;
-#endif
-                     if(packet_handler){
-                         packet_handler(capture_context, pkt_tick, ((char*)data_buf)+2, pkt_len, pkt_status);
-                     }
-                     data_state = 1;
-                 }else{
-                     data_state = 3;
-                 }
-                 break;
-             }
-            break;
-        default:
-            data_state = 1;
-            break;
-        }
-        last_header = header;
-        if(ret<0)break;
-    }
+    upv_s_callback cb = {this};
+    upv_s_emitter<upv_s_callback> emit = {this, &cb};
+    int ret = upv_parse_data(*this, data, len, emit);
     usbpv_record_data(data, len);
     return ret;
 }
 
+// stops within timeout plus the transfer cancel time, unless the packet handler blocks
 upv_s::upv_result upv_s::stop_capture(int timeout)
 {
     static uint32_t stop_cmd = UPV_STOP_CMD;
-    if(capture_finish){
+    if(!capture_running){
         return upv_s::R_Success;
     }
-    data_state = 4;
-    int r = upv_write_data(usb_dev, (uint8_t*)&stop_cmd, 4, NULL);
-    if (r < 0) { return upv_s::R_WriteConfig; }
-    int tmp;
-    int retry = 3;
-    bool de_q_res = false;
-    void* thread_res;
-    for(int i=0;i<retry;i++){
-        de_q_res = data_reader_q->de_q_timeout(tmp, timeout);
-        if(de_q_res){
-            break;
+    upv_s::upv_result res = upv_s::R_Success;
+    if(!capture_finish && !paused){
+        // the device puts the stop after its buffered data, the parser ends there
+        data_state = 4;
+        int tmp;
+        bool done = false;
+        int r = upv_write_data(usb_dev, (uint8_t*)&stop_cmd, 4, NULL);
+        if (r < 0) {
+            res = upv_s::R_WriteConfig;
+        }else if(inline_parse){
+            // parsed in the event thread, capture_finish is set at the stop
+            uint64_t end_ns = upv_now_ns() + timeout*1000000ull;
+            while(!capture_finish && upv_now_ns() < end_ns){
+                msleep(1);
+            }
+            done = capture_finish;
+        }else{
+            done = data_parser_q->de_q_timeout(tmp, timeout);
+        }
+        if (!done) {
+            DBG_PRINTF("stop not seen in %d ms, drop queued data\n", timeout);
+            capture_abort = 1;
         }
-        DBG_PRINTF("reader thread reamain %d\n", retry-i);
-        capture_finish = 1;
-        r = upv_write_data(usb_dev, (uint8_t*)&stop_cmd, 4, NULL);
-        if (r < 0) { return upv_s::R_WriteConfig; }
-    }
-    if(de_q_res){
-        pthread_join(reader_thread, &thread_res);
     }else{
-        DBG_PRINTF("reader thread will terminate\n");
-        pthread_kill(reader_thread, 0);
+        // data received before the analyzer was lost is still handled
+        capture_abort = !device_lost;
     }
+    capture_finish = 1;
+    end_reader();
+    if(!inline_parse){
+        pthread_join(parser_thread, NULL);
+        // buffers queued after the stop, then the one of the cancelled transfer
+        buf_data_t msg;
+        while(buf_data_q->de_q_timeout(msg, 0)){
+            if(msg.buffer){
+                mem_pool.put(msg.buffer);
+            }
+        }
+        if(held_buffer){
+            mem_pool.put(held_buffer);
+            held_buffer = NULL;
+        }
+    }
+    capture_running = 0;
+    capture_abort = 0;
+    paused = 0;
+    pause_on_stop.store(0);
+    return res;
+}
 
-    de_q_res = data_parser_q->de_q_timeout(tmp, timeout);
-    if(de_q_res){
-        pthread_join(parser_thread, &thread_res);
-    }else{
-        DBG_PRINTF("parser thread will terminate\n");
-        pthread_kill(parser_thread, 0);
+// the device stops sending, threads and transfers stay for resume_capture
+upv_s::upv_result upv_s::pause_capture(int timeout)
+{
+    static uint32_t stop_cmd = UPV_STOP_CMD;
+    if(!capture_running || capture_finish){
+        return upv_s::R_DeviceNotOpen;
     }
-#ifdef UPV_PKT_DEBUG
-    dbg_finish = 1;
-    pthread_join(dbg_thread, &thread_res);
-#endif
+    if(!paused){
+        pause_on_stop.store(1);
+        int r = upv_write_data(usb_dev, (uint8_t*)&stop_cmd, 4, NULL);
+        if (r < 0) {
+            pause_on_stop.store(0);
+            return upv_s::R_WriteConfig;
+        }
+        paused = 1;
+    }
+    // the parser clears the flag at the stop, data before it has been handled then
+    uint64_t end_ns = upv_now_ns() + timeout*1000000ull;
+    while(pause_on_stop.load() && upv_now_ns() < end_ns){
+        msleep(1);
+    }
+    // paused anyway, packets before the pause may still reach the handler
+    return pause_on_stop.load() ? upv_s::R_Timeout : upv_s::R_Success;
+}
+
+upv_s::upv_result upv_s::resume_capture()
+{
+    static uint32_t start_cmd = UPV_START_CMD;
+    if(!capture_running || capture_finish){
+        return upv_s::R_DeviceNotOpen;
+    }
+    if(!paused){
+        return upv_s::R_Success;
+    }
+    int r = upv_write_data(usb_dev, (uint8_t*)&start_cmd, 4, NULL);
+    if (r < 0) {
+        return upv_s::R_WriteConfig;
+    }
+    paused = 0;
     return upv_s::R_Success;
 }
 
+// the parser is not running, the marker goes through the packet hooks directly
+void upv_s::emit_gap()
+{
+    static const uint8_t none[4] = {0, 0, 0, 0};
+    pkt_tick = 0;
+    pkt_status = (UPV_CAPTURE_GAP<<4) | GetPacketSpeed(pkt_status);
+    emit_packet(none, 0);
+}
+
+upv_s::upv_result upv_s::reopen()
+{
+    // open replaces the option
+    string option = open_option;
+    if(option.empty()){
+        return upv_s::R_DeviceNotOpen;
+    }
+    upv_s::upv_result r = open(option.data(), (int)option.size());
+    if(r != upv_s::R_Success){
+        return r;
+    }
+    reconnects++;
+    emit_gap();
+    return start_capture(capture_context, packet_handler);
+}
+
 upv_s::upv_result upv_s::close()
 {
 
@@ -614,7 +1114,9 @@ upv_s::upv_result upv_s::close()
         usb_dev = NULL;
     }
     if(usb_ctx != NULL){
-        libusb_exit(usb_ctx);
+        if(usb_ctx != shared_ctx){
+            libusb_exit(usb_ctx);
+        }
         usb_ctx = NULL;
     }
     return r;
@@ -622,54 +1124,7 @@ upv_s::upv_result upv_s::close()
 
 list<string> upv_s::list_devices()
 {
-    list<string> res;
-
-
-    libusb_device** devs;
-    libusb_context* ctx;
-    int r;
-    ssize_t cnt;
-
-    libusb_device* dev;
-    int i = 0;
-    char tmpstr[256];
-
-    r = libusb_init(&ctx);
-    if (r < 0) {
-      return res;
-    }
-
-    cnt = libusb_get_device_list(ctx, &devs);
-    if (cnt < 0) {
-      libusb_exit(ctx);
-      return res;
-    }
-
-    while ((dev = devs[i++]) != NULL) {
-      struct libusb_device_descriptor desc;
-      int r = libusb_get_device_descriptor(dev, &desc);
-      if (r < 0) {
-        break;
-      }
-      if (desc.idVendor == UPV_VID && desc.idProduct == UPV_PID) {
-        libusb_device_handle* hdev;
-        if (libusb_open(dev, &hdev) >= 0) {
-          if (libusb_get_string_descriptor_ascii(hdev, desc.iManufacturer, (unsigned char*)tmpstr, sizeof(tmpstr)) >= 0) {
-            if (strncmp(tmpstr, UPV_MAN, sizeof(tmpstr)) == 0) {
-              if (libusb_get_string_descriptor_ascii(hdev, desc.iSerialNumber, (unsigned char*)tmpstr, sizeof(tmpstr)) >= 0) {
-                res.push_back(tmpstr);
-              }
-              else {
-                res.push_back("XXX");
-              }
-            }
-          }
-          libusb_close(hdev);
-        }
-      }
-    }
-
-    libusb_free_device_list(devs, 1);
-    libusb_exit(ctx);
-    return res;
+    // the first call scans, later ones copy the cache until a device comes or goes
+    static upv_enum_cache cache;
+    return cache.devices();
 }
@@ -2,11 +2,13 @@
 #define __USBPV_S_H__
 
 #include "libusb.h"
+#include "usbpv_parse.h"
 #include "semaphore.h"
 #include <list>
 #include <string>
 #include "string.h"
 #include <pthread.h>
+#include <atomic>
 
 #ifdef _WIN32
 #define UPV_CALL __cdecl
@@ -25,9 +27,18 @@
 #define UPV_API  __attribute__((visibility("default")))
 #endif
 
-#define UPV_PKT_DEBUG
 #define UPV_LOG  printf
 
+#define UPV_INLINE_TRANSFERS      4
+#define UPV_INLINE_TRANSFER_SIZE  (64*1024)
+#define UPV_MIN_TRANSFER_SIZE     (16*1024)
+#define UPV_CONFIG_REGS           10      // speed, flag and 8 filter bytes
+#define UPV_RECONFIG_TIMEOUT      1000    // ms to wait for the parser to reach the echoes
+
+
+#define UPV_VID 0x16C0
+#define UPV_PID 0x05DC
+#define UPV_MAN "tusb.org"
 
 #define UPV_OUT_REQ  (LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT)
 #define UPV_IN_REQ   (LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN)
@@ -54,6 +65,20 @@ enum CaptureSpeed {
 
 #define UPV_FLAG_ALL      (0xff)
 
+#define UPV_SPD_Unknown  0
+#define UPV_SPD_LOW      1
+#define UPV_SPD_FULL     2
+#define UPV_SPD_HIGH     3
+#define GetPacketSpeed(status)  ((status) & 0x03)
+
+#define UPV_DATA_PACKET     0
+#define UPV_RESET_BEGIN     1
+#define UPV_RESET_END       2
+#define UPV_SUSPEND_BEGIN   3
+#define UPV_SUSPEND_END     4
+#define UPV_CAPTURE_GAP     0xe
+#define UPV_OVERFLOW        0xf
+#define GetPacketType(status)   (((status)>>4) & 0x0f)
 
 
 template<int SIZE, int COUNT>
@@ -83,6 +108,7 @@ public:
         rd_idx = 0;
         wr_idx = 0;
         remain = COUNT;
+        min_remain = COUNT;
         return 0;
     }
     int deinit() {
@@ -97,12 +123,15 @@ public:
     uint8_t* get() {
         int result = sem_wait(&sem);
         if(result == 0){
-            lock();
-            uint8_t* res = mem[rd_idx];
-            rd_idx = (rd_idx + 1) % COUNT;
-            remain--;
-            unlock();
-            return res;
+            return take();
+        }
+        return NULL;
+    }
+    // NULL at once when no buffer is free
+    uint8_t* try_get() {
+        int result = sem_trywait(&sem);
+        if(result == 0){
+            return take();
         }
         return NULL;
     }
@@ -116,10 +145,36 @@ public:
         unlock();
         sem_post(&sem);
     }
+    int free_count(int* min_free) {
+        lock();
+        int r = remain;
+        if(min_free){
+            *min_free = min_remain;
+        }
+        unlock();
+        return r;
+    }
+    void reset_min() {
+        lock();
+        min_remain = remain;
+        unlock();
+    }
+    uint8_t* take() {
+        lock();
+        uint8_t* res = mem[rd_idx];
+        rd_idx = (rd_idx + 1) % COUNT;
+        remain--;
+        if(remain < min_remain){
+            min_remain = remain;
+        }
+        unlock();
+        return res;
+    }
     sem_t  sem;
     pthread_mutex_t mutex;
 
     int remain;
+    int min_remain;
     uint8_t* mem[COUNT];
     int rd_idx;
     int wr_idx;
@@ -132,6 +187,7 @@ public:
 struct buf_data_t{
     unsigned char* buffer;
     int len;
+    uint64_t rx_ns;     // completion time when latency is measured, else 0
 };
 template<typename T>
 struct upv_queue{
@@ -157,6 +213,12 @@ struct upv_queue{
         unlock();
         sem_post(&sem);
     }
+    int count(){
+        lock();
+        int r = (int)data.size();
+        unlock();
+        return r;
+    }
     bool de_q(T& v){
         int r = sem_wait(&sem);
         if(r == 0){
@@ -171,7 +233,7 @@ struct upv_queue{
     bool de_q_timeout(T& v, int ms){
         struct timespec ts;
         clock_gettime(CLOCK_REALTIME, &ts);
-        int ns = ts.tv_nsec + ms*1000000;
+        long long ns = ts.tv_nsec + (long long)ms*1000000;
         ts.tv_sec += ns/1000000000;
         ts.tv_nsec = ns%1000000000;
         do{
@@ -197,9 +259,64 @@ struct upv_queue{
     pthread_mutex_t mutex;
 };
 
+// capture counters, each has one writer thread and is read relaxed from any thread
+struct upv_s_stats{
+    std::atomic<uint64_t> rx_bytes;
+    std::atomic<uint64_t> parsed_bytes;
+    std::atomic<uint64_t> transfers;
+    std::atomic<uint64_t> packets[16];      // by GetPacketType
+    std::atomic<uint32_t> fifo_remain;      // device FIFO room of the last odd length packet
+    std::atomic<uint32_t> last_rx_len;
+    std::atomic<uint32_t> pool_stalls;      // transfers parked for want of a free buffer
+    struct timeval start_time;
+};
+
+// time spent in each step of upv_s::open, kept until the next open
+struct upv_open_times{
+    uint64_t init_ns;           // libusb_init, 0 with a manager context
+    uint64_t usb_open_ns;       // find and claim the USB device
+    uint64_t match_ns;          // part of usb_open_ns: device list and descriptor reads
+    uint64_t check_ns;          // serial, image hash and status before the load decision
+    uint64_t reset_ns;          // wait for the device to report idle
+    uint64_t load_ns;           // FPGA image upload
+    uint64_t start_ns;          // wait for loaded status and start
+    uint64_t config_ns;         // register writes and echo check
+    uint64_t drain_ns;          // part of config_ns: stale data read before writing one by one
+    uint64_t total_ns;
+    int config_writes;
+    int config_batched;         // 0 when the registers were written one by one
+    int load_skipped;           // device was still loaded with this image
+    int status_polls;           // status reads, 3 for a load without retries
+};
+
+inline uint64_t upv_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// single writer increment, no locked instruction
+template<typename T>
+inline void upv_stat_add(std::atomic<T>& c, T n)
+{
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+class upv_bw_stats;
+class upv_trigger;
+class upv_packet_ring;
+class upv_shm_writer;
+class upv_fanout;
+class upv_latency;
+class upv_health;
+struct upv_thread_param;
+
 typedef long(UPV_CB* pfnt_on_packet)(void* context, unsigned long tick_60MHz, const void* data, unsigned long len, long status);
+// replaces process_data in the parser thread, returns <0 to stop
+typedef int (*pfnt_process_data)(void* context, const uint8_t* data, int len);
 
-class upv_s
+class upv_s : public upv_parse_state
 {
 public:
 
@@ -212,6 +329,8 @@ public:
       R_WriteConfig = -5,
       R_EEInit = -6,
       R_Thread = -12,
+      R_Shm = -13,
+      R_Timeout = -14,
     };
 
     upv_s();
@@ -220,9 +339,31 @@ public:
     upv_result close();
     upv_result start_capture(void* context, pfnt_on_packet callback);
     upv_result stop_capture(int timeout);
+    // stop and restart the device stream, the capture threads keep running
+    upv_result pause_capture(int timeout);
+    upv_result resume_capture();
+    // config is the option bytes after the SN of open, works while capturing
+    upv_result reconfigure(const char* config, int len);
+    // open the analyzer of the last open again and restart the capture after a gap marker
+    upv_result reopen();
+    void emit_gap();
+    // times gets the batch result and drain time during open, NULL otherwise
+    upv_result write_config(const uint8_t* cfg_id, const uint8_t* cfg_val, int cfg_count, upv_open_times* times);
     static list<string> list_devices();
 
+    void reset_stats();
+    // print the counters to stdout every interval_ms, 0 stops printing
+    int set_stats_print(int interval_ms);
+
     int process_data(const uint8_t* data, int len);
+    inline void emit_packet(const void* data, int len);
+    int process_block(uint8_t* data, int len, uint64_t rx_ns);
+    void adapt_transfer(struct libusb_transfer* t, int capacity);
+    bool next_buffer(struct libusb_transfer* t);
+    void resume_transfer();
+    int submit_transfers();
+    void cancel_transfers();
+    void end_reader();
     void* reader_thread_func();
     void* parser_thread_func();
 
@@ -238,28 +379,44 @@ public:
     pthread_t parser_thread;
     void* capture_context;
     pfnt_on_packet packet_handler;
-    int capture_finish;
-    int data_state;
-    uint32_t last_header;
-    uint32_t data_buf[1024+16]; // USB max packet size <= 4096bytes
-    int32_t data_buf_idx;
-    int32_t pkt_len;
-    int32_t pkt_status;
-    int32_t pkt_tick;
+    std::atomic<upv_bw_stats*> bw_stats;      // optional bus time accounting, not owned
+    std::atomic<upv_trigger*> trigger;        // optional payload pattern trigger, not owned
+    std::atomic<upv_packet_ring*> ring;       // optional pull ring, not owned
+    std::atomic<upv_shm_writer*> shm;         // optional shared memory ring, not owned
+    std::atomic<upv_fanout*> fanout;          // optional subscribers, not owned
+    std::atomic<upv_packet_ring*> merge_ring; // optional time merge input, not owned
+    std::atomic<upv_latency*> latency;        // optional latency histograms, not owned
+    std::atomic<upv_health*> health;          // optional slow consumer warnings, not owned
+    pfnt_process_data data_processor;  // optional, set before start_capture
+    const upv_thread_param* thread_param;  // optional, UPV_THREAD_MAX entries, not owned
+    libusb_context* shared_ctx;         // event loop of a upv_manager, no reader thread, not owned
+    std::atomic<int> thread_tid[3];     // kernel id of reader, parser and stats thread
+    int inline_parse;                   // parse in the libusb event thread, set before start_capture
+    struct libusb_transfer* transfers[UPV_INLINE_TRANSFERS];
+    int transfer_count;
+    std::atomic<int> transfers_active;  // submitted and not completed, decremented in transfer callbacks
+    std::atomic<struct libusb_transfer*> parked_transfer;  // waits for a pool buffer, shared_ctx only
+    uint8_t* held_buffer;               // pool buffer of the last cancelled transfer
+    int latency_target_ms;              // size transfers to fill within this, 0 for full buffers
+    uint32_t rx_rate;                   // bytes per ms, event thread only
+    uint64_t rx_rate_ns;
+    void* processor_context;
+    volatile int capture_finish;
+    int capture_running;                // threads started and not joined
+    volatile int capture_abort;         // parser drops queued data
+    volatile int paused;
+    volatile int device_lost;           // transfers ended with a USB error, not by a stop
+    string open_option;                 // SN of the opened analyzer and the config bytes
+    int reconnects;                     // successful reopen calls
     uint16_t bcdUSB;
 
-#ifdef UPV_PKT_DEBUG
+    upv_s_stats stats;
+    upv_open_times open_times;
     pthread_t dbg_thread;
-    volatile int    dbg_finish;
-    struct timeval dbg_start_time;
-    uint64_t  dbg_recv_len;
-    uint64_t  dbg_process_len;
-    uint64_t  dbg_pkt_count;
-    uint64_t  dbg_recover_count;
-    uint32_t  dbg_last_remain;
-    uint32_t  dbg_last_rx_len;
+    int dbg_running;
+    volatile int dbg_finish;
+    volatile int dbg_interval_ms;
     void* dbg_thread_func();
-#endif
 };
 
 #endif
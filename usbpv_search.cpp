@@ -0,0 +1,291 @@
+#include "usbpv_search.h"
+#include "string.h"
+#include "stdio.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define UPV_SEARCH_FILE_BUF  (4*1024*1024)
+
+upv_matcher::upv_matcher()
+    :pattern_count(0)
+{
+}
+
+int upv_matcher::add(const uint8_t* bytes, const uint8_t* mask, int len)
+{
+    int n = pattern_count.load(std::memory_order_relaxed);
+    if(n >= UPV_SEARCH_MAX_PATTERNS || len < 1 || len > UPV_SEARCH_MAX_LEN || bytes == NULL){
+        return -1;
+    }
+    upv_pattern_t* p = &patterns[n];
+    p->len = len;
+    p->first = -1;
+    p->last = -1;
+    for(int i=0;i<len;i++){
+        p->mask[i] = mask ? mask[i] : 0xff;
+        p->bytes[i] = bytes[i] & p->mask[i];
+        if(p->mask[i] == 0xff){
+            if(p->first < 0){
+                p->first = i;
+            }
+            p->last = i;
+        }
+    }
+    // publish after the pattern is filled
+    pattern_count.store(n+1, std::memory_order_release);
+    return n;
+}
+
+void upv_matcher::clear()
+{
+    pattern_count.store(0, std::memory_order_release);
+}
+
+static inline int verify(const upv_pattern_t* p, const uint8_t* data)
+{
+    for(int k=0;k<p->len;k++){
+        if((data[k] & p->mask[k]) != p->bytes[k]){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int upv_matcher::scan(const upv_pattern_t* p, const uint8_t* data, int len, int pattern, pfnt_on_match cb, void* context) const
+{
+    int end = len - p->len + 1;    // candidate starts are [0, end)
+    int found = 0;
+    int i = 0;
+    if(end <= 0){
+        return 0;
+    }
+    if(p->first < 0){
+        // no fixed byte, check every position
+        for(;i<end;i++){
+            if(verify(p, data+i)){
+                found++;
+                if(cb == NULL || cb(context, pattern, i)){
+                    return found;
+                }
+            }
+        }
+        return found;
+    }
+    const uint8_t* f = data + p->first;
+    const uint8_t* l = data + p->last;
+#if defined(__SSE2__)
+    const __m128i vf = _mm_set1_epi8((char)p->bytes[p->first]);
+    const __m128i vl = _mm_set1_epi8((char)p->bytes[p->last]);
+    for(;i+16<=end;i+=16){
+        __m128i ef = _mm_cmpeq_epi8(vf, _mm_loadu_si128((const __m128i*)(f+i)));
+        __m128i el = _mm_cmpeq_epi8(vl, _mm_loadu_si128((const __m128i*)(l+i)));
+        unsigned bits = _mm_movemask_epi8(_mm_and_si128(ef, el));
+        while(bits){
+            int k = i + __builtin_ctz(bits);
+            bits &= bits - 1;
+            if(verify(p, data+k)){
+                found++;
+                if(cb == NULL || cb(context, pattern, k)){
+                    return found;
+                }
+            }
+        }
+    }
+#endif
+    uint8_t bf = p->bytes[p->first];
+    uint8_t bl = p->bytes[p->last];
+    for(;i<end;i++){
+        if(f[i] == bf && l[i] == bl && verify(p, data+i)){
+            found++;
+            if(cb == NULL || cb(context, pattern, i)){
+                return found;
+            }
+        }
+    }
+    return found;
+}
+
+int upv_matcher::match(const uint8_t* data, int len, pfnt_on_match cb, void* context) const
+{
+    int n = count();
+    int found = 0;
+    for(int i=0;i<n;i++){
+        found += scan(&patterns[i], data, len, i, cb, context);
+    }
+    return found;
+}
+
+static int on_first(void* context, int pattern, int offset)
+{
+    (void)pattern;
+    *(int*)context = offset;
+    return 1;
+}
+
+int upv_matcher::first_match(const uint8_t* data, int len, int* offset) const
+{
+    int n = count();
+    for(int i=0;i<n;i++){
+        if(scan(&patterns[i], data, len, i, on_first, offset)){
+            return i;
+        }
+    }
+    return -1;
+}
+
+struct search_job_t{
+    const upv_packet_store* store;
+    const upv_matcher* matcher;
+    uint64_t first;
+    uint64_t last;
+    uint64_t max_hits;
+    uint64_t found;
+    uint64_t position;           // packet being matched
+    uint64_t tick;
+    std::vector<upv_search_hit_t>* hits;
+    pthread_t thread;
+};
+
+static int on_hit(void* context, int pattern, int offset)
+{
+    search_job_t* job = (search_job_t*)context;
+    if(job->found < job->max_hits){
+        upv_search_hit_t hit;
+        hit.position = job->position;
+        hit.tick = job->tick;
+        hit.pattern = pattern;
+        hit.offset = offset;
+        job->hits->push_back(hit);
+    }
+    job->found++;
+    return 0;
+}
+
+static void* search_thread_func(void* arg)
+{
+    search_job_t* job = (search_job_t*)arg;
+    job->store->for_each(job->first, job->last, [job](uint64_t pos, const upv_stored_packet_t& p){
+        if(p.len > 0 && GetPacketType(p.status) == UPV_DATA_PACKET){
+            job->position = pos;
+            job->tick = p.tick;
+            job->matcher->match(p.data, p.len, on_hit, job);
+        }
+    });
+    return NULL;
+}
+
+uint64_t upv_search_store(const upv_packet_store* store, const upv_matcher& matcher,
+                          uint64_t first, uint64_t last, int threads,
+                          std::vector<upv_search_hit_t>* hits, uint64_t max_hits)
+{
+    search_job_t jobs[UPV_SEARCH_MAX_THREADS];
+    std::vector<upv_search_hit_t> local[UPV_SEARCH_MAX_THREADS];
+    uint64_t end = store->count();
+    if(last > end){
+        last = end;
+    }
+    if(first >= last || matcher.count() == 0){
+        return 0;
+    }
+    if(threads < 1){
+        threads = 1;
+    }
+    if(threads > UPV_SEARCH_MAX_THREADS){
+        threads = UPV_SEARCH_MAX_THREADS;
+    }
+    // split on chunk boundary, no thread gets less than one chunk
+    uint64_t step = (last - first + threads - 1) / threads;
+    step = (step + UPV_STORE_CHUNK_SIZE - 1) & ~(uint64_t)(UPV_STORE_CHUNK_SIZE - 1);
+    int n = 0;
+    for(uint64_t pos=first;pos<last;pos+=step,n++){
+        search_job_t* job = &jobs[n];
+        job->store = store;
+        job->matcher = &matcher;
+        job->first = pos;
+        job->last = pos + step < last ? pos + step : last;
+        job->max_hits = max_hits;
+        job->found = 0;
+        job->hits = &local[n];
+    }
+    int started[UPV_SEARCH_MAX_THREADS] = {0};
+    for(int i=1;i<n;i++){
+        started[i] = pthread_create(&jobs[i].thread, NULL, search_thread_func, &jobs[i]) == 0;
+    }
+    for(int i=0;i<n;i++){
+        if(!started[i]){
+            // run it here, also when the thread can't be created
+            search_thread_func(&jobs[i]);
+        }
+    }
+
+    uint64_t found = 0;
+    for(int i=0;i<n;i++){
+        if(started[i]){
+            pthread_join(jobs[i].thread, NULL);
+        }
+        for(size_t k=0;k<local[i].size() && found + k < max_hits;k++){
+            if(hits){
+                hits->push_back(local[i][k]);
+            }
+        }
+        found += jobs[i].found;
+    }
+    return found;
+}
+
+// packets of the file parser, matched in place
+struct file_search_t{
+    upv_parse_state state;
+    search_job_t job;
+    upv_tick_ext tick_ext;
+
+    inline void operator()(uint32_t tick_60MHz, const uint8_t* data, int len, int status){
+        uint64_t tick = tick_ext.extend(tick_60MHz);
+        if(len > 0 && GetPacketType(status) == UPV_DATA_PACKET){
+            job.tick = tick;
+            job.matcher->match(data, len, on_hit, &job);
+        }
+        job.position++;
+    }
+};
+
+int64_t upv_search_file(const char* path, const upv_matcher& matcher,
+                        std::vector<upv_search_hit_t>* hits, uint64_t max_hits)
+{
+    FILE* fp = fopen(path, "rb");
+    if(fp == NULL){
+        return -1;
+    }
+    std::vector<upv_search_hit_t> tmp;
+    // the raw stream can only be parsed in order, so the file is searched by one thread
+    file_search_t* fs = new file_search_t();
+    fs->job.matcher = &matcher;
+    fs->job.max_hits = max_hits;
+    fs->job.found = 0;
+    fs->job.position = 0;
+    fs->job.hits = hits ? hits : &tmp;
+
+    uint8_t* buf = new uint8_t[UPV_SEARCH_FILE_BUF];
+    size_t keep = 0;
+    while(true){
+        size_t r = fread(buf + keep, 1, UPV_SEARCH_FILE_BUF - keep, fp);
+        size_t len = keep + r;
+        size_t whole = len & ~(size_t)3;
+        if(whole == 0){
+            break;
+        }
+        if(upv_parse_data(fs->state, buf, (int)whole, *fs) < 0){
+            break;
+        }
+        // carry a split word to the next read
+        keep = len - whole;
+        memmove(buf, buf + whole, keep);
+    }
+    delete[] buf;
+    fclose(fp);
+    int64_t found = (int64_t)fs->job.found;
+    delete fs;
+    return found;
+}
@@ -0,0 +1,136 @@
+#ifndef __USBPV_SEARCH_H__
+#define __USBPV_SEARCH_H__
+
+#include "usbpv_store.h"
+#include "usbpv_lib.h"
+#include <list>
+
+#define UPV_SEARCH_MAX_LEN       64     // longest pattern
+#define UPV_SEARCH_MAX_PATTERNS  32
+#define UPV_SEARCH_MAX_THREADS   16
+
+// pattern byte k matches when (data[k] & mask[k]) == bytes[k]
+struct upv_pattern_t{
+    int len;
+    int first;               // first and last byte with full mask, -1 when none
+    int last;
+    uint8_t bytes[UPV_SEARCH_MAX_LEN];
+    uint8_t mask[UPV_SEARCH_MAX_LEN];
+};
+
+struct upv_search_hit_t{
+    uint64_t position;       // packet index in the store or in the file
+    uint64_t tick;           // 60MHz tick extended to 64 bit
+    int pattern;             // index of the pattern in the matcher
+    int offset;              // byte offset in the packet data, PID is offset 0
+};
+
+// returns nonzero to stop matching the packet
+typedef int (*pfnt_on_match)(void* context, int pattern, int offset);
+
+/**
+ * Multi pattern matcher over packet payloads
+ * Candidates are found by comparing the first and the last fully masked byte
+ * of a pattern at 16 positions at once (SSE2, scalar loop otherwise), then
+ * verified with the mask. Patterns can be added while another thread matches,
+ * clear() can not: the slots are refilled by the next add() while a match may
+ * still read them, so clear only when no thread matches.
+ */
+class upv_matcher
+{
+public:
+    upv_matcher();
+
+    // mask NULL for exact match, returns pattern index or -1
+    int add(const uint8_t* bytes, const uint8_t* mask, int len);
+    // not while another thread matches
+    void clear();
+    int count() const { return pattern_count.load(std::memory_order_acquire); }
+
+    // call cb for every match, pattern by pattern, returns number of matches
+    int match(const uint8_t* data, int len, pfnt_on_match cb, void* context) const;
+    // first pattern that matches anywhere, returns pattern index or -1
+    int first_match(const uint8_t* data, int len, int* offset) const;
+
+protected:
+    int scan(const upv_pattern_t* p, const uint8_t* data, int len, int pattern, pfnt_on_match cb, void* context) const;
+
+public:
+    std::atomic<int> pattern_count;
+    upv_pattern_t patterns[UPV_SEARCH_MAX_PATTERNS];
+};
+
+// handler and context of a trigger, never changed once published
+struct upv_trigger_sink_t{
+    pfn_trigger_handler handler;
+    void* context;
+};
+
+/**
+ * Live trigger in the parser thread
+ * The handler is called for data packets matching any pattern. A new handler
+ * is published with its context as one sink, the old sinks are kept until the
+ * trigger is deleted because the parser may still be calling them.
+ */
+class upv_trigger
+{
+public:
+    upv_trigger()
+        :sink(NULL)
+        ,fired(0)
+    {
+    }
+    ~upv_trigger()
+    {
+        for(std::list<upv_trigger_sink_t*>::iterator it = sinks.begin(); it != sinks.end(); ++it){
+            delete *it;
+        }
+    }
+
+    void set_handler(void* context, pfn_trigger_handler handler){
+        upv_trigger_sink_t* s = new upv_trigger_sink_t;
+        s->handler = handler;
+        s->context = context;
+        sinks.push_back(s);
+        sink.store(s, std::memory_order_release);
+    }
+
+    inline void on_packet(uint32_t tick, const uint8_t* data, int len, long status){
+        if(GetPacketType(status) != UPV_DATA_PACKET || len < 1 || matcher.count() == 0){
+            return;
+        }
+        int offset;
+        int pattern = matcher.first_match(data, len, &offset);
+        if(pattern >= 0){
+            fired++;
+            const upv_trigger_sink_t* s = sink.load(std::memory_order_acquire);
+            if(s && s->handler){
+                s->handler(s->context, tick, pattern, offset, data, len);
+            }
+        }
+    }
+
+public:
+    upv_matcher matcher;
+    std::atomic<const upv_trigger_sink_t*> sink;
+    std::list<upv_trigger_sink_t*> sinks;   // every sink set, owned
+    uint64_t fired;
+};
+
+/**
+ * Search data packets in [first, last) of a store with up to threads threads
+ * \returns number of hits, hits holds at most max_hits of them in packet order
+ */
+uint64_t upv_search_store(const upv_packet_store* store, const upv_matcher& matcher,
+                          uint64_t first, uint64_t last, int threads,
+                          std::vector<upv_search_hit_t>* hits, uint64_t max_hits = ~0ull);
+
+/**
+ * Search a raw capture recorded from the device stream (usbpv_record_data)
+ * The stream is parsed by upv_parse_data, position is the packet index.
+ * \returns number of hits, <0 when the file can't be read
+ */
+int64_t upv_search_file(const char* path, const upv_matcher& matcher,
+                        std::vector<upv_search_hit_t>* hits, uint64_t max_hits = ~0ull);
+
+#endif
@@ -0,0 +1,348 @@
+#include "usbpv_shm.h"
+#include "string.h"
+#include "errno.h"
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#endif
+
+upv_shm_writer::upv_shm_writer()
+    :shm_fd(-1)
+    ,hdr(NULL)
+    ,ring(NULL)
+    ,local_mem(NULL)
+    ,size(0)
+    ,mask(0)
+{
+}
+
+upv_shm_writer::~upv_shm_writer()
+{
+    close();
+}
+
+static uint32_t ring_size_pow2(uint32_t ring_size)
+{
+    uint32_t size = 1024*1024;
+    while(size < ring_size && size < 0x80000000u){
+        size <<= 1;
+    }
+    return size;
+}
+
+static void init_header(upv_shm_header_t* hdr, uint32_t size)
+{
+    hdr->version = UPV_SHM_VERSION;
+    hdr->size = size;
+    hdr->writer_pid = getpid();
+    hdr->closed.store(0);
+    hdr->waiters.store(0);
+    hdr->wake_seq.store(0);
+    hdr->reserve.store(0);
+    hdr->head.store(0);
+    hdr->packets = 0;
+    // readers check magic last
+    std::atomic_thread_fence(std::memory_order_release);
+    hdr->magic = UPV_SHM_MAGIC;
+}
+
+int upv_shm_writer::open_local(uint32_t ring_size)
+{
+    close();
+    size = ring_size_pow2(ring_size);
+    mask = size - 1;
+    local_mem = new uint8_t[UPV_SHM_HEADER_SIZE + (size_t)size];
+    hdr = (upv_shm_header_t*)local_mem;
+    ring = local_mem + UPV_SHM_HEADER_SIZE;
+    init_header(hdr, size);
+    return 0;
+}
+
+#ifndef _WIN32
+
+int upv_shm_writer::open(const char* shm_name, uint32_t ring_size)
+{
+    close();
+    size = ring_size_pow2(ring_size);
+    mask = size - 1;
+    // a stale ring of a crashed writer is replaced, readers still on it keep their mapping
+    shm_unlink(shm_name);
+    shm_fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(shm_fd < 0){
+        return -1;
+    }
+    if(ftruncate(shm_fd, UPV_SHM_HEADER_SIZE + (off_t)size) < 0){
+        goto error;
+    }
+    hdr = (upv_shm_header_t*)mmap(NULL, UPV_SHM_HEADER_SIZE + (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if(hdr == MAP_FAILED){
+        hdr = NULL;
+        goto error;
+    }
+    ring = (uint8_t*)hdr + UPV_SHM_HEADER_SIZE;
+    name = shm_name;
+    init_header(hdr, size);
+    return 0;
+error:
+    ::close(shm_fd);
+    shm_fd = -1;
+    shm_unlink(shm_name);
+    return -1;
+}
+
+void upv_shm_writer::close()
+{
+    if(hdr){
+        hdr->closed.store(1);
+        wake();
+        if(local_mem){
+            delete[] local_mem;
+            local_mem = NULL;
+        }else{
+            munmap(hdr, UPV_SHM_HEADER_SIZE + (size_t)size);
+        }
+        hdr = NULL;
+        ring = NULL;
+    }
+    if(shm_fd >= 0){
+        ::close(shm_fd);
+        shm_fd = -1;
+        shm_unlink(name.c_str());
+    }
+}
+
+void upv_shm_writer::wake()
+{
+    hdr->wake_seq.fetch_add(1);
+#ifdef __linux__
+    syscall(SYS_futex, &hdr->wake_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+#else
+
+int upv_shm_writer::open(const char* shm_name, uint32_t ring_size)
+{
+    (void)shm_name;
+    (void)ring_size;
+    return -1;
+}
+
+void upv_shm_writer::close()
+{
+    if(hdr){
+        hdr->closed.store(1);
+        delete[] local_mem;
+        local_mem = NULL;
+        hdr = NULL;
+        ring = NULL;
+    }
+}
+
+void upv_shm_writer::wake()
+{
+}
+
+#endif
+
+upv_shm_reader::upv_shm_reader()
+    :shm_fd(-1)
+    ,hdr(NULL)
+    ,ring(NULL)
+    ,map_size(0)
+    ,size(0)
+    ,mask(0)
+    ,pos(0)
+    ,overruns(0)
+    ,lost_bytes(0)
+{
+}
+
+upv_shm_reader::~upv_shm_reader()
+{
+    close();
+}
+
+#ifndef _WIN32
+
+int upv_shm_reader::open(const char* shm_name)
+{
+    close();
+    struct stat st;
+    shm_fd = shm_open(shm_name, O_RDWR, 0);
+    if(shm_fd < 0){
+        return -1;
+    }
+    if(fstat(shm_fd, &st) < 0 || st.st_size <= UPV_SHM_HEADER_SIZE){
+        goto error;
+    }
+    map_size = st.st_size;
+    hdr = (upv_shm_header_t*)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if(hdr == MAP_FAILED){
+        hdr = NULL;
+        goto error;
+    }
+    if(hdr->magic != UPV_SHM_MAGIC || hdr->version != UPV_SHM_VERSION
+            || UPV_SHM_HEADER_SIZE + (size_t)hdr->size != map_size){
+        goto error;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    size = hdr->size;
+    mask = size - 1;
+    ring = (const uint8_t*)hdr + UPV_SHM_HEADER_SIZE;
+    pos = hdr->head.load(std::memory_order_acquire);
+    overruns = 0;
+    lost_bytes = 0;
+    return 0;
+error:
+    close();
+    return -1;
+}
+
+void upv_shm_reader::close()
+{
+    if(hdr && map_size){
+        munmap(hdr, map_size);
+    }
+    hdr = NULL;
+    ring = NULL;
+    map_size = 0;
+    if(shm_fd >= 0){
+        ::close(shm_fd);
+        shm_fd = -1;
+    }
+}
+
+#else
+
+int upv_shm_reader::open(const char* shm_name)
+{
+    (void)shm_name;
+    return -1;
+}
+
+void upv_shm_reader::close()
+{
+    hdr = NULL;
+    ring = NULL;
+}
+
+#endif
+
+int upv_shm_reader::wait(int timeout_ms)
+{
+#ifdef __linux__
+    uint32_t seq = hdr->wake_seq.load(std::memory_order_acquire);
+    hdr->waiters.fetch_add(1);
+    // pairs with the fence in push()
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(hdr->head.load(std::memory_order_acquire) == pos && !hdr->closed.load()){
+        struct timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        syscall(SYS_futex, &hdr->wake_seq, FUTEX_WAIT, seq, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+    }
+    hdr->waiters.fetch_sub(1);
+#else
+    // no cross process wake up, poll the head
+    for(int i=0;(timeout_ms < 0 || i < timeout_ms) && hdr->head.load() == pos && !hdr->closed.load();i++){
+        usleep(1000);
+    }
+#endif
+    return hdr->head.load(std::memory_order_acquire) != pos;
+}
+
+int upv_shm_reader::attach(const upv_shm_writer* writer)
+{
+    close();
+    if(writer->hdr == NULL){
+        return -1;
+    }
+    hdr = writer->hdr;
+    size = hdr->size;
+    mask = size - 1;
+    ring = (const uint8_t*)hdr + UPV_SHM_HEADER_SIZE;
+    pos = hdr->head.load(std::memory_order_acquire);
+    overruns = 0;
+    lost_bytes = 0;
+    return 0;
+}
+
+int upv_shm_reader::read(void* buf, int buf_size, int max_packets, int timeout_ms, int* used)
+{
+    uint8_t* dst = (uint8_t*)buf;
+    int n = 0;
+    int out = 0;
+    int waited = 0;
+    if(hdr == NULL){
+        return -1;
+    }
+    while(true){
+        uint64_t h = hdr->head.load(std::memory_order_acquire);
+        if(h - pos > size){
+            // lapped before reading anything
+            overruns++;
+            lost_bytes += h - pos;
+            pos = h;
+        }
+        while(pos < h && n < max_packets){
+            const upv_packet_t* p = (const upv_packet_t*)(ring + (pos & mask));
+            upv_packet_t ph = *p;
+            uint32_t sz;
+            int torn = 0;
+            if(ph.status == UPV_RING_PAD){
+                sz = size - (pos & mask);
+            }else if(ph.len > 1027){
+                torn = 1;
+                sz = 0;
+            }else{
+                sz = UPV_PACKET_SIZE(ph.len);
+                if(out + (int)sz > buf_size){
+                    break;
+                }
+                memcpy(dst + out, p, sz);
+            }
+            // the copy is good when the writer did not start to overwrite it
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t r = hdr->reserve.load(std::memory_order_relaxed);
+            if(torn || (r > size && pos < r - size)){
+                uint64_t newest = hdr->head.load(std::memory_order_acquire);
+                overruns++;
+                lost_bytes += newest - pos;
+                pos = newest;
+                h = newest;
+                continue;
+            }
+            if(ph.status != UPV_RING_PAD){
+                out += sz;
+                n++;
+            }
+            pos += sz;
+        }
+        if(n > 0 || waited){
+            break;
+        }
+        if(hdr->closed.load() && pos == hdr->head.load(std::memory_order_acquire)){
+            n = -1;
+            break;
+        }
+        if(timeout_ms == 0){
+            break;
+        }
+        waited = 1;
+        if(!wait(timeout_ms)){
+            break;
+        }
+    }
+    if(used){
+        *used = out;
+    }
+    return n;
+}
@@ -0,0 +1,130 @@
+#ifndef __USBPV_SHM_H__
+#define __USBPV_SHM_H__
+
+#include "usbpv_ring.h"
+
+#define UPV_SHM_MAGIC         0x52565055     // "UPVR"
+#define UPV_SHM_VERSION       1
+#define UPV_SHM_HEADER_SIZE   4096
+#define UPV_SHM_DEFAULT_SIZE  (64*1024*1024)
+
+// first page of the shared memory, upv_packet_t records follow it
+struct upv_shm_header_t{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                      // ring bytes, power of 2
+    uint32_t writer_pid;
+    std::atomic<uint32_t> closed;       // writer has stopped
+    std::atomic<uint32_t> waiters;      // readers sleeping on wake_seq
+    std::atomic<uint32_t> wake_seq;     // futex word
+    uint32_t reserved;
+    char pad0[64];
+    std::atomic<uint64_t> reserve;      // end of the record being written
+    std::atomic<uint64_t> head;         // end of the last complete record
+    uint64_t packets;
+};
+
+/**
+ * Writer of a named shared memory ring (/dev/shm)
+ * One writer, any number of readers in other processes. The writer never
+ * waits for readers, a reader that falls more than the ring size behind
+ * detects the overrun and skips to the newest packet. open_local() puts the
+ * same ring in process memory for readers in this process.
+ */
+class upv_shm_writer
+{
+public:
+    upv_shm_writer();
+    ~upv_shm_writer();
+
+    // name like "/usbpv0", returns 0 for success
+    int open(const char* name, uint32_t ring_size = UPV_SHM_DEFAULT_SIZE);
+    int open_local(uint32_t ring_size);
+    void close();
+
+    // head after a record of len bytes is pushed
+    inline uint64_t head_after(int len) const {
+        uint64_t h = hdr->head.load(std::memory_order_relaxed);
+        uint32_t need = UPV_PACKET_SIZE(len);
+        uint32_t off = h & mask;
+        return h + need + (off + need > size ? size - off : 0);
+    }
+
+    inline void push(uint32_t tick, const void* data, int len, long status){
+        uint64_t h = hdr->head.load(std::memory_order_relaxed);
+        uint32_t need = UPV_PACKET_SIZE(len);
+        uint32_t off = h & mask;
+        uint32_t pad = off + need > size ? size - off : 0;
+        // readers of anything before reserve - size know it is gone
+        hdr->reserve.store(h + pad + need, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        if(pad){
+            ((upv_packet_t*)(ring + off))->status = UPV_RING_PAD;
+            off = 0;
+        }
+        upv_packet_t* p = (upv_packet_t*)(ring + off);
+        p->tick_60MHz = tick;
+        p->len = len;
+        p->status = (uint16_t)status;
+        if(len > 0){
+            memcpy(p + 1, data, len);
+        }
+        hdr->packets++;
+        hdr->head.store(h + pad + need, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(hdr->waiters.load(std::memory_order_relaxed)){
+            wake();
+        }
+    }
+
+protected:
+    void wake();
+
+public:
+    string name;
+    int shm_fd;
+    upv_shm_header_t* hdr;
+    uint8_t* ring;
+    uint8_t* local_mem;          // open_local() memory
+    uint32_t size;
+    uint32_t mask;
+};
+
+/**
+ * Reader of a shared memory ring, keeps its own position
+ */
+class upv_shm_reader
+{
+public:
+    upv_shm_reader();
+    ~upv_shm_reader();
+
+    // attach at the newest packet, returns 0 for success
+    int open(const char* name);
+    // attach to a ring of this process
+    int attach(const upv_shm_writer* writer);
+    void close();
+
+    /**
+     * copy packets into buf as upv_packet_t records
+     * \param timeout_ms wait time when no packet is available, <0 wait forever
+     * \returns number of packets, -1 when the writer has closed and all packets are read
+     */
+    int read(void* buf, int buf_size, int max_packets, int timeout_ms, int* used);
+
+protected:
+    int wait(int timeout_ms);
+
+public:
+    int shm_fd;
+    upv_shm_header_t* hdr;
+    const uint8_t* ring;
+    size_t map_size;
+    uint32_t size;
+    uint32_t mask;
+    uint64_t pos;
+    uint64_t overruns;
+    uint64_t lost_bytes;
+};
+
+#endif
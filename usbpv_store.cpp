@@ -0,0 +1,198 @@
+#include "usbpv_store.h"
+#include "string.h"
+
+upv_packet_store::upv_packet_store()
+    :packet_count(0)
+    ,chunk_count(0)
+    ,cur_chunk(NULL)
+    ,arena_pos(0)
+    ,payload_used(0)
+    ,block_count(0)
+{
+    memset(dir, 0, sizeof(dir));
+    memset(blocks, 0, sizeof(blocks));
+    clear();
+}
+
+upv_packet_store::~upv_packet_store()
+{
+    clear();
+}
+
+void upv_packet_store::clear()
+{
+    for(int p=0;p<UPV_STORE_DIR_PAGES;p++){
+        if(dir[p]){
+            for(int i=0;i<UPV_STORE_DIR_SIZE;i++){
+                delete dir[p][i];
+            }
+            delete[] dir[p];
+            dir[p] = NULL;
+        }
+    }
+    for(uint32_t b=0;b<block_count;b++){
+        delete[] blocks[b];
+        blocks[b] = NULL;
+    }
+    tick_ext.reset();
+    cur_addr_ep = UPV_STORE_NO_ADDR_EP;
+    packet_count.store(0, std::memory_order_release);
+    chunk_count.store(0, std::memory_order_release);
+    cur_chunk = NULL;
+    arena_pos = 0;
+    payload_used = 0;
+    block_count = 0;
+}
+
+uint64_t upv_packet_store::alloc_payload(int len)
+{
+    uint64_t b = arena_pos / UPV_STORE_BLOCK_SIZE;
+    if(arena_pos % UPV_STORE_BLOCK_SIZE + len > UPV_STORE_BLOCK_SIZE){
+        // payload never crosses a block
+        b++;
+        arena_pos = b * UPV_STORE_BLOCK_SIZE;
+    }
+    if(b >= block_count){
+        if(b >= UPV_STORE_MAX_BLOCKS){
+            return ~0ull;
+        }
+        blocks[b] = new uint8_t[UPV_STORE_BLOCK_SIZE];
+        block_count = b + 1;
+    }
+    uint64_t off = arena_pos;
+    arena_pos += len;
+    payload_used += len;
+    return off;
+}
+
+upv_store_chunk_t* upv_packet_store::new_chunk(uint64_t first, uint64_t tick)
+{
+    uint64_t ci = chunk_count.load(std::memory_order_relaxed);
+    if(ci >= (uint64_t)UPV_STORE_DIR_PAGES*UPV_STORE_DIR_SIZE){
+        return NULL;
+    }
+    upv_store_chunk_t**& page = dir[ci >> UPV_STORE_DIR_SHIFT];
+    if(page == NULL){
+        page = new upv_store_chunk_t*[UPV_STORE_DIR_SIZE];
+        memset(page, 0, sizeof(upv_store_chunk_t*)*UPV_STORE_DIR_SIZE);
+    }
+    upv_store_chunk_t* c = new upv_store_chunk_t;
+    c->first = first;
+    c->base_tick = tick;
+    c->payload_base = arena_pos;
+    page[ci & (UPV_STORE_DIR_SIZE-1)] = c;
+    chunk_count.store(ci+1, std::memory_order_release);
+    return c;
+}
+
+void upv_packet_store::append(uint32_t tick_60MHz, const uint8_t* data, int len, long status)
+{
+    uint64_t tick = tick_ext.extend(tick_60MHz);
+    uint64_t n = packet_count.load(std::memory_order_relaxed);
+    upv_store_chunk_t* c = cur_chunk;
+    if(c == NULL || n - c->first >= UPV_STORE_CHUNK_SIZE || tick - c->base_tick > 0xffffffffull){
+        // full, or the tick does not fit in tick_delta after a long idle bus
+        c = new_chunk(n, tick);
+        if(c == NULL){
+            return;
+        }
+        cur_chunk = c;
+    }
+    int i = (int)(n - c->first);
+
+    uint16_t addr_ep = UPV_STORE_NO_ADDR_EP;
+    if(GetPacketType(status) == UPV_DATA_PACKET && len > 0){
+        uint8_t pid = data[0];
+        if(pid == UPV_PID_IN || pid == UPV_PID_OUT || pid == UPV_PID_SETUP || pid == UPV_PID_PING){
+            if(len >= 3){
+                cur_addr_ep = UPV_STORE_ADDR_EP(UPV_TOKEN_ADDR(data), UPV_TOKEN_EP(data), pid == UPV_PID_IN);
+            }
+        }else if(pid == UPV_PID_SOF){
+            cur_addr_ep = UPV_STORE_NO_ADDR_EP;
+        }
+        addr_ep = cur_addr_ep;
+    }
+
+    uint32_t payload_off = 0;
+    if(len > UPV_STORE_INLINE_LEN){
+        uint64_t off = alloc_payload(len);
+        if(off == ~0ull){
+            // arena full, keep the packet header only
+            len = 0;
+        }else{
+            memcpy(blocks[off / UPV_STORE_BLOCK_SIZE] + (off % UPV_STORE_BLOCK_SIZE), data, len);
+            payload_off = (uint32_t)(off - c->payload_base);
+        }
+    }else if(len > 0){
+        memcpy(&payload_off, data, len);
+    }
+    c->tick_delta[i] = (uint32_t)(tick - c->base_tick);
+    c->payload_off[i] = payload_off;
+    c->len[i] = len;
+    c->addr_ep[i] = addr_ep;
+    c->status[i] = (uint8_t)status;
+    packet_count.store(n+1, std::memory_order_release);
+}
+
+long UPV_CB upv_packet_store::on_packet(void* store, unsigned long tick_60MHz, const void* data, unsigned long len, long status)
+{
+    ((upv_packet_store*)store)->append(tick_60MHz, (const uint8_t*)data, len, status);
+    return 0;
+}
+
+uint64_t upv_packet_store::lower_bound(uint64_t tick) const
+{
+    uint64_t lo = 0;
+    uint64_t hi = count();
+    while(lo < hi){
+        uint64_t mid = lo + (hi - lo)/2;
+        if(tick_at(mid) < tick){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// last chunk in [lo, hi) starting at or before index
+uint64_t upv_packet_store::chunk_of_split(uint64_t index, uint64_t lo, uint64_t hi) const
+{
+    hi--;
+    while(lo < hi){
+        uint64_t mid = lo + (hi - lo + 1)/2;
+        if(chunk(mid)->first <= index){
+            lo = mid;
+        }else{
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+void upv_packet_store::slice(uint64_t tick_begin, uint64_t tick_end, uint64_t* first, uint64_t* last) const
+{
+    *first = lower_bound(tick_begin);
+    *last = lower_bound(tick_end);
+    if(*last < *first){
+        *last = *first;
+    }
+}
+
+uint64_t upv_packet_store::memory_bytes() const
+{
+    uint64_t chunks = chunk_count.load(std::memory_order_relaxed);
+    uint64_t pages = (chunks + UPV_STORE_DIR_SIZE - 1) / UPV_STORE_DIR_SIZE;
+    return chunks * sizeof(upv_store_chunk_t)
+         + pages * UPV_STORE_DIR_SIZE * sizeof(upv_store_chunk_t*)
+         + (uint64_t)block_count * UPV_STORE_BLOCK_SIZE;
+}
+
+double upv_packet_store::bytes_per_packet() const
+{
+    uint64_t n = count();
+    if(n == 0){
+        return 0;
+    }
+    return (double)(n * (sizeof(upv_store_chunk_t) - 24) / UPV_STORE_CHUNK_SIZE + payload_used) / n;
+}
@@ -0,0 +1,155 @@
+#ifndef __USBPV_STORE_H__
+#define __USBPV_STORE_H__
+
+#include "usbpv_decode.h"
+#include <atomic>
+
+#define UPV_STORE_CHUNK_SHIFT  12
+#define UPV_STORE_CHUNK_SIZE   (1<<UPV_STORE_CHUNK_SHIFT)      // packets per chunk
+#define UPV_STORE_DIR_SHIFT    12
+#define UPV_STORE_DIR_SIZE     (1<<UPV_STORE_DIR_SHIFT)        // chunks per directory page
+#define UPV_STORE_DIR_PAGES    4096
+#define UPV_STORE_BLOCK_SIZE   (16*1024*1024)                  // payload arena block
+#define UPV_STORE_MAX_BLOCKS   65536
+
+#define UPV_STORE_INLINE_LEN   4                               // tokens and handshakes live in payload_off
+
+#define UPV_STORE_NO_ADDR_EP   0xffff
+#define UPV_STORE_ADDR_EP(addr, ep, dir_in)  (((addr)<<5) | ((dir_in)<<4) | (ep))
+
+// one packet read back from the store
+struct upv_stored_packet_t{
+    uint64_t tick;           // 60MHz tick extended to 64 bit
+    const uint8_t* data;     // same bytes the packet handler got, NULL when len is 0
+    uint16_t len;
+    uint16_t addr_ep;        // UPV_STORE_ADDR_EP of the current token, UPV_STORE_NO_ADDR_EP for SOF and bus events
+    long     status;
+};
+
+// columns of up to UPV_STORE_CHUNK_SIZE packets, 13 bytes per packet
+// a chunk is closed early when a tick is more than 32 bit past base_tick
+struct upv_store_chunk_t{
+    uint64_t first;          // position of the first packet
+    uint64_t base_tick;
+    uint64_t payload_base;   // arena offset, payload_off is relative to it
+    uint32_t tick_delta[UPV_STORE_CHUNK_SIZE];
+    uint32_t payload_off[UPV_STORE_CHUNK_SIZE];   // short packets keep their bytes here
+    uint16_t len[UPV_STORE_CHUNK_SIZE];
+    uint16_t addr_ep[UPV_STORE_CHUNK_SIZE];
+    uint8_t  status[UPV_STORE_CHUNK_SIZE];
+};
+
+/**
+ * In memory packet store in struct of arrays layout
+ * Packets are appended by one thread (usually the parser thread) and may be
+ * read by other threads at the same time, a reader sees the packets before
+ * count(). Chunks and payload blocks are never moved once allocated.
+ */
+class upv_packet_store
+{
+public:
+    upv_packet_store();
+    ~upv_packet_store();
+    void clear();
+
+    void append(uint32_t tick_60MHz, const uint8_t* data, int len, long status);
+    static long UPV_CB on_packet(void* store, unsigned long tick_60MHz, const void* data, unsigned long len, long status);
+
+    inline uint64_t count() const {
+        return packet_count.load(std::memory_order_acquire);
+    }
+    inline const upv_store_chunk_t* chunk(uint64_t chunk_idx) const {
+        return dir[chunk_idx >> UPV_STORE_DIR_SHIFT][chunk_idx & (UPV_STORE_DIR_SIZE-1)];
+    }
+    // index of the chunk holding the packet at index
+    inline uint64_t chunk_of(uint64_t index) const {
+        // chunks are full unless one before was closed early
+        uint64_t ci = index >> UPV_STORE_CHUNK_SHIFT;
+        uint64_t n = chunk_count.load(std::memory_order_acquire);
+        if(ci + 1 < n && chunk(ci + 1)->first <= index){
+            ci = chunk_of_split(index, ci + 1, n);
+        }
+        return ci;
+    }
+    inline const uint8_t* payload(uint64_t offset) const {
+        return blocks[offset / UPV_STORE_BLOCK_SIZE] + (offset % UPV_STORE_BLOCK_SIZE);
+    }
+    inline const uint8_t* packet_data(const upv_store_chunk_t* c, int i) const {
+        if(c->len[i] <= UPV_STORE_INLINE_LEN){
+            return c->len[i] ? (const uint8_t*)&c->payload_off[i] : NULL;
+        }
+        return payload(c->payload_base + c->payload_off[i]);
+    }
+    inline void get(uint64_t index, upv_stored_packet_t* pkt) const {
+        const upv_store_chunk_t* c = chunk(chunk_of(index));
+        int i = (int)(index - c->first);
+        pkt->tick = c->base_tick + c->tick_delta[i];
+        pkt->len = c->len[i];
+        pkt->data = packet_data(c, i);
+        pkt->addr_ep = c->addr_ep[i];
+        pkt->status = c->status[i];
+    }
+    inline uint64_t tick_at(uint64_t index) const {
+        const upv_store_chunk_t* c = chunk(chunk_of(index));
+        return c->base_tick + c->tick_delta[index - c->first];
+    }
+
+    // first packet with tick >= tick
+    uint64_t lower_bound(uint64_t tick) const;
+    // packets in [tick_begin, tick_end) are [*first, *last)
+    void slice(uint64_t tick_begin, uint64_t tick_end, uint64_t* first, uint64_t* last) const;
+
+    // call f(index, packet) for packets in [first, last), walking chunk by chunk
+    template<typename F>
+    void for_each(uint64_t first, uint64_t last, F f) const {
+        upv_stored_packet_t pkt;
+        uint64_t end = count();
+        if(last > end){
+            last = end;
+        }
+        uint64_t chunks = chunk_count.load(std::memory_order_acquire);
+        uint64_t ci = first < last ? chunk_of(first) : 0;
+        while(first < last){
+            const upv_store_chunk_t* c = chunk(ci);
+            int i = (int)(first - c->first);
+            uint64_t n = (ci + 1 < chunks ? chunk(ci + 1)->first : end) - first;
+            if(n > last - first){
+                n = last - first;
+            }
+            for(int k=i;k<i+(int)n;k++,first++){
+                pkt.tick = c->base_tick + c->tick_delta[k];
+                pkt.len = c->len[k];
+                pkt.data = packet_data(c, k);
+                pkt.addr_ep = c->addr_ep[k];
+                pkt.status = c->status[k];
+                f(first, pkt);
+            }
+            ci++;
+        }
+    }
+
+    uint64_t payload_bytes() const { return payload_used; }
+    // allocated memory, include the unused tail of the last chunk and block
+    uint64_t memory_bytes() const;
+    // packed cost of the stored packets, columns plus payload
+    double bytes_per_packet() const;
+
+protected:
+    uint64_t alloc_payload(int len);
+    uint64_t chunk_of_split(uint64_t index, uint64_t lo, uint64_t hi) const;
+    upv_store_chunk_t* new_chunk(uint64_t first, uint64_t tick);
+
+public:
+    upv_tick_ext tick_ext;
+    uint16_t cur_addr_ep;
+    std::atomic<uint64_t> packet_count;
+    std::atomic<uint64_t> chunk_count;
+    upv_store_chunk_t* cur_chunk;     // appended to, NULL when full
+    uint64_t arena_pos;          // next free arena offset
+    uint64_t payload_used;
+    uint32_t block_count;
+    upv_store_chunk_t** dir[UPV_STORE_DIR_PAGES];
+    uint8_t* blocks[UPV_STORE_MAX_BLOCKS];
+};
+
+#endif
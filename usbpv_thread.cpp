@@ -0,0 +1,91 @@
+#include "usbpv_thread.h"
+#include "stdio.h"
+#include "string.h"
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#endif
+
+int upv_thread_create(pthread_t* thread, const upv_thread_param_t* param, void* (*func)(void*), void* arg)
+{
+    if(param == NULL){
+        return pthread_create(thread, NULL, func, arg);
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+#ifdef __linux__
+    if(param->cpu_mask){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(int i=0;i<64;i++){
+            if(param->cpu_mask & ((uint64_t)1<<i)){
+                CPU_SET(i, &set);
+            }
+        }
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+#endif
+    if(param->policy == UPV_SCHED_FIFO || param->policy == UPV_SCHED_RR){
+        // fails with EPERM without CAP_SYS_NICE, the caller gets the error
+        struct sched_param sp;
+        memset(&sp, 0, sizeof(sp));
+        sp.sched_priority = param->priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, param->policy == UPV_SCHED_FIFO ? SCHED_FIFO : SCHED_RR);
+        pthread_attr_setschedparam(&attr, &sp);
+    }
+    int r = pthread_create(thread, &attr, func, arg);
+    pthread_attr_destroy(&attr);
+#ifdef __linux__
+    if(r == 0 && param->name[0]){
+        char name[16];
+        strncpy(name, param->name, sizeof(name) - 1);
+        name[sizeof(name) - 1] = 0;
+        pthread_setname_np(*thread, name);
+    }
+#endif
+    return r;
+}
+
+int upv_thread_enter(const upv_thread_param_t* param)
+{
+#ifdef __linux__
+    int tid = (int)syscall(SYS_gettid);
+    if(param && param->policy == UPV_SCHED_OTHER && param->nice){
+        setpriority(PRIO_PROCESS, tid, param->nice);
+    }
+    return tid;
+#else
+    (void)param;
+    return 0;
+#endif
+}
+
+uint64_t upv_thread_ctx_switches(int tid)
+{
+#ifdef __linux__
+    char path[64];
+    char line[128];
+    unsigned long long n = 0;
+    if(tid <= 0){
+        return 0;
+    }
+    snprintf(path, sizeof(path), "/proc/self/task/%d/status", tid);
+    FILE* fp = fopen(path, "r");
+    if(fp == NULL){
+        return 0;
+    }
+    while(fgets(line, sizeof(line), fp)){
+        if(sscanf(line, "nonvoluntary_ctxt_switches: %llu", &n) == 1){
+            break;
+        }
+    }
+    fclose(fp);
+    return n;
+#else
+    (void)tid;
+    return 0;
+#endif
+}
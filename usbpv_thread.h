@@ -0,0 +1,23 @@
+#ifndef __USBPV_THREAD_H__
+#define __USBPV_THREAD_H__
+
+#include "usbpv_lib.h"
+#include <pthread.h>
+
+/**
+ * Create a thread with CPU affinity and scheduling of param
+ * param may be NULL for default attributes.
+ * \returns 0 or the pthread error code
+ */
+int upv_thread_create(pthread_t* thread, const upv_thread_param_t* param, void* (*func)(void*), void* arg);
+
+/**
+ * Called first in the new thread, applies the nice level and returns the
+ * kernel thread id, 0 where there is none
+ */
+int upv_thread_enter(const upv_thread_param_t* param);
+
+// involuntary context switches of a thread of this process, 0 when unknown
+uint64_t upv_thread_ctx_switches(int tid);
+
+#endif
@@ -1,7 +1,14 @@
 #include "usbpv_s.h"
 #include "string.h"
+#include "stdio.h"
+#include "stdlib.h"
 #include "pthread.h"
 #include "signal.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
 
 #define UPV_RESET  0x73
 #define UPV_START  0x74
@@ -22,12 +29,14 @@
    } while(0);
 
 int upv_usb_open_serial(libusb_context *usb_ctx, libusb_device_handle **usb_dev, int vendor, int product,
-                             const char* description, const char* serial, uint16_t* bcdUSB, const char** error_string)
+                             const char* description, const char* serial, uint16_t* bcdUSB, const char** error_string,
+                             uint64_t* match_ns)
 {
     libusb_device *dev;
     libusb_device **devs;
     char string[256];
     int i = 0;
+    uint64_t t0 = upv_now_ns();
 
     if (usb_dev == NULL)
         upv_error_return(-11, "device context invalid");
@@ -85,6 +94,9 @@ int upv_usb_open_serial(libusb_context *usb_ctx, libusb_device_handle **usb_dev,
             {
                 // here we got the target device
                 libusb_free_device_list(devs,1);
+                if(match_ns){
+                    *match_ns = upv_now_ns() - t0;
+                }
 
                 struct libusb_config_descriptor *config0;
                 int cfg, cfg0, detach_errno = 0;
@@ -129,13 +141,7 @@ int upv_usb_open_serial(libusb_context *usb_ctx, libusb_device_handle **usb_dev,
                     }
                 }
 
-                if (libusb_control_transfer(*usb_dev, UPV_OUT_REQ,
-                    UPV_RESET, 0,
-                    0, NULL, 0, USB_WRITE_TIMEOUT) < 0){
-                    libusb_close(*usb_dev);
-                    *usb_dev = NULL;
-                    upv_error_return(-1, "Device reset failed");
-                }
+                // no reset here, the caller checks if the image is still loaded first
                 if(bcdUSB){
                     *bcdUSB = desc.bcdUSB;
                 }
@@ -214,6 +220,194 @@ int upv_write_data(libusb_device_handle *usb_dev, unsigned char *buf, int size,
 }
 
 
+#define UPLOAD_CHUNK_SIZE  (64*1024)
+#define UPLOAD_CHUNKS      4
+
+struct upv_upload_t{
+    unsigned char* buf;
+    int size;
+    int offset;                 // next byte to submit, under mutex
+    pthread_mutex_t mutex;
+    // the callback runs on the thread handling events, with a shared context
+    // that is a upv_manager thread and not the caller
+    std::atomic<int> pending;   // submitted and not completed
+    std::atomic<int> failed;
+};
+
+// submit the next chunk of the image in t, returns 0 when there is none or it failed
+static int upload_next(upv_upload_t* u, struct libusb_transfer* t)
+{
+    pthread_mutex_lock(&u->mutex);
+    if(u->failed || u->offset >= u->size){
+        pthread_mutex_unlock(&u->mutex);
+        return 0;
+    }
+    int n = u->size - u->offset;
+    if(n > UPLOAD_CHUNK_SIZE){
+        n = UPLOAD_CHUNK_SIZE;
+    }
+    t->buffer = u->buf + u->offset;
+    t->length = n;
+    u->pending++;
+    if(libusb_submit_transfer(t) != 0){
+        u->pending--;
+        u->failed = 1;
+        pthread_mutex_unlock(&u->mutex);
+        return 0;
+    }
+    u->offset += n;
+    pthread_mutex_unlock(&u->mutex);
+    return 1;
+}
+
+static void LIBUSB_CALL upload_callback(struct libusb_transfer* t)
+{
+    upv_upload_t* u = (upv_upload_t*)t->user_data;
+    if(t->status != LIBUSB_TRANSFER_COMPLETED || t->actual_length != t->length){
+        u->failed = 1;
+    }else{
+        upload_next(u, t);
+    }
+    u->pending--;
+}
+
+// same as upv_write_data with large chunks kept in flight, chunks are multiples
+// of the max packet size so the device sees the same byte stream
+int upv_write_data_async(libusb_context *usb_ctx, libusb_device_handle *usb_dev, unsigned char *buf, int size, const char** error_string)
+{
+    if (usb_dev == NULL)
+        upv_error_return(-666, "USB device unavailable");
+
+    struct libusb_transfer* t[UPLOAD_CHUNKS];
+    upv_upload_t u;
+    u.buf = buf;
+    u.size = size;
+    u.offset = 0;
+    pthread_mutex_init(&u.mutex, NULL);
+    u.pending = 0;
+    u.failed = 0;
+    for(int i=0;i<UPLOAD_CHUNKS;i++){
+        t[i] = libusb_alloc_transfer(0);
+        if(t[i] == NULL){
+            u.failed = 1;
+            continue;
+        }
+        libusb_fill_bulk_transfer(t[i], usb_dev, OUT_EP, buf, 0, upload_callback, &u, USB_WRITE_TIMEOUT);
+        upload_next(&u, t[i]);
+    }
+    while(u.pending > 0){
+        struct timeval tv = {0, 100000};
+        libusb_handle_events_timeout_completed(usb_ctx, &tv, NULL);
+    }
+    for(int i=0;i<UPLOAD_CHUNKS;i++){
+        libusb_free_transfer(t[i]);
+    }
+    pthread_mutex_destroy(&u.mutex);
+    if(u.failed)
+        upv_error_return(-1, "usb bulk write failed");
+    return size;
+}
+
+int upv_get_serial(libusb_device_handle *usb_dev, char* buf, int size)
+{
+    struct libusb_device_descriptor desc;
+    buf[0] = 0;
+    if (libusb_get_device_descriptor(libusb_get_device(usb_dev), &desc) < 0)
+        return -1;
+    if (libusb_get_string_descriptor_ascii(usb_dev, desc.iSerialNumber, (unsigned char *)buf, size) < 0)
+        return -1;
+    return 0;
+}
+
+// host side record of the image hash loaded into the device with this serial
+// Only kept in a per user directory: XDG_RUNTIME_DIR is private to the user,
+// a shared /tmp could hold a record or a link planted by another user.
+// The record can't tell when another program loaded a different image
+// without a power cycle, delete it or power cycle the analyzer then.
+static int load_cache_path(const char* serial, char* path, int size)
+{
+#ifdef _WIN32
+    const char* dir = getenv("TEMP");
+#else
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+#endif
+    if(dir == NULL || *dir == 0){
+        return -1;
+    }
+    char name[64];
+    int i = 0;
+    for(;serial[i] && i<(int)sizeof(name)-1;i++){
+        char c = serial[i];
+        name[i] = ((c>='0'&&c<='9') || (c>='a'&&c<='z') || (c>='A'&&c<='Z')) ? c : '_';
+    }
+    name[i] = 0;
+    snprintf(path, size, "%s/usbpv_%s.load", dir, name);
+    return 0;
+}
+
+int upv_load_cache_match(const char* serial, uint64_t hash)
+{
+    char path[512];
+    if(serial == NULL || *serial == 0 || load_cache_path(serial, path, sizeof(path)) < 0){
+        return 0;
+    }
+#ifdef _WIN32
+    FILE* f = fopen(path, "r");
+#else
+    // a regular file of our own, not followed through a link
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if(fd < 0){
+        return 0;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid()){
+        close(fd);
+        return 0;
+    }
+    FILE* f = fdopen(fd, "r");
+    if(f == NULL){
+        close(fd);
+    }
+#endif
+    if(f == NULL){
+        return 0;
+    }
+    unsigned long long v = 0;
+    int r = fscanf(f, "%llx", &v);
+    fclose(f);
+    return r == 1 && v == hash;
+}
+
+// hash 0 drops the record
+void upv_load_cache_store(const char* serial, uint64_t hash)
+{
+    char path[512];
+    if(serial == NULL || *serial == 0 || load_cache_path(serial, path, sizeof(path)) < 0){
+        return;
+    }
+    if(hash == 0){
+        remove(path);
+        return;
+    }
+#ifdef _WIN32
+    FILE* f = fopen(path, "w");
+#else
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+    if(fd < 0){
+        return;
+    }
+    FILE* f = fdopen(fd, "w");
+    if(f == NULL){
+        close(fd);
+    }
+#endif
+    if(f){
+        fprintf(f, "%016llx\n", (unsigned long long)hash);
+        fclose(f);
+    }
+}
+
+
 int upv_read_data(libusb_device_handle *usb_dev, unsigned char* buf, int size, const char** error_string)
 {
     int actual_length;
@@ -258,3 +452,111 @@ int upv_write_config_data(libusb_device_handle *usb_dev, uint8_t id, uint8_t val
     }
     return 0;
 }
+
+#define CONFIG_BATCH_TIMEOUT 200
+
+struct upv_config_batch_t{
+    uint8_t* echo;
+    int echo_len;               // read after pending drops to 0
+    int echo_size;
+    // changed on the thread handling events, a upv_manager thread with a shared context
+    std::atomic<int> pending;   // submitted and not completed
+    std::atomic<int> failed;
+};
+
+static void LIBUSB_CALL config_write_callback(struct libusb_transfer* t)
+{
+    upv_config_batch_t* b = (upv_config_batch_t*)t->user_data;
+    if(t->status != LIBUSB_TRANSFER_COMPLETED || t->actual_length != t->length){
+        b->failed = 1;
+    }
+    b->pending--;
+}
+
+static void LIBUSB_CALL config_read_callback(struct libusb_transfer* t)
+{
+    upv_config_batch_t* b = (upv_config_batch_t*)t->user_data;
+    if(t->status == LIBUSB_TRANSFER_COMPLETED){
+        int n = t->actual_length;
+        if(n > b->echo_size - b->echo_len){
+            n = b->echo_size - b->echo_len;
+        }
+        memcpy(b->echo + b->echo_len, t->buffer, n);
+        b->echo_len += n;
+        // echoes may come back one packet per register
+        if(b->echo_len < b->echo_size && !b->failed){
+            if(libusb_submit_transfer(t) == 0){
+                return;
+            }
+            b->failed = 1;
+        }
+    }else{
+        b->failed = 1;
+    }
+    b->pending--;
+}
+
+// write all registers in one bulk transfer and check the echoes in one pass
+// returns 0 on success, -1 on transfer error, -2 on echo mismatch
+int upv_write_config_batch(libusb_context *usb_ctx, libusb_device_handle *usb_dev, const uint8_t* id, const uint8_t* val, int count)
+{
+    uint8_t buf_in[64*4];
+    uint8_t buf_out[64*4];
+    uint8_t buf_rd[512];
+    if(usb_dev == NULL || count <= 0 || count > 64){
+        return -1;
+    }
+    for(int i=0;i<count;i++){
+        buf_in[i*4] = 0x55;
+        buf_in[i*4+1] = id[i];
+        buf_in[i*4+2] = val[i];
+        buf_in[i*4+3] = (uint8_t)0x55+id[i]+val[i];
+    }
+
+    upv_config_batch_t b;
+    b.echo = buf_out;
+    b.echo_len = 0;
+    b.echo_size = count*4;
+    b.pending = 0;
+    b.failed = 0;
+    struct libusb_transfer* rd = libusb_alloc_transfer(0);
+    struct libusb_transfer* wr = libusb_alloc_transfer(0);
+    if(rd == NULL || wr == NULL){
+        libusb_free_transfer(rd);
+        libusb_free_transfer(wr);
+        return -1;
+    }
+    // read is queued first so the echoes are taken as soon as the device has them
+    libusb_fill_bulk_transfer(rd, usb_dev, IN_EP, buf_rd, sizeof(buf_rd), config_read_callback, &b, CONFIG_BATCH_TIMEOUT);
+    libusb_fill_bulk_transfer(wr, usb_dev, OUT_EP, buf_in, count*4, config_write_callback, &b, CONFIG_BATCH_TIMEOUT);
+    // counted first, with a manager the callback may run before submit returns
+    b.pending++;
+    if(libusb_submit_transfer(rd) == 0){
+        b.pending++;
+        if(libusb_submit_transfer(wr) != 0){
+            b.pending--;
+            b.failed = 1;
+            libusb_cancel_transfer(rd);
+        }
+    }else{
+        b.pending--;
+        b.failed = 1;
+    }
+    while(b.pending > 0){
+        // the transfers reference b, every one has to complete or time out
+        struct timeval tv = {0, 100000};
+        libusb_handle_events_timeout_completed(usb_ctx, &tv, NULL);
+    }
+    libusb_free_transfer(rd);
+    libusb_free_transfer(wr);
+
+    if(b.failed || b.echo_len < count*4){
+        UPV_LOG("Batched config got %d of %d echo bytes\n", b.echo_len, count*4);
+        return -1;
+    }
+    if(memcmp(buf_in, buf_out, count*4) != 0){
+        UPV_LOG("Batched config, data mismatch\n");
+        return -2;
+    }
+    return 0;
+}